@@ -2,13 +2,13 @@
 #include "die.h"
 #include "hexdump.h"
 
+#include <algorithm>
 #include <cerrno>
 
-#include <fcntl.h>
 #include <linux/mei.h>
 #include <linux/mei_uuid.h>
-#include <sys/ioctl.h>
-#include <unistd.h>
+#include <poll.h>
+#include <sys/epoll.h>
 
 #include <absl/strings/str_format.h>
 
@@ -22,109 +22,414 @@
 namespace amt {
 
 namespace {
-template <typename ReqT, typename RspT>
-bool RunExchange(const ReqT &req, RspT &rsp, int fd, uint64_t max_msg_length) {
-  static_assert(std::is_pod_v<ReqT>);
-  size_t write_len = sizeof(ReqT);
-  die_if(write_len > max_msg_length, "write message too large");
-  auto recv_buf = std::make_unique<uint8_t[]>(max_msg_length + 1);
+constexpr uint32_t kResponseBit = 1u << 23;
+} // namespace
+
+AmtHostInterface::AmtHostInterface(std::unique_ptr<MeiTransport> transport,
+                                   absl::Duration timeout, size_t pipeline_depth)
+    : transport_(std::move(transport)), timeout_(timeout),
+      pipeline_depth_(pipeline_depth) {
+  die_if(pipeline_depth_ == 0, "pipeline depth must be positive");
+  die_if(!Connect(), "can't connect to AMTHI");
+}
+
+AmtHostInterface::~AmtHostInterface() { transport_->Close(); }
 
-  // std::printf("AmtHostInterface write:\n %s\n", Hexdump(write_data,
-  // write_len).c_str());
-  ssize_t written = write(fd, &req, write_len);
-  die_if(written < 0, "write errno=%u", errno);
-  die_if(static_cast<size_t>(written) != write_len, "write error");
+bool AmtHostInterface::Connect() {
+  MeiClientProperties props;
+  if (!transport_->Connect(MEI_AMTHI_GUID, props)) {
+    absl::PrintF("Failed to connect to AMTHI\n");
+    return false;
+  }
+  printf("Opened mei fd %d\n", transport_->fd());
 
-  ssize_t r = read(fd, recv_buf.get(), max_msg_length + 1);
-  die_if(r <= 0, "read errno=%u", errno);
-  // std::printf("AmtHostInterface read:\n %s\n", Hexdump(buffer_.get(), r).c_str());
-  die_if(static_cast<size_t>(r) > max_msg_length, "reply too large:\n%s",
-         Hexdump(recv_buf.get(), r));
+  absl::PrintF("Connected to AMTHI max_msg_len=%u protocol_ver=%u\n",
+               props.max_msg_length, props.protocol_version);
 
-  bool success = rsp.Deserialize(absl::MakeSpan(recv_buf.get(), r));
-  if (!success) {
-    absl::PrintF("Failed to parse reply:\n%s\n", Hexdump(recv_buf.get(), r));
+  uint64_t max_msg_length = props.max_msg_length;
+  if (recv_buf_ == nullptr || max_msg_length > max_msg_length_) {
+    recv_buf_ = std::make_unique<uint8_t[]>(max_msg_length + 1);
   }
+  max_msg_length_ = max_msg_length;
+  connected_ = true;
+  reconnect_at_ = absl::InfiniteFuture();
+  reconnect_backoff_ = kReconnectBackoff;
+  return true;
+}
+
+//
+// Synchronous APIs
+//
 
+template <typename RspT, typename ReqT>
+bool AmtHostInterface::RunExchange(const ReqT &req, RspT &rsp) {
+  bool success = false;
+  SubmitTyped<RspT>(req, [&](std::optional<RspT> r) {
+    if (r.has_value()) {
+      rsp = std::move(*r);
+      success = true;
+    }
+  });
+  Wait();
   return success;
 }
-} // namespace
 
-AmtHostInterface::AmtHostInterface(std::string mei_dev) {
-  fd_ = open(mei_dev.c_str(), O_RDWR);
-  printf("Opened mei fd %d\n", fd_);
-  die_if(fd_ < 0, "mei fd error");
+std::string AmtHostInterface::CustomCommand(absl::Span<uint8_t> req) {
+  std::optional<std::string> rsp;
+  CustomCommandAsync(req, [&](std::optional<std::string> r) { rsp = std::move(r); });
+  Wait();
+  die_if(!rsp.has_value(), "CustomCommand failed");
+  return *rsp;
+}
 
-  mei_connect_client_data data;
-  data.in_client_uuid = MEI_AMTHI_GUID;
+bool AmtHostInterface::GetLocalSystemAccount(GetLocalSystemAccountResponse &rsp) {
+  GetLocalSystemAccountRequest req{};
+  req.header.Init(kAhiGetLocalSystemAccount, 40);
+  return RunExchange(req, rsp);
+}
 
-  int ret = ioctl(fd_, IOCTL_MEI_CONNECT_CLIENT, &data);
-  die_if(ret < 0, "ioctl error %d\n", ret);
+bool AmtHostInterface::EnumerateHashHandles(EnumerateHashHandlesResponse &rsp) {
+  AhiHeader req{};
+  req.Init(kAhiEnumerateHashHandles, 0);
+  return RunExchange(req, rsp);
+}
 
-  absl::PrintF("Connected to AMTHI max_msg_len=%u protocol_ver=%u\n",
-               data.out_client_properties.max_msg_length,
-               data.out_client_properties.protocol_version);
+bool AmtHostInterface::GetCertificateHashEntry(GetCertificateHashEntryResponse &rsp,
+                                               uint32_t handle) {
+  GetCertificateHashEntryRequest req{};
+  req.header.Init(kAhiGetCertificateHashEntry, 4);
+  req.handle = handle;
+  return RunExchange(req, rsp);
+}
 
-  max_msg_length_ = data.out_client_properties.max_msg_length;
+bool AmtHostInterface::GetUuid(GetUuidResponse &rsp) {
+  AhiHeader req{};
+  req.Init(kAhiGetUuid, 0);
+  return RunExchange(req, rsp);
 }
 
-AmtHostInterface::~AmtHostInterface() {
-  if (fd_ >= 0) {
-    close(fd_);
-    fd_ = -1;
+//
+// Asynchronous APIs
+//
+
+void AmtHostInterface::GetLocalSystemAccountAsync(
+    Completion<GetLocalSystemAccountResponse> done) {
+  GetLocalSystemAccountRequest req{};
+  req.header.Init(kAhiGetLocalSystemAccount, 40);
+  SubmitTyped(req, std::move(done));
+}
+
+void AmtHostInterface::EnumerateHashHandlesAsync(
+    Completion<EnumerateHashHandlesResponse> done) {
+  AhiHeader req{};
+  req.Init(kAhiEnumerateHashHandles, 0);
+  SubmitTyped(req, std::move(done));
+}
+
+void AmtHostInterface::GetCertificateHashEntryAsync(
+    uint32_t handle, Completion<GetCertificateHashEntryResponse> done) {
+  GetCertificateHashEntryRequest req{};
+  req.header.Init(kAhiGetCertificateHashEntry, 4);
+  req.handle = handle;
+  SubmitTyped(req, std::move(done));
+}
+
+void AmtHostInterface::GetUuidAsync(Completion<GetUuidResponse> done) {
+  AhiHeader req{};
+  req.Init(kAhiGetUuid, 0);
+  SubmitTyped(req, std::move(done));
+}
+
+void AmtHostInterface::CustomCommandAsync(absl::Span<const uint8_t> req,
+                                          Completion<std::string> done) {
+  Submit(std::string(reinterpret_cast<const char *>(req.data()), req.size()),
+         [done = std::move(done)](absl::Span<uint8_t> *rsp) {
+           if (rsp == nullptr) {
+             done(std::nullopt);
+             return;
+           }
+           done(std::string(reinterpret_cast<const char *>(rsp->data()), rsp->size()));
+         });
+}
+
+void AmtHostInterface::GetCertificateHashEntriesAsync(
+    const std::vector<uint32_t> &handles,
+    std::function<void(std::vector<std::optional<GetCertificateHashEntryResponse>>)>
+        done) {
+  typedef std::vector<std::optional<GetCertificateHashEntryResponse>> Results;
+  if (handles.empty()) {
+    done(Results{});
+    return;
+  }
+
+  struct Batch {
+    Results results;
+    size_t remaining;
+    std::function<void(Results)> done;
+  };
+  auto batch = std::make_shared<Batch>();
+  batch->results.resize(handles.size());
+  batch->remaining = handles.size();
+  batch->done = std::move(done);
+
+  for (size_t i = 0; i < handles.size(); i++) {
+    GetCertificateHashEntryAsync(
+        handles[i], [batch, i](std::optional<GetCertificateHashEntryResponse> rsp) {
+          batch->results[i] = std::move(rsp);
+          if (--batch->remaining == 0) {
+            batch->done(std::move(batch->results));
+          }
+        });
   }
 }
 
-std::string AmtHostInterface::CustomCommand(absl::Span<uint8_t> req) {
-  size_t write_len = req.size();
-  die_if(write_len > max_msg_length_, "write message too large");
-  auto recv_buf = std::make_unique<uint8_t[]>(max_msg_length_ + 1);
+template <typename RspT, typename ReqT>
+void AmtHostInterface::SubmitTyped(const ReqT &req, Completion<RspT> done) {
+  static_assert(std::is_pod_v<ReqT>);
+  Submit(std::string(reinterpret_cast<const char *>(&req), sizeof(ReqT)),
+         [done = std::move(done)](absl::Span<uint8_t> *data) {
+           if (data == nullptr) {
+             done(std::nullopt);
+             return;
+           }
+           RspT rsp{};
+           if (!rsp.Deserialize(*data)) {
+             absl::PrintF("Failed to parse reply:\n%s\n",
+                          Hexdump(data->data(), data->size()));
+             done(std::nullopt);
+             return;
+           }
+           done(std::move(rsp));
+         });
+}
+
+void AmtHostInterface::Submit(std::string req,
+                              std::function<void(absl::Span<uint8_t> *)> done) {
+  die_if(req.size() > max_msg_length_, "write message too large");
+  die_if(req.size() < sizeof(AhiHeader), "request too short");
+
+  AhiHeader header;
+  memcpy(&header, req.data(), sizeof(header));
+  pending_.push_back(Command{
+      .req = std::move(req),
+      .rsp_cmd = header.cmd | kResponseBit,
+      .deadline = absl::Now() + timeout_,
+      .done = std::move(done),
+  });
+}
 
-  ssize_t written = write(fd_, req.data(), write_len);
-  die_if(written < 0, "write errno=%u", errno);
-  die_if(static_cast<size_t>(written) != write_len, "write error");
+//
+// Event loop
+//
 
-  ssize_t r = read(fd_, recv_buf.get(), max_msg_length_ + 1);
-  die_if(r <= 0, "read errno=%u", errno);
-  die_if(static_cast<size_t>(r) > max_msg_length_, "reply too large:\n%s",
-         Hexdump(recv_buf.get(), r));
+uint32_t AmtHostInterface::events() const {
+  uint32_t ev = 0;
+  if (!connected_) {
+    return ev;
+  }
+  if (!in_flight_.empty()) {
+    ev |= EPOLLIN;
+  }
+  if (!pending_.empty() && in_flight_.size() < pipeline_depth_) {
+    ev |= EPOLLOUT;
+  }
+  return ev;
+}
 
-  return std::string(reinterpret_cast<const char *>(recv_buf.get()), r);
+absl::Time AmtHostInterface::NextDeadline() const {
+  absl::Time ret = reconnect_at_;
+  for (const Command &cmd : pending_) {
+    ret = std::min(ret, cmd.deadline);
+  }
+  for (const Command &cmd : in_flight_) {
+    ret = std::min(ret, cmd.deadline);
+  }
+  return ret;
 }
 
-bool AmtHostInterface::GetLocalSystemAccount(GetLocalSystemAccountResponse &rsp) {
-  struct {
-    AhiHeader header;
-    uint8_t reserved[40];
-  } __attribute__((packed)) req{};
-  static_assert(sizeof(req) == 12 + 40);
-  req.header.Init(0x04000067, 40);
-  return RunExchange(req, rsp, fd_, max_msg_length_);
+void AmtHostInterface::HandleEvents() {
+  if (!connected_) {
+    if (absl::Now() >= reconnect_at_ && !Connect()) {
+      ScheduleReconnect();
+    }
+    if (!connected_) {
+      FailAll();
+      return;
+    }
+  }
+  bool progress = true;
+  while (progress) {
+    progress = false;
+    while (!in_flight_.empty() && ReadOne()) {
+      progress = true;
+    }
+    while (!pending_.empty() && in_flight_.size() < pipeline_depth_ && WriteOne()) {
+      progress = true;
+    }
+  }
+  ExpireCommands(absl::Now());
 }
 
-bool AmtHostInterface::EnumerateHashHandles(EnumerateHashHandlesResponse &rsp) {
-  AhiHeader req{};
-  req.Init(0x400002c, 0);
-  return RunExchange(req, rsp, fd_, max_msg_length_);
+void AmtHostInterface::Wait() {
+  while (outstanding() > 0) {
+    HandleEvents();
+    if (outstanding() == 0) {
+      break;
+    }
+
+    pollfd pfd{.fd = transport_->fd(), .events = 0, .revents = 0};
+    uint32_t ev = events();
+    if (ev & EPOLLIN) {
+      pfd.events |= POLLIN;
+    }
+    if (ev & EPOLLOUT) {
+      pfd.events |= POLLOUT;
+    }
+    absl::Duration wait = NextDeadline() - absl::Now();
+    int timeout_ms = static_cast<int>(
+        absl::ToInt64Milliseconds(absl::Ceil(wait, absl::Milliseconds(1))));
+    if (timeout_ms < 0) {
+      timeout_ms = 0;
+    }
+    int r = poll(&pfd, 1, timeout_ms);
+    die_if(r < 0 && errno != EINTR, "poll errno=%d", errno);
+  }
 }
 
-bool AmtHostInterface::GetCertificateHashEntry(GetCertificateHashEntryResponse &rsp,
-                                               uint32_t handle) {
-  struct {
-    AhiHeader header;
-    uint32_t handle;
-  } __attribute__((packed)) req;
-  static_assert(sizeof(req) == 12 + 4);
+bool AmtHostInterface::WriteOne() {
+  Command &cmd = pending_.front();
+  // std::printf("AmtHostInterface write:\n %s\n", Hexdump(cmd.req.data(),
+  // cmd.req.size()).c_str());
+  ssize_t written = transport_->Write(
+      absl::MakeConstSpan(reinterpret_cast<const uint8_t *>(cmd.req.data()),
+                          cmd.req.size()));
+  if (written < 0 && errno == EAGAIN) {
+    return false;
+  }
+  if (written < 0 || static_cast<size_t>(written) != cmd.req.size()) {
+    absl::PrintF("AHI write error ret=%d errno=%d\n", written, errno);
+    Command failed = std::move(cmd);
+    pending_.pop_front();
+    failed.done(nullptr);
+    return true;
+  }
+  in_flight_.push_back(std::move(cmd));
+  pending_.pop_front();
+  return true;
+}
 
-  req.header.Init(0x0400002D, 4);
-  req.handle = handle;
-  return RunExchange(req, rsp, fd_, max_msg_length_);
+bool AmtHostInterface::ReadOne() {
+  ssize_t r =
+      transport_->Read(absl::MakeSpan(recv_buf_.get(), max_msg_length_ + 1));
+  if (r < 0 && errno == EAGAIN) {
+    return false;
+  }
+  if (r <= 0) {
+    absl::PrintF("AHI read error ret=%d errno=%d\n", r, errno);
+    Reset();
+    return true;
+  }
+  // std::printf("AmtHostInterface read:\n %s\n", Hexdump(recv_buf_.get(), r).c_str());
+
+  Command cmd = std::move(in_flight_.front());
+  in_flight_.pop_front();
+  auto data = absl::MakeSpan(recv_buf_.get(), r);
+
+  if (static_cast<size_t>(r) > max_msg_length_) {
+    absl::PrintF("reply too large:\n%s\n", Hexdump(data.data(), data.size()));
+    cmd.done(nullptr);
+    return true;
+  }
+
+  AhiHeader header{};
+  if (data.size() >= sizeof(header)) {
+    memcpy(&header, data.data(), sizeof(header));
+  }
+  if (header.cmd != cmd.rsp_cmd) {
+    absl::PrintF("unexpected reply for %#010x:\n%s\n", cmd.rsp_cmd,
+                 Hexdump(data.data(), data.size()));
+    cmd.done(nullptr);
+    return true;
+  }
+  cmd.done(&data);
+  return true;
 }
 
-bool AmtHostInterface::GetUuid(GetUuidResponse &rsp) {
-  AhiHeader req{};
-  req.Init(0x0400005C, 0);
-  return RunExchange(req, rsp, fd_, max_msg_length_);
+void AmtHostInterface::ExpireCommands(absl::Time now) {
+  bool in_flight_expired = false;
+  for (const Command &cmd : in_flight_) {
+    if (cmd.deadline <= now) {
+      in_flight_expired = true;
+    }
+  }
+  if (in_flight_expired) {
+    absl::PrintF("AHI command timed out, reconnecting\n");
+    Reset();
+  }
+
+  std::deque<Command> expired;
+  for (auto it = pending_.begin(); it != pending_.end();) {
+    if (it->deadline <= now) {
+      expired.push_back(std::move(*it));
+      it = pending_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  for (Command &cmd : expired) {
+    cmd.done(nullptr);
+  }
+}
+
+void AmtHostInterface::Reset() {
+  std::deque<Command> in_flight;
+  in_flight.swap(in_flight_);
+
+  transport_->Close();
+  connected_ = false;
+  if (!Connect()) {
+    ScheduleReconnect();
+    for (auto it = in_flight.rbegin(); it != in_flight.rend(); ++it) {
+      pending_.push_front(std::move(*it));
+    }
+    FailAll();
+    return;
+  }
+
+  // Commands still in time are sent again on the new connection.
+  absl::Time now = absl::Now();
+  std::deque<Command> failed;
+  while (!in_flight.empty()) {
+    Command cmd = std::move(in_flight.back());
+    in_flight.pop_back();
+    if (cmd.deadline > now) {
+      pending_.push_front(std::move(cmd));
+    } else {
+      failed.push_back(std::move(cmd));
+    }
+  }
+  for (Command &cmd : failed) {
+    cmd.done(nullptr);
+  }
+}
+
+void AmtHostInterface::ScheduleReconnect() {
+  absl::PrintF("Reconnecting to AMTHI in %s\n", absl::FormatDuration(reconnect_backoff_));
+  reconnect_at_ = absl::Now() + reconnect_backoff_;
+  reconnect_backoff_ = std::min(reconnect_backoff_ * 2, kReconnectBackoffMax);
+}
+
+void AmtHostInterface::FailAll() {
+  // Completions may queue new commands, they fail on the next call.
+  std::deque<Command> failed;
+  failed.swap(in_flight_);
+  while (!pending_.empty()) {
+    failed.push_back(std::move(pending_.front()));
+    pending_.pop_front();
+  }
+  for (Command &cmd : failed) {
+    cmd.done(nullptr);
+  }
 }
 
 } // namespace amt
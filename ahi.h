@@ -2,13 +2,45 @@
 #define __AHI_H__
 
 #include "ahi_messages.h"
+#include "mei_transport.h"
 
+#include <deque>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <vector>
+
+#include <absl/time/clock.h>
+#include <absl/time/time.h>
 #include <absl/types/span.h>
 
 namespace amt {
+
+// class AmtHostInterface
+// Talks to the AMTHI client over a MEI transport.
+// Commands are queued and up to pipeline_depth of them are written to the
+// ME before their replies are read. Each command has a deadline, a command
+// which is not answered in time fails, and the MEI connection is
+// re-established to drop the late reply. If that fails, e.g. while the ME
+// is resetting, every queued command fails and HandleEvents() retries the
+// connection with backoff, failing the commands queued meanwhile.
+//
+// The *Async() functions only queue the command. The caller either drives
+// the queue from its own event loop with fd() / events() / HandleEvents(),
+// or blocks in Wait(). The completion receives nullopt on failure.
+//
+// The synchronous functions queue the command and Wait() for it.
 class AmtHostInterface {
 public:
-  explicit AmtHostInterface(std::string mei_dev);
+  template <typename RspT> using Completion = std::function<void(std::optional<RspT>)>;
+
+  // The mei driver queues writes until the AMTHI client can take them, and
+  // AMTHI answers in order, so a few commands can be outstanding.
+  static constexpr size_t kDefaultPipelineDepth = 4;
+
+  explicit AmtHostInterface(std::unique_ptr<MeiTransport> transport,
+                            absl::Duration timeout = absl::Seconds(5),
+                            size_t pipeline_depth = kDefaultPipelineDepth);
   ~AmtHostInterface();
 
   // Return: true if success
@@ -20,9 +52,83 @@ public:
   // Send request, then return raw response.
   std::string CustomCommand(absl::Span<uint8_t> req);
 
+  void GetLocalSystemAccountAsync(Completion<GetLocalSystemAccountResponse> done);
+  void EnumerateHashHandlesAsync(Completion<EnumerateHashHandlesResponse> done);
+  void GetCertificateHashEntryAsync(uint32_t handle,
+                                    Completion<GetCertificateHashEntryResponse> done);
+  void GetUuidAsync(Completion<GetUuidResponse> done);
+  void CustomCommandAsync(absl::Span<const uint8_t> req, Completion<std::string> done);
+
+  // Queue one GetCertificateHashEntry per handle, they are pipelined.
+  // done receives the responses in the order of handles.
+  void GetCertificateHashEntriesAsync(
+      const std::vector<uint32_t> &handles,
+      std::function<void(std::vector<std::optional<GetCertificateHashEntryResponse>>)>
+          done);
+
+  // Event loop integration.
+  int fd() const { return transport_->fd(); }
+  // EPOLLIN / EPOLLOUT the caller should wait for.
+  uint32_t events() const;
+  // Earliest command deadline or reconnect attempt, InfiniteFuture() if
+  // idle.
+  absl::Time NextDeadline() const;
+  // Write queued commands, read replies and expire commands. Never blocks.
+  void HandleEvents();
+
+  // Block until all queued commands are completed.
+  void Wait();
+
+  size_t outstanding() const { return pending_.size() + in_flight_.size(); }
+  // False while the MEI connection is being retried, fd() is -1 then.
+  bool connected() const { return connected_; }
+
 private:
-  uint64_t max_msg_length_;
-  int fd_ = -1;
+  struct Command {
+    std::string req;
+    // Reply header command, for sanity check.
+    uint32_t rsp_cmd;
+    absl::Time deadline;
+    // Receives nullptr on failure.
+    std::function<void(absl::Span<uint8_t> *)> done;
+  };
+
+  static constexpr absl::Duration kReconnectBackoff = absl::Milliseconds(100);
+  static constexpr absl::Duration kReconnectBackoffMax = absl::Seconds(10);
+
+  // Returns false if the AMTHI client is not available.
+  bool Connect();
+  void Submit(std::string req, std::function<void(absl::Span<uint8_t> *)> done);
+  template <typename RspT, typename ReqT>
+  void SubmitTyped(const ReqT &req, Completion<RspT> done);
+  template <typename RspT, typename ReqT> bool RunExchange(const ReqT &req, RspT &rsp);
+
+  // Returns false if the fd would block.
+  bool WriteOne();
+  bool ReadOne();
+  void ExpireCommands(absl::Time now);
+  // Fail every in-flight command and reconnect so late replies are dropped.
+  void Reset();
+  void ScheduleReconnect();
+  // Complete every queued command with nullptr.
+  void FailAll();
+
+  std::unique_ptr<MeiTransport> transport_;
+  absl::Duration timeout_;
+  size_t pipeline_depth_;
+
+  bool connected_ = false;
+  absl::Time reconnect_at_ = absl::InfiniteFuture();
+  absl::Duration reconnect_backoff_ = kReconnectBackoff;
+
+  uint64_t max_msg_length_ = 0;
+  // Reused for every reply, max_msg_length_ + 1 bytes.
+  std::unique_ptr<uint8_t[]> recv_buf_;
+
+  // Not written yet.
+  std::deque<Command> pending_;
+  // Written, waiting for reply. The ME answers in order.
+  std::deque<Command> in_flight_;
 };
 
 } // namespace amt
@@ -0,0 +1,354 @@
+#include "ahi_cache.h"
+#include "die.h"
+
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <absl/strings/ascii.h>
+#include <absl/strings/str_format.h>
+#include <absl/time/clock.h>
+
+namespace amt {
+
+namespace {
+
+constexpr char kMagic[8] = {'A', 'H', 'I', 'C', 'A', 'C', 'H', 'E'};
+constexpr uint32_t kVersion = 1;
+
+struct FileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t entry_count;
+};
+static_assert(sizeof(FileHeader) == 16);
+
+struct EntryHeader {
+  uint32_t cmd;
+  uint32_t handle;
+  uint64_t fw_id;
+  int64_t expires_unix_ms;
+  uint32_t len;
+  uint32_t reserved;
+};
+static_assert(sizeof(EntryHeader) == 32);
+
+size_t Pad8(size_t len) { return (len + 7) & ~size_t{7}; }
+
+// FNV-1a, stable across runs unlike absl::Hash.
+uint64_t Fnv1a(absl::string_view data) {
+  uint64_t h = 0xcbf29ce484222325ull;
+  for (char c : data) {
+    h ^= static_cast<uint8_t>(c);
+    h *= 0x100000001b3ull;
+  }
+  return h;
+}
+
+std::string SimpleRequest(uint32_t cmd) {
+  AhiHeader req{};
+  req.Init(cmd, 0);
+  return std::string(reinterpret_cast<const char *>(&req), sizeof(req));
+}
+
+} // namespace
+
+AhiCache::AhiCache(std::string path, absl::Duration ttl, std::string fw_identity,
+                   std::function<AmtHostInterface &()> get_ahi)
+    : path_(std::move(path)), ttl_(ttl), enabled_(!fw_identity.empty()),
+      fw_id_(Fnv1a(fw_identity)), get_ahi_(std::move(get_ahi)) {
+  if (!enabled_) {
+    absl::PrintF("No firmware identity, not using the cache\n");
+    return;
+  }
+  if (!path_.empty()) {
+    Load();
+  }
+}
+
+AhiCache::~AhiCache() {
+  Save();
+  Unmap();
+}
+
+std::string AhiCache::FirmwareIdentity(const std::string &mei_dev) {
+  std::string name = mei_dev.substr(mei_dev.find_last_of('/') + 1);
+  std::ifstream f("/sys/class/mei/" + name + "/fw_ver");
+  if (!f) {
+    absl::PrintF("Can't read firmware version of %s\n", mei_dev);
+    return "";
+  }
+  std::stringstream ss;
+  ss << f.rdbuf();
+  std::string ret(absl::StripAsciiWhitespace(ss.str()));
+  if (ret.empty()) {
+    absl::PrintF("Empty firmware version of %s\n", mei_dev);
+  }
+  return ret;
+}
+
+//
+// Typed lookups
+//
+
+template <typename RspT>
+bool AhiCache::Get(Key key, const std::string &req, RspT &rsp) {
+  std::string data;
+  if (auto cached = Lookup(key); cached.has_value()) {
+    data = std::string(*cached);
+  } else if (auto fetched = Fetch(key, req); fetched.has_value()) {
+    data = std::move(*fetched);
+  } else {
+    return false;
+  }
+  return rsp.Deserialize(
+      absl::MakeSpan(reinterpret_cast<uint8_t *>(data.data()), data.size()));
+}
+
+bool AhiCache::GetUuid(GetUuidResponse &rsp) {
+  return Get(Key{kAhiGetUuid, 0}, SimpleRequest(kAhiGetUuid), rsp);
+}
+
+bool AhiCache::EnumerateHashHandles(EnumerateHashHandlesResponse &rsp) {
+  return Get(Key{kAhiEnumerateHashHandles, 0}, SimpleRequest(kAhiEnumerateHashHandles),
+             rsp);
+}
+
+bool AhiCache::GetCertificateHashEntry(GetCertificateHashEntryResponse &rsp,
+                                       uint32_t handle) {
+  auto ret = GetCertificateHashEntries({handle});
+  if (!ret[0].has_value()) {
+    return false;
+  }
+  rsp = std::move(*ret[0]);
+  return true;
+}
+
+std::vector<std::optional<GetCertificateHashEntryResponse>>
+AhiCache::GetCertificateHashEntries(const std::vector<uint32_t> &handles) {
+  std::vector<std::optional<std::string>> raw(handles.size());
+  std::vector<size_t> misses;
+  for (size_t i = 0; i < handles.size(); i++) {
+    if (auto cached = Lookup(Key{kAhiGetCertificateHashEntry, handles[i]})) {
+      raw[i] = std::string(*cached);
+    } else {
+      misses.push_back(i);
+    }
+  }
+
+  if (!misses.empty()) {
+    AmtHostInterface &ahi = get_ahi_();
+    for (size_t i : misses) {
+      GetCertificateHashEntryRequest req{};
+      req.header.Init(kAhiGetCertificateHashEntry, 4);
+      req.handle = handles[i];
+      ahi.CustomCommandAsync(
+          absl::MakeConstSpan(reinterpret_cast<const uint8_t *>(&req), sizeof(req)),
+          [&raw, i](std::optional<std::string> rsp) { raw[i] = std::move(rsp); });
+    }
+    ahi.Wait();
+  }
+
+  std::vector<std::optional<GetCertificateHashEntryResponse>> ret(handles.size());
+  for (size_t i = 0; i < handles.size(); i++) {
+    if (!raw[i].has_value()) {
+      continue;
+    }
+    GetCertificateHashEntryResponse rsp{};
+    std::string &data = *raw[i];
+    if (!rsp.Deserialize(
+            absl::MakeSpan(reinterpret_cast<uint8_t *>(data.data()), data.size()))) {
+      continue;
+    }
+    if (rsp.amt_status == 0) {
+      Store(Key{kAhiGetCertificateHashEntry, handles[i]}, std::move(data));
+    }
+    ret[i] = std::move(rsp);
+  }
+  return ret;
+}
+
+std::optional<std::string> AhiCache::SimpleCommand(uint32_t cmd) {
+  Key key{cmd, 0};
+  if (auto cached = Lookup(key)) {
+    return std::string(*cached);
+  }
+  return Fetch(key, SimpleRequest(cmd));
+}
+
+//
+// Entries
+//
+
+std::optional<absl::string_view> AhiCache::Lookup(Key key) {
+  auto it = entries_.find(key);
+  if (it == entries_.end() ||
+      it->second.expires_unix_ms <= absl::ToUnixMillis(absl::Now())) {
+    stats_.misses++;
+    return std::nullopt;
+  }
+  stats_.hits++;
+  return it->second.data;
+}
+
+void AhiCache::Store(Key key, std::string data) {
+  if (!enabled_) {
+    return;
+  }
+  Entry &entry = entries_[key];
+  entry.expires_unix_ms = absl::ToUnixMillis(absl::Now() + ttl_);
+  entry.owned = std::move(data);
+  entry.data = entry.owned;
+  dirty_ = true;
+}
+
+std::optional<std::string> AhiCache::Fetch(Key key, std::string req) {
+  std::optional<std::string> rsp;
+  AmtHostInterface &ahi = get_ahi_();
+  ahi.CustomCommandAsync(
+      absl::MakeConstSpan(reinterpret_cast<const uint8_t *>(req.data()), req.size()),
+      [&rsp](std::optional<std::string> r) { rsp = std::move(r); });
+  ahi.Wait();
+  if (!rsp.has_value()) {
+    return std::nullopt;
+  }
+
+  if (AhiReplySucceeded(*rsp)) {
+    Store(key, *rsp);
+  }
+  return rsp;
+}
+
+//
+// File I/O
+//
+
+void AhiCache::Load() {
+  int fd = open(path_.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return;
+  }
+  struct stat st {};
+  if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(FileHeader)) {
+    close(fd);
+    return;
+  }
+  void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    absl::PrintF("Failed to map cache %s errno=%d\n", path_, errno);
+    return;
+  }
+  map_ = map;
+  map_len_ = st.st_size;
+
+  const char *base = static_cast<const char *>(map_);
+  FileHeader header;
+  memcpy(&header, base, sizeof(header));
+  if (memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 || header.version != kVersion) {
+    absl::PrintF("Ignoring invalid cache %s\n", path_);
+    return;
+  }
+
+  size_t off = sizeof(FileHeader);
+  for (uint32_t i = 0; i < header.entry_count; i++) {
+    EntryHeader eh;
+    if (off + sizeof(eh) > map_len_) {
+      break;
+    }
+    memcpy(&eh, base + off, sizeof(eh));
+    off += sizeof(eh);
+    if (eh.len > map_len_ - off) {
+      break;
+    }
+    // Entries of other firmwares are dropped.
+    if (eh.fw_id == fw_id_) {
+      Entry &entry = entries_[Key{eh.cmd, eh.handle}];
+      entry.expires_unix_ms = eh.expires_unix_ms;
+      entry.data = absl::string_view(base + off, eh.len);
+    } else {
+      dirty_ = true;
+    }
+    off += Pad8(eh.len);
+  }
+}
+
+void AhiCache::Unmap() {
+  if (map_ != nullptr) {
+    munmap(map_, map_len_);
+    map_ = nullptr;
+    map_len_ = 0;
+  }
+}
+
+void AhiCache::Save() {
+  if (path_.empty() || !dirty_) {
+    return;
+  }
+
+  size_t len = sizeof(FileHeader);
+  for (const auto &[key, entry] : entries_) {
+    len += sizeof(EntryHeader) + Pad8(entry.data.size());
+  }
+
+  // A unique temp file next to the cache, so concurrent processes saving
+  // the same cache never truncate each other's mapping.
+  std::string tmp_path = path_ + ".XXXXXX";
+  int fd = mkstemp(tmp_path.data());
+  if (fd < 0) {
+    absl::PrintF("Failed to create cache %s errno=%d\n", tmp_path, errno);
+    return;
+  }
+  if (fchmod(fd, 0644) != 0 || ftruncate(fd, len) != 0) {
+    absl::PrintF("Failed to resize cache %s errno=%d\n", tmp_path, errno);
+    close(fd);
+    unlink(tmp_path.c_str());
+    return;
+  }
+  void *map = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    absl::PrintF("Failed to map cache %s errno=%d\n", tmp_path, errno);
+    unlink(tmp_path.c_str());
+    return;
+  }
+
+  char *base = static_cast<char *>(map);
+  FileHeader header{};
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.entry_count = entries_.size();
+  memcpy(base, &header, sizeof(header));
+
+  size_t off = sizeof(FileHeader);
+  for (const auto &[key, entry] : entries_) {
+    EntryHeader eh{
+        .cmd = key.first,
+        .handle = key.second,
+        .fw_id = fw_id_,
+        .expires_unix_ms = entry.expires_unix_ms,
+        .len = static_cast<uint32_t>(entry.data.size()),
+        .reserved = 0,
+    };
+    memcpy(base + off, &eh, sizeof(eh));
+    off += sizeof(eh);
+    memcpy(base + off, entry.data.data(), entry.data.size());
+    off += Pad8(entry.data.size());
+  }
+
+  msync(map, len, MS_SYNC);
+  munmap(map, len);
+  if (rename(tmp_path.c_str(), path_.c_str()) != 0) {
+    absl::PrintF("Failed to replace cache %s errno=%d\n", path_, errno);
+    unlink(tmp_path.c_str());
+    return;
+  }
+  dirty_ = false;
+}
+
+} // namespace amt
@@ -0,0 +1,99 @@
+#ifndef __AHI_CACHE_H__
+#define __AHI_CACHE_H__
+
+#include "ahi.h"
+#include "ahi_messages.h"
+
+#include <functional>
+#include <map>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <absl/strings/string_view.h>
+#include <absl/time/time.h>
+
+namespace amt {
+
+// class AhiCache
+// Persistent cache of AHI replies which rarely change (UUID, certificate
+// hashes, provisioning state ...).
+// Replies are keyed by command, handle and ME firmware identity, and expire
+// after ttl. Only the missing or stale entries are queried from the ME, so
+// a warm cache doesn't touch the MEI device at all: get_ahi is only called
+// on a miss. Without a firmware identity a firmware update couldn't be
+// told apart, so everything is queried from the ME and nothing is stored.
+//
+// File format, all integers in host byte order:
+//   FileHeader
+//   EntryHeader, reply bytes padded to 8 bytes
+//   ...
+// The file is mmap'ed on load and rewritten atomically by Save().
+// An empty path disables persistence.
+class AhiCache {
+public:
+  AhiCache(std::string path, absl::Duration ttl, std::string fw_identity,
+           std::function<AmtHostInterface &()> get_ahi);
+  ~AhiCache();
+
+  // Return: true if success
+  bool GetUuid(GetUuidResponse &rsp);
+  bool EnumerateHashHandles(EnumerateHashHandlesResponse &rsp);
+  bool GetCertificateHashEntry(GetCertificateHashEntryResponse &rsp, uint32_t handle);
+  // Misses are fetched from the ME as one pipelined batch.
+  std::vector<std::optional<GetCertificateHashEntryResponse>>
+  GetCertificateHashEntries(const std::vector<uint32_t> &handles);
+  // Reply of a command without payload, e.g. kAhiGetProvisioningState.
+  std::optional<std::string> SimpleCommand(uint32_t cmd);
+
+  // Write the cache file if anything changed. Also called by the destructor.
+  void Save();
+
+  // Identity of the firmware behind mei_dev, read from sysfs. Empty if
+  // it can't be read.
+  static std::string FirmwareIdentity(const std::string &mei_dev);
+
+  struct Stats {
+    uint64_t hits;
+    uint64_t misses;
+  };
+  const Stats &stats() const { return stats_; }
+
+private:
+  // (cmd, handle)
+  typedef std::pair<uint32_t, uint32_t> Key;
+  struct Entry {
+    int64_t expires_unix_ms;
+    // Points into the mapped file or owned.
+    absl::string_view data;
+    std::string owned;
+  };
+
+  void Load();
+  void Unmap();
+  std::optional<absl::string_view> Lookup(Key key);
+  void Store(Key key, std::string data);
+  // Query the ME with req and cache the reply.
+  std::optional<std::string> Fetch(Key key, std::string req);
+
+  template <typename RspT> bool Get(Key key, const std::string &req, RspT &rsp);
+
+  std::string path_;
+  absl::Duration ttl_;
+  // False without a firmware identity.
+  bool enabled_;
+  uint64_t fw_id_;
+  std::function<AmtHostInterface &()> get_ahi_;
+
+  void *map_ = nullptr;
+  size_t map_len_ = 0;
+
+  std::map<Key, Entry> entries_;
+  bool dirty_ = false;
+  Stats stats_{};
+};
+
+} // namespace amt
+
+#endif // __AHI_CACHE_H__
@@ -1,7 +1,10 @@
 #include "ahi.h"
+#include "ahi_cache.h"
 #include "ahi_messages.h"
 #include "die.h"
 
+#include <memory>
+
 #include <absl/flags/flag.h>
 #include <absl/flags/parse.h>
 #include <absl/flags/usage.h>
@@ -9,6 +12,15 @@
 #include <absl/strings/str_format.h>
 
 ABSL_FLAG(std::string, mei_device, "/dev/mei0", "Path to the MEI chardev");
+ABSL_FLAG(absl::Duration, timeout, absl::Seconds(5), "Timeout of each AHI command");
+ABSL_FLAG(uint32_t, pipeline_depth, amt::AmtHostInterface::kDefaultPipelineDepth,
+          "Max number of AHI commands sent before their replies are read");
+ABSL_FLAG(std::string, cache_file, "",
+          "Cache replies in this file, empty to always query the ME");
+ABSL_FLAG(absl::Duration, cache_ttl, absl::Hours(1), "How long cached replies are valid");
+ABSL_FLAG(bool, local_system_account, true,
+          "Query the local system account. It is never cached, so this always "
+          "needs an MEI exchange, --nolocal_system_account skips it");
 
 using namespace amt;
 
@@ -16,53 +28,62 @@ int main(int argc, char *argv[]) {
   absl::SetProgramUsageMessage("Dump ME info");
   absl::ParseCommandLine(argc, argv);
 
-  AmtHostInterface ahi(absl::GetFlag(FLAGS_mei_device));
+  // Only connect to the ME if there's a cache miss.
+  const std::string mei_device = absl::GetFlag(FLAGS_mei_device);
+  std::unique_ptr<AmtHostInterface> ahi_ptr;
+  auto get_ahi = [&]() -> AmtHostInterface & {
+    if (ahi_ptr == nullptr) {
+      ahi_ptr = std::make_unique<AmtHostInterface>(
+          std::make_unique<MeiDevice>(mei_device), absl::GetFlag(FLAGS_timeout),
+          absl::GetFlag(FLAGS_pipeline_depth));
+    }
+    return *ahi_ptr;
+  };
+  AhiCache cache(absl::GetFlag(FLAGS_cache_file), absl::GetFlag(FLAGS_cache_ttl),
+                 AhiCache::FirmwareIdentity(mei_device), get_ahi);
 
   {
     GetUuidResponse rsp;
-    bool success = ahi.GetUuid(rsp);
+    bool success = cache.GetUuid(rsp);
     die_if(!success, "GetUuid");
     std::cout << rsp.ToString() << std::endl;
   }
 
-  {
+  if (absl::GetFlag(FLAGS_local_system_account)) {
     GetLocalSystemAccountResponse rsp;
-    bool success = ahi.GetLocalSystemAccount(rsp);
+    bool success = get_ahi().GetLocalSystemAccount(rsp);
     die_if(!success, "GetLocalSystemAccount");
     std::cout << rsp.ToString() << std::endl;
   }
 
   {
     EnumerateHashHandlesResponse rsp;
-    bool success = ahi.EnumerateHashHandles(rsp);
+    bool success = cache.EnumerateHashHandles(rsp);
     die_if(!success, "EnumerateHashHandles");
     die_if(rsp.amt_status != 0, "EnumerateHashHandles status=%u", rsp.amt_status);
 
-    for (uint32_t handle : rsp.handles) {
-      GetCertificateHashEntryResponse rsp2;
-      bool success2 = ahi.GetCertificateHashEntry(rsp2, handle);
-      die_if(!success2, "GetCertificateHashEntry");
-      std::cout << absl::StrFormat("Handle %#010x %s\n", handle, rsp2.ToString());
+    auto entries = cache.GetCertificateHashEntries(rsp.handles);
+    for (size_t i = 0; i < entries.size(); i++) {
+      die_if(!entries[i].has_value(), "GetCertificateHashEntry");
+      std::cout << absl::StrFormat("Handle %#010x %s\n", rsp.handles[i],
+                                   entries[i]->ToString());
     }
   }
 
   {
-    AhiHeader req{};
-    req.Init(0x4000011, 0);
-    std::string rsp =
-        ahi.CustomCommand(absl::MakeSpan(reinterpret_cast<uint8_t *>(&req), sizeof(req)));
+    std::optional<std::string> rsp = cache.SimpleCommand(kAhiGetProvisioningState);
+    die_if(!rsp.has_value(), "GetProvisioningState");
     std::cout << "GetProvisioningState:" << std::endl
-              << Hexdump(rsp.data(), rsp.size()) << std::endl;
+              << Hexdump(rsp->data(), rsp->size()) << std::endl;
   }
 
   {
-    AhiHeader req{};
-    req.Init(0x400006b, 0);
-    std::string rsp =
-        ahi.CustomCommand(absl::MakeSpan(reinterpret_cast<uint8_t *>(&req), sizeof(req)));
+    std::optional<std::string> rsp = cache.SimpleCommand(kAhiGetControlMode);
+    die_if(!rsp.has_value(), "GetControlMode");
     std::cout << "GetControlMode:" << std::endl
-              << Hexdump(rsp.data(), rsp.size()) << std::endl;
+              << Hexdump(rsp->data(), rsp->size()) << std::endl;
   }
 
+  absl::PrintF("Cache hits=%u misses=%u\n", cache.stats().hits, cache.stats().misses);
   return 0;
 }
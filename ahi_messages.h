@@ -6,6 +6,7 @@
 #include <absl/strings/str_cat.h>
 #include <absl/strings/str_format.h>
 #include <cinttypes>
+#include <cstring>
 #include <string>
 
 namespace amt {
@@ -42,6 +43,37 @@ struct AhiHeader {
 };
 static_assert(sizeof(AhiHeader) == 12);
 
+// A raw AHI reply succeeded if the amt_status following the header is 0.
+// Only those are cached. A reply too short to carry amt_status failed.
+inline bool AhiReplySucceeded(const std::string &rsp) {
+  uint32_t amt_status;
+  if (rsp.size() < sizeof(AhiHeader) + sizeof(amt_status)) {
+    return false;
+  }
+  memcpy(&amt_status, rsp.data() + sizeof(AhiHeader), sizeof(amt_status));
+  return amt_status == 0;
+}
+
+// AMTHI command codes, the reply sets bit 23 (cmd_is_response).
+constexpr uint32_t kAhiGetProvisioningState = 0x04000011;
+constexpr uint32_t kAhiEnumerateHashHandles = 0x0400002C;
+constexpr uint32_t kAhiGetCertificateHashEntry = 0x0400002D;
+constexpr uint32_t kAhiGetUuid = 0x0400005C;
+constexpr uint32_t kAhiGetLocalSystemAccount = 0x04000067;
+constexpr uint32_t kAhiGetControlMode = 0x0400006B;
+
+struct GetCertificateHashEntryRequest {
+  AhiHeader header;
+  uint32_t handle;
+} __attribute__((packed));
+static_assert(sizeof(GetCertificateHashEntryRequest) == 12 + 4);
+
+struct GetLocalSystemAccountRequest {
+  AhiHeader header;
+  uint8_t reserved[40];
+} __attribute__((packed));
+static_assert(sizeof(GetLocalSystemAccountRequest) == 12 + 40);
+
 struct EnumerateHashHandlesResponse {
   AhiHeader header;
   uint32_t amt_status;
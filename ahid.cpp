@@ -0,0 +1,518 @@
+#include "ahi.h"
+#include "ahi_messages.h"
+#include "ahid.h"
+#include "die.h"
+
+#include <cstring>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <absl/flags/flag.h>
+#include <absl/flags/parse.h>
+#include <absl/flags/usage.h>
+#include <absl/strings/str_format.h>
+#include <absl/time/clock.h>
+#include <absl/time/time.h>
+
+#include <grp.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+ABSL_FLAG(std::string, mei_device, "/dev/mei0", "Path to the MEI chardev");
+ABSL_FLAG(std::string, socket_path, "/run/ahid.sock", "Unix socket to serve on");
+ABSL_FLAG(absl::Duration, timeout, absl::Seconds(5), "Timeout of each AHI command");
+ABSL_FLAG(uint32_t, pipeline_depth, amt::AmtHostInterface::kDefaultPipelineDepth,
+          "Max number of AHI commands sent before their replies are read");
+ABSL_FLAG(absl::Duration, cache_ttl, absl::Seconds(60),
+          "How long replies are served from memory, 0 to disable");
+ABSL_FLAG(std::string, socket_group, "",
+          "Only this group may connect to --socket_path, empty to allow any local "
+          "user");
+
+namespace amt {
+namespace {
+
+// Per client limits of the queries waiting for the ME and of the replies
+// not written yet. Past either one the client isn't read until it drains.
+constexpr uint32_t kMaxClientQueries = 16;
+constexpr size_t kMaxClientOutBuf = 64 * 1024;
+
+void epoll_ctl_add(int epfd, int fd, uint32_t events) {
+  struct epoll_event ev;
+  ev.events = events;
+  ev.data.fd = fd;
+  int err = epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+  die_if(err == -1, "epoll_ctl_add errno=%d", errno);
+}
+
+void epoll_ctl_mod(int epfd, int fd, uint32_t events) {
+  struct epoll_event ev;
+  ev.events = events;
+  ev.data.fd = fd;
+  int err = epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+  die_if(err == -1, "epoll_ctl_mod errno=%d", errno);
+}
+
+void epoll_ctl_del(int epfd, int fd) {
+  int err = epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+  die_if(err == -1, "epoll_ctl_DEL errno=%d", errno);
+}
+
+// Serves AHI queries of many local clients over one AMTHI connection.
+// Identical queries in flight are coalesced into one ME exchange, and
+// replies are cached in memory for --cache_ttl.
+class Ahid {
+public:
+  Ahid()
+      : ahi_(std::make_unique<MeiDevice>(absl::GetFlag(FLAGS_mei_device)),
+             absl::GetFlag(FLAGS_timeout), absl::GetFlag(FLAGS_pipeline_depth)),
+        cache_ttl_(absl::GetFlag(FLAGS_cache_ttl)) {}
+
+  int Run() {
+    epoll_fd_ = epoll_create(1);
+    die_if(epoll_fd_ < 0, "epoll_create errno=%d", errno);
+    epoll_ctl_add(epoll_fd_, ahi_.fd(), 0);
+    ahi_fd_ = ahi_.fd();
+
+    // SIGUSR1 dumps stats.
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    die_if(sigprocmask(SIG_BLOCK, &mask, nullptr) == -1, "sigprocmask errno=%d", errno);
+    signal_fd_ = signalfd(-1, &mask, SFD_NONBLOCK);
+    die_if(signal_fd_ < 0, "signalfd errno=%d", errno);
+    epoll_ctl_add(epoll_fd_, signal_fd_, EPOLLIN);
+
+    BeginListen(absl::GetFlag(FLAGS_socket_path));
+
+    while (true) {
+      UpdateAhiEvents();
+      int timeout_ms = -1;
+      absl::Time deadline = ahi_.NextDeadline();
+      if (deadline != absl::InfiniteFuture()) {
+        timeout_ms = std::max<int64_t>(
+            0, absl::ToInt64Milliseconds(
+                   absl::Ceil(deadline - absl::Now(), absl::Milliseconds(1))));
+      }
+
+      epoll_event events[1024];
+      int event_count = epoll_wait(epoll_fd_, events, 1024, timeout_ms);
+      die_if(event_count == -1, "epoll_wait errno=%d", errno);
+      for (int i = 0; i < event_count; i++) {
+        int fd = events[i].data.fd;
+        if (fd == ahi_fd_) {
+          // Handled below.
+        } else if (fd == signal_fd_) {
+          HandleSignal();
+        } else if (fd == listen_fd_) {
+          HandleIncomingConnection();
+        } else if (auto it = clients_.find(fd); it != clients_.end()) {
+          Client &client = it->second;
+          if (client.paused && (events[i].events & (EPOLLHUP | EPOLLERR))) {
+            // Not read meanwhile, see HandleClientData().
+            MarkDead(client);
+            continue;
+          }
+          if (events[i].events & EPOLLOUT) {
+            FlushClient(client);
+          }
+          if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLRDHUP | EPOLLERR)) {
+            HandleClientData(client);
+          }
+        }
+      }
+      // Also expires timed out commands.
+      ahi_.HandleEvents();
+      ResumeClients();
+      CloseDeadClients();
+    }
+
+    return 0;
+  }
+
+private:
+  // (cmd, handle)
+  typedef std::pair<uint32_t, uint32_t> Key;
+
+  struct Client {
+    int fd;
+    // Distinguishes clients reusing the same fd.
+    uint64_t serial;
+    uid_t uid;
+    std::string in_buf;
+    std::string out_buf;
+    // Queries waiting for the ME.
+    uint32_t outstanding;
+    // Over a per client limit, not read until it drains.
+    bool paused;
+    // Closed at the end of the loop iteration, see CloseDeadClients().
+    bool dead;
+  };
+
+  struct Waiter {
+    int fd;
+    uint64_t serial;
+    uint32_t id;
+  };
+
+  struct CacheEntry {
+    absl::Time expires;
+    std::string data;
+  };
+
+  void BeginListen(const std::string &path) {
+    sockaddr_un sa{};
+    die_if(path.size() >= sizeof(sa.sun_path), "socket path too long");
+    sa.sun_family = AF_UNIX;
+    memcpy(sa.sun_path, path.c_str(), path.size() + 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    die_if(fd < 0, "socket creation fail");
+    unlink(path.c_str());
+    int err = bind(fd, reinterpret_cast<sockaddr *>(&sa), sizeof(sa));
+    die_if(err == -1, "bind %s errno=%d", path.c_str(), errno);
+    // Secrets are restricted by peer uid.
+    if (std::string name = absl::GetFlag(FLAGS_socket_group); !name.empty()) {
+      group *gr = getgrnam(name.c_str());
+      die_if(gr == nullptr, "unknown group %s", name.c_str());
+      err = chown(path.c_str(), -1, gr->gr_gid);
+      die_if(err == -1, "chown %s errno=%d", path.c_str(), errno);
+      chmod(path.c_str(), 0660);
+    } else {
+      chmod(path.c_str(), 0666);
+    }
+    err = listen(fd, 128);
+    die_if(err == -1, "listen");
+
+    listen_fd_ = fd;
+    epoll_ctl_add(epoll_fd_, fd, EPOLLIN);
+    absl::PrintF("Listening on %s\n", path);
+  }
+
+  void HandleIncomingConnection() {
+    while (true) {
+      int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK);
+      if (fd < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+      }
+      die_if(fd < 0, "accept errno=%d", errno);
+
+      ucred cred{};
+      socklen_t len = sizeof(cred);
+      int err = getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len);
+      die_if(err == -1, "SO_PEERCRED errno=%d", errno);
+
+      clients_[fd] = Client{
+          .fd = fd,
+          .serial = next_serial_++,
+          .uid = cred.uid,
+      };
+      epoll_ctl_add(epoll_fd_, fd, EPOLLIN | EPOLLRDHUP);
+    }
+  }
+
+  // Buffered requests are handled before reading more, so in_buf stays
+  // below one read plus a request.
+  void HandleClientData(Client &client) {
+    char buf[4096];
+    while (true) {
+      size_t off = 0;
+      while (!client.dead && !Throttled(client) &&
+             client.in_buf.size() - off >= sizeof(AhidRequest)) {
+        AhidRequest req;
+        memcpy(&req, client.in_buf.data() + off, sizeof(req));
+        off += sizeof(req);
+        HandleQuery(client, req);
+      }
+      client.in_buf.erase(0, off);
+      if (client.dead) {
+        return;
+      }
+      if (Throttled(client)) {
+        if (!client.paused) {
+          client.paused = true;
+          paused_clients_.push_back(client.fd);
+          stats_.paused++;
+          UpdateClientEvents(client);
+        }
+        return;
+      }
+
+      ssize_t r = read(client.fd, buf, sizeof(buf));
+      if (r < 0 && errno == EAGAIN) {
+        return;
+      }
+      if (r <= 0) {
+        // Pending replies are dropped.
+        MarkDead(client);
+        return;
+      }
+      client.in_buf.append(buf, r);
+    }
+  }
+
+  bool Throttled(const Client &client) const {
+    return client.outstanding >= kMaxClientQueries ||
+           client.out_buf.size() >= kMaxClientOutBuf;
+  }
+
+  // Read the paused clients again once they're below the limits.
+  void ResumeClients() {
+    std::vector<int> paused;
+    paused.swap(paused_clients_);
+    for (int fd : paused) {
+      auto it = clients_.find(fd);
+      if (it == clients_.end() || it->second.dead || !it->second.paused) {
+        continue;
+      }
+      Client &client = it->second;
+      if (Throttled(client)) {
+        paused_clients_.push_back(fd);
+        continue;
+      }
+      client.paused = false;
+      UpdateClientEvents(client);
+      HandleClientData(client);
+    }
+  }
+
+  void UpdateClientEvents(const Client &client) {
+    epoll_ctl_mod(epoll_fd_, client.fd,
+                  (client.paused ? 0 : EPOLLIN | EPOLLRDHUP) |
+                      (client.out_buf.empty() ? 0 : EPOLLOUT));
+  }
+
+  void HandleQuery(Client &client, const AhidRequest &req) {
+    stats_.queries++;
+    std::optional<std::string> ahi_req = BuildRequest(req.cmd, req.handle);
+    if (!ahi_req.has_value() ||
+        (req.cmd == kAhiGetLocalSystemAccount && client.uid != 0)) {
+      stats_.rejected++;
+      Reply(Waiter{client.fd, client.serial, req.id}, AhidResponse::kRejected, "");
+      return;
+    }
+
+    Key key{req.cmd, req.cmd == kAhiGetCertificateHashEntry ? req.handle : 0};
+    // Credentials are never kept around.
+    bool cacheable = req.cmd != kAhiGetLocalSystemAccount;
+
+    if (cacheable) {
+      auto it = cache_.find(key);
+      if (it != cache_.end() && it->second.expires > absl::Now()) {
+        stats_.cache_hits++;
+        Reply(Waiter{client.fd, client.serial, req.id}, AhidResponse::kOk,
+              it->second.data);
+        return;
+      }
+    }
+
+    std::vector<Waiter> &waiters = in_flight_[key];
+    waiters.push_back(Waiter{client.fd, client.serial, req.id});
+    client.outstanding++;
+    if (waiters.size() > 1) {
+      stats_.coalesced++;
+      return;
+    }
+
+    stats_.me_exchanges++;
+    ahi_.CustomCommandAsync(
+        absl::MakeConstSpan(reinterpret_cast<const uint8_t *>(ahi_req->data()),
+                            ahi_req->size()),
+        [this, key, cacheable](std::optional<std::string> rsp) {
+          OnReply(key, cacheable, std::move(rsp));
+        });
+  }
+
+  void OnReply(Key key, bool cacheable, std::optional<std::string> rsp) {
+    std::vector<Waiter> waiters = std::move(in_flight_[key]);
+    in_flight_.erase(key);
+    for (const Waiter &w : waiters) {
+      if (Client *client = FindClient(w)) {
+        client->outstanding--;
+      }
+    }
+
+    if (!rsp.has_value()) {
+      stats_.failures++;
+      for (const Waiter &w : waiters) {
+        Reply(w, AhidResponse::kFailed, "");
+      }
+      return;
+    }
+
+    if (cacheable && AhiReplySucceeded(*rsp) && cache_ttl_ > absl::ZeroDuration()) {
+      cache_[key] = CacheEntry{
+          .expires = absl::Now() + cache_ttl_,
+          .data = *rsp,
+      };
+    }
+    for (const Waiter &w : waiters) {
+      Reply(w, AhidResponse::kOk, *rsp);
+    }
+  }
+
+  std::optional<std::string> BuildRequest(uint32_t cmd, uint32_t handle) {
+    switch (cmd) {
+    case kAhiGetUuid:
+    case kAhiEnumerateHashHandles:
+    case kAhiGetProvisioningState:
+    case kAhiGetControlMode: {
+      AhiHeader req{};
+      req.Init(cmd, 0);
+      return std::string(reinterpret_cast<const char *>(&req), sizeof(req));
+    }
+    case kAhiGetCertificateHashEntry: {
+      GetCertificateHashEntryRequest req{};
+      req.header.Init(cmd, 4);
+      req.handle = handle;
+      return std::string(reinterpret_cast<const char *>(&req), sizeof(req));
+    }
+    case kAhiGetLocalSystemAccount: {
+      GetLocalSystemAccountRequest req{};
+      req.header.Init(cmd, 40);
+      return std::string(reinterpret_cast<const char *>(&req), sizeof(req));
+    }
+    default:
+      return std::nullopt;
+    }
+  }
+
+  // nullptr if the client is gone.
+  Client *FindClient(const Waiter &w) {
+    auto it = clients_.find(w.fd);
+    if (it == clients_.end() || it->second.serial != w.serial || it->second.dead) {
+      return nullptr;
+    }
+    return &it->second;
+  }
+
+  void Reply(const Waiter &w, AhidResponse::Status status, const std::string &data) {
+    Client *found = FindClient(w);
+    if (found == nullptr) {
+      return;
+    }
+    Client &client = *found;
+    AhidResponse rsp{
+        .id = w.id,
+        .status = status,
+        .len = static_cast<uint32_t>(data.size()),
+    };
+    client.out_buf.append(reinterpret_cast<const char *>(&rsp), sizeof(rsp));
+    client.out_buf.append(data);
+    FlushClient(client);
+  }
+
+  void FlushClient(Client &client) {
+    if (client.dead) {
+      return;
+    }
+    size_t off = 0;
+    while (off < client.out_buf.size()) {
+      ssize_t written = send(client.fd, client.out_buf.data() + off,
+                             client.out_buf.size() - off, MSG_NOSIGNAL);
+      if (written < 0 && errno == EAGAIN) {
+        break;
+      }
+      if (written <= 0) {
+        MarkDead(client);
+        return;
+      }
+      off += written;
+    }
+    client.out_buf.erase(0, off);
+    UpdateClientEvents(client);
+  }
+
+  // Clients are not erased right away, callers up the stack may still
+  // hold a reference.
+  void MarkDead(Client &client) {
+    if (!client.dead) {
+      client.dead = true;
+      dead_clients_.push_back(client.fd);
+    }
+  }
+
+  void CloseDeadClients() {
+    for (int fd : dead_clients_) {
+      epoll_ctl_del(epoll_fd_, fd);
+      close(fd);
+      clients_.erase(fd);
+    }
+    dead_clients_.clear();
+  }
+
+  void UpdateAhiEvents() {
+    // AHI reconnects after a timeout. The old fd is gone from epoll with
+    // it, but the new one may reuse the number. While the reconnect is
+    // retried there is no fd, the loop wakes up by NextDeadline().
+    ahi_fd_ = ahi_.fd();
+    if (ahi_fd_ < 0) {
+      return;
+    }
+    struct epoll_event ev;
+    ev.events = ahi_.events();
+    ev.data.fd = ahi_.fd();
+    int err = epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, ahi_.fd(), &ev);
+    if (err == -1 && errno == ENOENT) {
+      err = epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, ahi_.fd(), &ev);
+    }
+    die_if(err == -1, "epoll_ctl ahi errno=%d", errno);
+  }
+
+  void HandleSignal() {
+    signalfd_siginfo info;
+    while (read(signal_fd_, &info, sizeof(info)) == sizeof(info)) {
+    }
+    absl::PrintF("Stats: clients=%u queries=%u cache_hits=%u coalesced=%u "
+                 "me_exchanges=%u failures=%u rejected=%u paused=%u\n",
+                 clients_.size(), stats_.queries, stats_.cache_hits, stats_.coalesced,
+                 stats_.me_exchanges, stats_.failures, stats_.rejected, stats_.paused);
+  }
+
+  AmtHostInterface ahi_;
+  absl::Duration cache_ttl_;
+
+  // key is fd
+  std::unordered_map<int, Client> clients_;
+  uint64_t next_serial_ = 0;
+  // Queries waiting for the ME.
+  std::map<Key, std::vector<Waiter>> in_flight_;
+  std::map<Key, CacheEntry> cache_;
+  std::vector<int> dead_clients_;
+  std::vector<int> paused_clients_;
+
+  struct {
+    uint64_t queries;
+    uint64_t cache_hits;
+    uint64_t coalesced;
+    uint64_t me_exchanges;
+    uint64_t failures;
+    uint64_t rejected;
+    // Times a client was paused by the per client limits.
+    uint64_t paused;
+  } stats_{};
+
+  int epoll_fd_;
+  int signal_fd_;
+  int listen_fd_;
+  int ahi_fd_;
+};
+
+} // namespace
+} // namespace amt
+
+int main(int argc, char *argv[]) {
+  absl::SetProgramUsageMessage("Serves AHI queries over a unix socket");
+  absl::ParseCommandLine(argc, argv);
+
+  amt::Ahid ahid;
+  return ahid.Run();
+}
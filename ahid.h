@@ -0,0 +1,46 @@
+#ifndef __AHID_H__
+#define __AHID_H__
+
+#include <cinttypes>
+
+namespace amt {
+
+// Wire protocol of ahid, the AHI broker daemon.
+// Clients connect to the unix socket and write AhidRequest structs, they
+// may have multiple requests outstanding. Each request is answered with an
+// AhidResponse header followed by len bytes of raw AHI reply, which can be
+// parsed with the Deserialize() of the corresponding response in
+// ahi_messages.h. Responses may arrive out of order, use id to match them.
+// All integers are in host byte order.
+
+struct AhidRequest {
+  // Chosen by the client, echoed in the response.
+  uint32_t id;
+  // One of kAhiGetUuid, kAhiEnumerateHashHandles, kAhiGetCertificateHashEntry,
+  // kAhiGetProvisioningState, kAhiGetControlMode, kAhiGetLocalSystemAccount.
+  // kAhiGetLocalSystemAccount is only served to root.
+  uint32_t cmd;
+  // Only used by kAhiGetCertificateHashEntry.
+  uint32_t handle;
+};
+static_assert(sizeof(AhidRequest) == 12);
+
+struct AhidResponse {
+  enum Status : uint32_t {
+    kOk = 0,
+    // ME exchange failed or timed out.
+    kFailed = 1,
+    // Unknown command or permission denied.
+    kRejected = 2,
+  };
+
+  uint32_t id;
+  Status status;
+  // Length of the AHI reply that follows.
+  uint32_t len;
+};
+static_assert(sizeof(AhidResponse) == 12);
+
+} // namespace amt
+
+#endif // __AHID_H__
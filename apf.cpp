@@ -3,12 +3,10 @@
 #include "hexdump.h"
 
 #include <arpa/inet.h>
-#include <fcntl.h>
 #include <linux/mei.h>
 #include <linux/mei_uuid.h>
-#include <sys/ioctl.h>
-#include <unistd.h>
 
+#include <algorithm>
 #include <cinttypes>
 #include <cstring>
 
@@ -27,35 +25,52 @@ namespace amt {
 #define MEI_LME_GUID                                                                     \
   UUID_LE(0x6733a4db, 0x0476, 0x4e7b, 0xb3, 0xaf, 0xbc, 0xfc, 0x29, 0xbe, 0xe7, 0xa7)
 
-AmtPortForwarding::AmtPortForwarding(std::string mei_dev) {
-  fd_ = open("/dev/mei0", O_RDWR);
-  die_if(fd_ < 0, "mei fd error");
+// Buffers kept in the pool when idle, enough for a few dozen busy channels.
+constexpr size_t kPoolMaxIdle = 256;
 
-  mei_connect_client_data data;
-  data.in_client_uuid = MEI_LME_GUID;
+AmtPortForwarding::AmtPortForwarding(std::unique_ptr<MeiTransport> transport,
+                                     size_t max_out_queue, size_t max_early_data)
+    : transport_(std::move(transport)), max_out_queue_(max_out_queue),
+      max_early_data_(max_early_data) {}
 
-  int ret = ioctl(fd_, IOCTL_MEI_CONNECT_CLIENT, &data);
-  die_if(ret < 0, "ioctl error %d\n", ret);
+AmtPortForwarding::~AmtPortForwarding() { Disconnect(); }
 
-  absl::PrintF("Connected to LME max_msg_len=%u protocol_ver=%u\n",
-               data.out_client_properties.max_msg_length,
-               data.out_client_properties.protocol_version);
+bool AmtPortForwarding::Connect() {
+  die_if(connected_, "already connected");
+  MeiClientProperties props;
+  if (!transport_->Connect(MEI_LME_GUID, props)) {
+    absl::PrintF("Failed to connect LME\n");
+    return false;
+  }
 
-  int flags = fcntl(fd_, F_GETFL);
-  die_if(flags == -1, "fcntl GETFL");
-  int err = fcntl(fd_, F_SETFL, flags | O_NONBLOCK);
-  die_if(err == -1, "fcntl SEFL");
+  absl::PrintF("Connected to LME max_msg_len=%u protocol_ver=%u\n",
+               props.max_msg_length, props.protocol_version);
 
-  max_msg_length_ = data.out_client_properties.max_msg_length;
-  buffer_length_ = max_msg_length_ + 32;
-  buffer_ = std::make_unique<uint8_t[]>(buffer_length_);
+  max_msg_length_ = props.max_msg_length;
+  die_if(max_msg_length_ <= ApfChannelData::kHeaderSize, "max_msg_len too small");
+  if (pool_ == nullptr || pool_->buffer_size() != max_msg_length_) {
+    read_buf_ = BufferPool::Buffer();
+    pool_ = std::make_unique<BufferPool>(max_msg_length_, kPoolMaxIdle);
+  }
+  if (!read_buf_) {
+    read_buf_ = pool_->Get();
+  }
+  connected_ = true;
+  disconnected_ = false;
+  last_receive_ = absl::Now();
+  probe_sent_ = absl::InfinitePast();
+  answers_probes_ = false;
+  return true;
 }
 
-AmtPortForwarding::~AmtPortForwarding() {
-  if (fd_ >= 0) {
-    close(fd_);
-    fd_ = -1;
-  }
+void AmtPortForwarding::Disconnect() {
+  // Channels don't survive the MEI connection.
+  channels_.clear();
+  out_queue_.clear();
+  queue_blocked_.clear();
+  paced_.clear();
+  transport_->Close();
+  connected_ = false;
 }
 
 // Overall workflow:
@@ -64,15 +79,23 @@ AmtPortForwarding::~AmtPortForwarding() {
 // Caller requests open channel -> ME accept/reject
 AmtPortForwarding::MeRequest AmtPortForwarding::ProcessOneMessage() {
   MeRequest ret = std::nullopt;
+  if (disconnected_) {
+    return MeDisconnect{};
+  }
 
-  ssize_t len = read(fd_, buffer_.get(), buffer_length_);
-  die_if(len < 0, "Failed to read ret=%d errno=%d\n", len, errno);
-  if (len == 0) {
-    absl::PrintF("ME connection closing...\n");
+  ssize_t len = transport_->Read(absl::MakeSpan(read_buf_.data(), read_buf_.capacity()));
+  if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
     return std::nullopt;
   }
+  if (len <= 0) {
+    // e.g. ENODEV after an ME reset.
+    absl::PrintF("ME connection lost ret=%d errno=%d\n", len, errno);
+    disconnected_ = true;
+    return MeDisconnect{};
+  }
 
-  auto data = absl::MakeSpan(buffer_.get(), len);
+  last_receive_ = absl::Now();
+  auto data = absl::MakeSpan(read_buf_.data(), len);
   bool parsing_success = false;
   std::optional<std::string> processing_err = std::nullopt;
 
@@ -94,9 +117,14 @@ AmtPortForwarding::MeRequest AmtPortForwarding::ProcessOneMessage() {
     CASE_MSG_TYPE(ApfServiceRequest);
     CASE_MSG_TYPE(ApfGlobalMessage);
     CASE_MSG_TYPE(ApfChannelOpenConfirmation);
+    CASE_MSG_TYPE(ApfChannelOpenFailure);
     CASE_MSG_TYPE(ApfChannelClose);
     CASE_MSG_TYPE(ApfChannelData);
     CASE_MSG_TYPE(ApfChannelWindowAdjust);
+    CASE_MSG_TYPE(ApfKeepAliveRequest);
+    CASE_MSG_TYPE(ApfKeepAliveReply);
+    CASE_MSG_TYPE(ApfKeepAliveOptionsRequest);
+    CASE_MSG_TYPE(ApfKeepAliveOptionsReply);
     default: parsing_success = false;
     // clang-format on
   }
@@ -177,10 +205,27 @@ bool AmtPortForwarding::Process(const ApfGlobalMessage &msg, MeRequest &ret) {
 bool AmtPortForwarding::Process(const ApfChannelOpenConfirmation &msg, MeRequest &ret) {
   absl::PrintF("Received %s\n", msg.ToString());
 
-  channels_[msg.recipient_channel] = OpenedChannel{
-      .peer_channel_id = msg.sender_channel,
-      .send_window = msg.initial_window_size,
-  };
+  auto it = channels_.find(msg.recipient_channel);
+  if (it == channels_.end() || it->second.confirmed) {
+    absl::PrintF("Unexpected confirmation.\n");
+    return false;
+  }
+
+  OpenedChannel &channel = it->second;
+  channel.peer_channel_id = msg.sender_channel;
+  channel.send_window = msg.initial_window_size;
+  channel.confirmed = true;
+  // Early data goes out first, the caller is resumed after
+  // OpenChannelResult if it all fits the window.
+  FlushSendBuffer(channel);
+  if (!IsBlocked(channel)) {
+    channel.want_send_completion = false;
+  }
+  // Caller may have given up on the channel while it was opening.
+  MaybeSendClose(channel);
+  if (channel.aborted) {
+    return true;
+  }
 
   ret = OpenChannelResult{
       .channel_id = msg.recipient_channel,
@@ -189,13 +234,51 @@ bool AmtPortForwarding::Process(const ApfChannelOpenConfirmation &msg, MeRequest
   return true;
 }
 
+bool AmtPortForwarding::Process(const ApfChannelOpenFailure &msg, MeRequest &ret) {
+  absl::PrintF("Received %s\n", msg.ToString());
+
+  auto it = channels_.find(msg.recipient_channel);
+  if (it == channels_.end() || it->second.confirmed) {
+    absl::PrintF("Unexpected open failure.\n");
+    return false;
+  }
+
+  // The channel never existed on the ME side, there's no close to
+  // exchange. Reclaim right away, also when the caller already aborted it.
+  bool aborted = it->second.aborted;
+  channels_.erase(it);
+  stats_.channels_open_failed++;
+  stats_.channels_reclaimed++;
+  if (aborted) {
+    return true;
+  }
+
+  ret = OpenChannelResult{
+      .channel_id = msg.recipient_channel,
+      .success = false,
+  };
+  return true;
+}
+
 bool AmtPortForwarding::Process(const ApfChannelClose &msg, MeRequest &ret) {
   absl::PrintF("Received %s\n", msg.ToString());
+  auto it = channels_.find(msg.recipient_channel);
+  if (it == channels_.end()) {
+    absl::PrintF("Recipient channel not found.\n");
+    return false;
+  }
 
-  // cleanup is handled in CloseChannel().
+  // Our ApfChannelClose is sent by CloseChannel(), after the caller
+  // finished sending.
+  it->second.close_received = true;
+  if (it->second.aborted) {
+    MaybeReclaim(msg.recipient_channel);
+    return true;
+  }
   ret = ChannelClosed{
       .channel_id = msg.recipient_channel,
   };
+  MaybeReclaim(msg.recipient_channel);
   return true;
 }
 
@@ -206,8 +289,11 @@ bool AmtPortForwarding::Process(const ApfChannelData &msg, MeRequest &ret) {
     absl::PrintF("Recipient channel not found.\n");
     return false;
   }
+  if (it->second.aborted) {
+    return true;
+  }
 
-  it->second.recv_buf += msg.data;
+  it->second.recv_buf.Append(msg.data);
   ret = IncomingData{
       .channel_id = msg.recipient_channel,
   };
@@ -224,12 +310,19 @@ bool AmtPortForwarding::Process(const ApfChannelWindowAdjust &msg, MeRequest &re
 
   OpenedChannel &channel = it->second;
   channel.send_window += msg.bytes_to_add;
+  absl::Time now = absl::Now();
+  channel.pacer.OnWindowAdjust(msg.bytes_to_add, now);
+  if (channel.window_stalled) {
+    channel.window_stalled = false;
+    stats_.window_stall_time += now - channel.stalled_since;
+  }
 
   if (!channel.send_buf.empty()) {
     FlushSendBuffer(channel);
   }
+  MaybeSendClose(channel);
 
-  if (channel.send_buf.empty() && channel.want_send_completion) {
+  if (!IsBlocked(channel) && channel.want_send_completion) {
     // std::cerr << "completion raised " << msg.recipient_channel << std::endl;
     ret = SendDataCompletion{
         .channel_id = msg.recipient_channel,
@@ -237,6 +330,36 @@ bool AmtPortForwarding::Process(const ApfChannelWindowAdjust &msg, MeRequest &re
     channel.want_send_completion = false;
   }
 
+  MaybeReclaim(msg.recipient_channel);
+  return true;
+}
+
+bool AmtPortForwarding::Process(const ApfKeepAliveRequest &msg, MeRequest &ret) {
+  stats_.keepalive_requests++;
+  Send(ApfKeepAliveReply{.cookie = msg.cookie}.Serialize());
+  return true;
+}
+
+bool AmtPortForwarding::Process(const ApfKeepAliveReply &msg, MeRequest &ret) {
+  // Replies to a timed out probe are ignored.
+  if (probe_sent_ == absl::InfinitePast() || msg.cookie != probe_cookie_) {
+    return true;
+  }
+  stats_.keepalive_replies++;
+  keepalive_rtt_.Add(last_receive_ - probe_sent_);
+  probe_sent_ = absl::InfinitePast();
+  answers_probes_ = true;
+  return true;
+}
+
+bool AmtPortForwarding::Process(const ApfKeepAliveOptionsRequest &msg, MeRequest &ret) {
+  absl::PrintF("Received %s\n", msg.ToString());
+  Send(ApfKeepAliveOptionsReply{}.Serialize());
+  return true;
+}
+
+bool AmtPortForwarding::Process(const ApfKeepAliveOptionsReply &msg, MeRequest &ret) {
+  absl::PrintF("Received %s\n", msg.ToString());
   return true;
 }
 
@@ -244,12 +367,16 @@ bool AmtPortForwarding::Process(const ApfChannelWindowAdjust &msg, MeRequest &re
 // Public APIs
 //
 
-uint32_t AmtPortForwarding::OpenChannel(uint32_t port_from, uint32_t port_to) {
-  // TODO handle port collision
+uint32_t AmtPortForwarding::OpenChannel(uint32_t port_from, uint32_t port_to,
+                                        uint32_t window) {
+  // Channel ids wrap around, skip the ones still in use.
+  while (channels_.find(next_channel_id_) != channels_.end()) {
+    next_channel_id_++;
+  }
   ApfChannelOpenRequest req{};
   req.is_forwarded = true;
   req.sender_channel = next_channel_id_++;
-  req.initial_window_size = 4096;
+  req.initial_window_size = window;
   req.connected_address = "127.0.0.1";
   req.connected_port = port_to;
   req.originator_address = "127.0.0.1";
@@ -257,81 +384,405 @@ uint32_t AmtPortForwarding::OpenChannel(uint32_t port_from, uint32_t port_to) {
 
   absl::PrintF("New channel: %s\n", req.ToString());
   Send(req.Serialize());
+  channels_.emplace(req.sender_channel, OpenedChannel(req.sender_channel, pool_.get()));
+  stats_.channels_opened++;
   return req.sender_channel;
 }
 
 void AmtPortForwarding::CloseChannel(uint32_t channel_id) {
-  // TODO pending buffer
-  // TODO two-way close bookkeeping.
   auto it = channels_.find(channel_id);
   die_if(it == channels_.end(), "unknown channel to close : %u", channel_id);
 
-  ApfChannelClose req{.recipient_channel = it->second.peer_channel_id};
-  Send(req.Serialize());
-  channels_.erase(it);
+  OpenedChannel &channel = it->second;
+  if (channel.close_requested) {
+    return;
+  }
+  channel.close_requested = true;
+  channel.want_send_completion = false;
+  // Nothing more to coalesce with.
+  channel.corked = false;
+  FlushSendBuffer(channel);
+  MaybeSendClose(channel);
+  MaybeReclaim(channel_id);
+}
+
+void AmtPortForwarding::AbortChannel(uint32_t channel_id) {
+  auto it = channels_.find(channel_id);
+  if (it == channels_.end()) {
+    // Already reclaimed.
+    return;
+  }
+
+  OpenedChannel &channel = it->second;
+  if (channel.aborted) {
+    return;
+  }
+  channel.aborted = true;
+  channel.close_requested = true;
+  channel.want_send_completion = false;
+  channel.send_buf.Clear();
+  channel.recv_buf.Clear();
+  stats_.channels_aborted++;
+  MaybeSendClose(channel);
+  MaybeReclaim(channel_id);
 }
 
 bool AmtPortForwarding::SendData(uint32_t channel_id, absl::Span<const uint8_t> data) {
   die_if(data.size() == 0, "Cannot send 0 byte.");
   auto it = channels_.find(channel_id);
   die_if(it == channels_.end(), "Channel %u not found.", channel_id);
+  die_if(it->second.close_requested, "Channel %u is closing.", channel_id);
 
-  it->second.send_buf.append(reinterpret_cast<const char *>(data.data()), data.size());
+  OpenedChannel &channel = it->second;
+  if (!channel.confirmed) {
+    stats_.early_data += data.size();
+  }
+  if (channel.corked) {
+    stats_.cork_writes++;
+    if (channel.send_buf.empty()) {
+      channel.corked_since = absl::Now();
+    }
+  }
+  channel.send_buf.Append(data);
   // std::cerr << "send data enqueued " << channel_id << std::endl;
-  it->second.want_send_completion = true;
-  FlushSendBuffer(it->second);
-  return !it->second.send_buf.empty();
+  channel.want_send_completion = true;
+  FlushSendBuffer(channel);
+  return IsBlocked(channel);
 }
 
-const std::string *AmtPortForwarding::PeekData(uint32_t channel_id) {
+bool AmtPortForwarding::IsBlocked(uint32_t channel_id) const {
+  auto it = channels_.find(channel_id);
+  return it != channels_.end() && IsBlocked(it->second);
+}
+
+void AmtPortForwarding::SetCork(uint32_t channel_id, bool corked) {
+  auto it = channels_.find(channel_id);
+  die_if(it == channels_.end(), "Channel %u not found.", channel_id);
+  it->second.corked = corked;
+  if (!corked) {
+    FlushSendBuffer(it->second);
+  }
+}
+
+bool AmtPortForwarding::HasCorkedData(uint32_t channel_id) const {
   auto it = channels_.find(channel_id);
   if (it == channels_.end()) {
-    absl::PrintF("Channel not found.\n");
-    return nullptr;
+    return false;
+  }
+  const OpenedChannel &channel = it->second;
+  return channel.corked && !channel.send_buf.empty() && !IsBlocked(channel);
+}
+
+void AmtPortForwarding::SetWeight(uint32_t channel_id, uint32_t weight) {
+  auto it = channels_.find(channel_id);
+  die_if(it == channels_.end(), "Channel %u not found.", channel_id);
+  die_if(weight == 0, "Channel %u weight must be positive.", channel_id);
+  it->second.weight = weight;
+}
+
+void AmtPortForwarding::FlushCorked(uint32_t channel_id) {
+  auto it = channels_.find(channel_id);
+  if (it == channels_.end() || !HasCorkedData(channel_id)) {
+    return;
   }
-  return &it->second.recv_buf;
+  stats_.cork_forced_flushes++;
+  FlushSendBuffer(it->second, /*force=*/true);
+}
+
+absl::Span<const uint8_t> AmtPortForwarding::PeekData(uint32_t channel_id) {
+  auto it = channels_.find(channel_id);
+  if (it == channels_.end()) {
+    // Reclaimed by the last PopData().
+    return {};
+  }
+  return it->second.recv_buf.Front();
 }
 
 void AmtPortForwarding::PopData(uint32_t channel_id, uint32_t bytes_to_pop) {
   auto it = channels_.find(channel_id);
   if (it == channels_.end()) {
     absl::PrintF("Channel not found.\n");
+    return;
   }
 
-  std::string &buf = it->second.recv_buf;
+  BufferQueue &buf = it->second.recv_buf;
   die_if(bytes_to_pop > buf.size(), "too many bytes to pop");
-  buf = buf.substr(bytes_to_pop);
+  if (bytes_to_pop == 0) {
+    return;
+  }
+  buf.Pop(bytes_to_pop);
 
-  ApfChannelWindowAdjust req{
-      .recipient_channel = it->second.peer_channel_id,
-      .bytes_to_add = bytes_to_pop,
-  };
-  Send(req.Serialize());
+  if (!it->second.close_received) {
+    ApfChannelWindowAdjust req{
+        .recipient_channel = it->second.peer_channel_id,
+        .bytes_to_add = bytes_to_pop,
+    };
+    Send(req.Serialize());
+  }
+  MaybeReclaim(channel_id);
 }
 
 //
 // Private helper functions
 //
 
-void AmtPortForwarding::Send(std::string data) {
+void AmtPortForwarding::Send(const std::string &data) {
+  Send(absl::MakeConstSpan(reinterpret_cast<const uint8_t *>(data.data()), data.size()));
+}
+
+void AmtPortForwarding::Send(absl::Span<const uint8_t> data) {
+  if (out_queue_.empty() && TryWrite(data)) {
+    return;
+  }
+  die_if(data.size() > pool_->buffer_size(), "message too long len=%u", data.size());
+  BufferPool::Buffer msg = pool_->Get();
+  memcpy(msg.data(), data.data(), data.size());
+  Send(std::move(msg), data.size());
+}
+
+void AmtPortForwarding::Send(BufferPool::Buffer msg, size_t len) {
+  if (out_queue_.empty() && TryWrite(absl::MakeConstSpan(msg.data(), len))) {
+    return;
+  }
+  out_queue_.push_back(QueuedMessage{std::move(msg), len, absl::Now()});
+  stats_.out_queued++;
+  stats_.out_queue_peak = std::max<uint64_t>(stats_.out_queue_peak, out_queue_.size());
+}
+
+bool AmtPortForwarding::TryWrite(absl::Span<const uint8_t> data) {
   // absl::PrintF("sending data len=%u\n%s\n", data.size(),
   //              Hexdump(data.data(), data.size()));
-  size_t sent = write(fd_, data.data(), data.size());
-  die_if(sent != data.size(), "write error");
+  ssize_t sent;
+  do {
+    sent = transport_->Write(data);
+  } while (sent < 0 && errno == EINTR);
+  if (sent < 0 && errno == EAGAIN) {
+    return false;
+  }
+  // MEI writes are all or nothing. On failure the message is dropped and
+  // the next ProcessOneMessage() reports MeDisconnect.
+  if (sent != static_cast<ssize_t>(data.size())) {
+    if (!disconnected_) {
+      absl::PrintF("MEI write error ret=%d errno=%d\n", sent, errno);
+    }
+    disconnected_ = true;
+  }
+  return true;
 }
 
-void AmtPortForwarding::FlushSendBuffer(OpenedChannel &channel) {
-  size_t len = channel.send_window;
-  if (channel.send_buf.size() < len) {
-    len = channel.send_buf.size();
+std::vector<AmtPortForwarding::SendDataCompletion> AmtPortForwarding::HandleWritable() {
+  absl::Time now = absl::Now();
+  while (!out_queue_.empty()) {
+    QueuedMessage &msg = out_queue_.front();
+    if (!TryWrite(absl::MakeConstSpan(msg.buf.data(), msg.len))) {
+      break;
+    }
+    absl::Duration delay = now - msg.enqueued;
+    stats_.out_queue_delay += delay;
+    stats_.out_queue_max_delay = std::max(stats_.out_queue_max_delay, delay);
+    out_queue_.pop_front();
   }
-  ApfChannelData req{
-      .recipient_channel = channel.peer_channel_id,
-      .data = channel.send_buf.substr(0, len),
-  };
+
+  // Resume the channels held back by the queue, weighted round robin.
+  std::vector<SendDataCompletion> ret;
+  while (!queue_blocked_.empty() && !OutQueueFull()) {
+    uint32_t channel_id = queue_blocked_.front();
+    queue_blocked_.pop_front();
+    auto it = channels_.find(channel_id);
+    if (it == channels_.end() || !it->second.queue_blocked) {
+      continue;
+    }
+    OpenedChannel &channel = it->second;
+    channel.queue_blocked = false;
+    Resume(channel, /*force=*/false, channel.weight, ret);
+  }
+  return ret;
+}
+
+void AmtPortForwarding::Resume(OpenedChannel &channel, bool force, uint32_t max_frames,
+                               std::vector<SendDataCompletion> &completions) {
+  uint32_t channel_id = channel.id;
+  FlushSendBuffer(channel, force, max_frames);
+  MaybeSendClose(channel);
+  if (!IsBlocked(channel) && channel.want_send_completion && !channel.aborted) {
+    completions.push_back(SendDataCompletion{.channel_id = channel_id});
+    channel.want_send_completion = false;
+  }
+  MaybeReclaim(channel_id);
+}
+
+absl::Time AmtPortForwarding::NextPacingTime() const {
+  absl::Time next = absl::InfiniteFuture();
+  for (uint32_t channel_id : paced_) {
+    if (auto it = channels_.find(channel_id); it != channels_.end()) {
+      next = std::min(next, it->second.pacer.next_send());
+    }
+  }
+  return next;
+}
+
+std::vector<AmtPortForwarding::SendDataCompletion>
+AmtPortForwarding::HandlePacing(absl::Time now) {
+  std::vector<uint32_t> due;
+  for (auto it = paced_.begin(); it != paced_.end();) {
+    auto channel = channels_.find(*it);
+    if (channel == channels_.end()) {
+      it = paced_.erase(it);
+    } else if (channel->second.pacer.next_send() <= now) {
+      due.push_back(*it);
+      it = paced_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  std::vector<SendDataCompletion> ret;
+  for (uint32_t channel_id : due) {
+    OpenedChannel &channel = channels_.find(channel_id)->second;
+    channel.paced = false;
+    Resume(channel, channel.paced_force, /*max_frames=*/0, ret);
+  }
+  return ret;
+}
+
+const SendPacer *AmtPortForwarding::pacer(uint32_t channel_id) const {
+  auto it = channels_.find(channel_id);
+  return it == channels_.end() ? nullptr : &it->second.pacer;
+}
+
+bool AmtPortForwarding::CheckLiveness(absl::Time now, absl::Duration idle,
+                                      absl::Duration timeout) {
+  if (!connected()) {
+    return true;
+  }
+  const char *stall = nullptr;
+  if (!out_queue_.empty() && now - out_queue_.front().enqueued > timeout) {
+    stall = "MEI not writable";
+  } else if (probe_sent_ != absl::InfinitePast() && now - probe_sent_ > timeout) {
+    if (answers_probes_ && last_receive_ < probe_sent_) {
+      stall = "keepalive not answered";
+    } else {
+      // ME is busy or ignores probes, probe again once idle.
+      probe_sent_ = absl::InfinitePast();
+    }
+  }
+  if (stall != nullptr) {
+    absl::PrintF("ME stalled: %s for %s\n", stall, absl::FormatDuration(timeout));
+    stats_.liveness_failures++;
+    disconnected_ = true;
+    return false;
+  }
+
+  if (probe_sent_ == absl::InfinitePast() && now - last_receive_ >= idle) {
+    probe_cookie_++;
+    probe_sent_ = now;
+    stats_.keepalives_sent++;
+    Send(ApfKeepAliveRequest{.cookie = probe_cookie_}.Serialize());
+  }
+  return true;
+}
+
+void AmtPortForwarding::FlushSendBuffer(OpenedChannel &channel, bool force,
+                                        uint32_t max_frames) {
+  if (!channel.confirmed || channel.send_buf.empty()) {
+    return;
+  }
+  // Messages are encoded straight from send_buf into a pooled buffer.
+  const size_t max_data_len = max_msg_length_ - ApfChannelData::kHeaderSize;
+  const absl::Time now = absl::Now();
+  uint32_t frames = 0;
+  while (!channel.send_buf.empty() && channel.send_window > 0) {
+    if (channel.corked && !force && channel.send_buf.size() < max_data_len) {
+      break;
+    }
+    // Backpressure, resumed by HandleWritable(). Forced flushes are small
+    // and bypass the limit.
+    if (OutQueueFull() && !force) {
+      stats_.out_queue_full++;
+      QueueBlocked(channel);
+      break;
+    }
+    // Turn is over, let the other blocked channels send.
+    if (max_frames > 0 && frames == max_frames) {
+      QueueBlocked(channel);
+      break;
+    }
+    if (pacing_ && channel.pacer.next_send() > now) {
+      if (!channel.paced) {
+        stats_.paced++;
+        channel.paced = true;
+        paced_.insert(channel.id);
+      }
+      channel.paced_force = force;
+      break;
+    }
+    frames++;
+    size_t len = std::min<size_t>(
+        {channel.send_window, channel.send_buf.size(), max_data_len});
+    BufferPool::Buffer msg = pool_->Get();
+    auto data = msg.span().subspan(0, ApfChannelData::kHeaderSize + len);
+    ApfChannelData::FillHeader(data, channel.peer_channel_id, len);
+    channel.send_buf.CopyTo(data.subspan(ApfChannelData::kHeaderSize));
+    Send(std::move(msg), data.size());
+    channel.pacer.OnSend(len, now);
+    channel.send_window -= len;
+    channel.send_buf.Pop(len);
+    if (channel.corked) {
+      stats_.cork_frames++;
+    }
+  }
+  if (channel.send_window == 0 && !channel.send_buf.empty() && !channel.window_stalled) {
+    channel.window_stalled = true;
+    channel.stalled_since = now;
+    stats_.window_stalls++;
+    channel.pacer.OnStall(now);
+  }
+  if (channel.corked && channel.send_buf.empty()) {
+    stats_.cork_delay += now - channel.corked_since;
+  }
+}
+
+void AmtPortForwarding::QueueBlocked(OpenedChannel &channel) {
+  if (!channel.queue_blocked) {
+    channel.queue_blocked = true;
+    queue_blocked_.push_back(channel.id);
+  }
+}
+
+bool AmtPortForwarding::IsBlocked(const OpenedChannel &channel) const {
+  if (channel.send_buf.empty()) {
+    return false;
+  }
+  if (!channel.confirmed) {
+    return channel.send_buf.size() >= max_early_data_;
+  }
+  // A held back partial frame doesn't block the caller if it fits the window.
+  const size_t max_data_len = max_msg_length_ - ApfChannelData::kHeaderSize;
+  return !channel.corked || channel.send_buf.size() >= max_data_len ||
+         channel.send_buf.size() > channel.send_window;
+}
+
+void AmtPortForwarding::MaybeSendClose(OpenedChannel &channel) {
+  if (!channel.close_requested || channel.close_sent || !channel.confirmed ||
+      !channel.send_buf.empty()) {
+    return;
+  }
+  ApfChannelClose req{.recipient_channel = channel.peer_channel_id};
   Send(req.Serialize());
-  channel.send_window -= len;
-  channel.send_buf = channel.send_buf.substr(len);
+  channel.close_sent = true;
+}
+
+bool AmtPortForwarding::MaybeReclaim(uint32_t channel_id) {
+  auto it = channels_.find(channel_id);
+  if (it == channels_.end()) {
+    return false;
+  }
+  const OpenedChannel &channel = it->second;
+  if (!channel.close_sent || !channel.close_received || !channel.recv_buf.empty()) {
+    return false;
+  }
+  channels_.erase(it);
+  stats_.channels_reclaimed++;
+  return true;
 }
 
 } // namespace amt
@@ -1,12 +1,24 @@
 #ifndef __APF_H__
 #define __APF_H__
 
+#include "buffer_pool.h"
+#include "histogram.h"
+#include "mei_transport.h"
+#include "send_pacer.h"
+
 #include <cinttypes>
 
+#include <absl/time/time.h>
 #include <absl/types/span.h>
+#include <deque>
+#include <functional>
+#include <memory>
 #include <optional>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <variant>
+#include <vector>
 
 namespace amt {
 
@@ -124,6 +136,23 @@ struct ApfChannelOpenConfirmation {
   std::string ToString() const;
 };
 
+struct ApfChannelOpenFailure {
+  enum Reason : uint32_t {
+    kAdministrativelyProhibited = 1,
+    kConnectFailed = 2,
+    kUnknownChannelType = 3,
+    kResourceShortage = 4,
+  };
+  static constexpr uint8_t kType = 92;
+
+  uint32_t recipient_channel;
+  Reason reason;
+
+  bool Deserialize(absl::Span<uint8_t> data);
+  std::string Serialize() const;
+  std::string ToString() const;
+};
+
 struct ApfChannelClose {
   static constexpr uint8_t kType = 97;
 
@@ -137,8 +166,15 @@ struct ApfChannelClose {
 struct ApfChannelData {
   static constexpr uint8_t kType = 94;
 
+  static constexpr size_t kHeaderSize = 9;
+
   uint32_t recipient_channel;
-  std::string data;
+  // Points into the buffer passed to Deserialize().
+  absl::Span<const uint8_t> data;
+
+  // Write the message header, the data_len bytes of data follow it.
+  static void FillHeader(absl::Span<uint8_t> to, uint32_t recipient_channel,
+                         uint32_t data_len);
 
   bool Deserialize(absl::Span<uint8_t> data);
   std::string Serialize() const;
@@ -156,11 +192,55 @@ struct ApfChannelWindowAdjust {
   std::string ToString() const;
 };
 
+// Either side may send a request, the reply echoes the cookie.
+struct ApfKeepAliveRequest {
+  static constexpr uint8_t kType = 208;
+
+  uint32_t cookie;
+
+  bool Deserialize(absl::Span<uint8_t> data);
+  std::string Serialize() const;
+  std::string ToString() const;
+};
+
+struct ApfKeepAliveReply {
+  static constexpr uint8_t kType = 209;
+
+  uint32_t cookie;
+
+  bool Deserialize(absl::Span<uint8_t> data);
+  std::string Serialize() const;
+  std::string ToString() const;
+};
+
+// Keepalive settings requested by the other side, in seconds.
+struct ApfKeepAliveOptionsRequest {
+  static constexpr uint8_t kType = 210;
+
+  uint32_t keepalive_interval;
+  uint32_t read_timeout;
+
+  bool Deserialize(absl::Span<uint8_t> data);
+  std::string Serialize() const;
+  std::string ToString() const;
+};
+
+struct ApfKeepAliveOptionsReply {
+  static constexpr uint8_t kType = 211;
+
+  bool Deserialize(absl::Span<uint8_t> data);
+  std::string Serialize() const;
+  std::string ToString() const;
+};
+
 // class AmtPortForwarding
 // The caller should monitor the fd() and drive the class by
 // calling ProcessOneMessage() when there's data available.
 // Caller then do necessary operation according to the returned
 // MeRequest object (e.g. open port, forward data etc.)
+// Messages which can't be written to MEI right away are queued, the
+// caller should also poll fd() for writing while WantWrite() is true and
+// call HandleWritable().
 class AmtPortForwarding {
 public:
   // ME requests to open a listen port.
@@ -175,8 +255,7 @@ public:
   };
 
   // Returned after OpenChannel(), can be successful or failure.
-  // SendData() should not be called before receiving a successful
-  // result.
+  // Data sent before a successful result is held back, see SendData().
   struct OpenChannelResult {
     uint32_t channel_id;
     bool success;
@@ -194,13 +273,15 @@ public:
     uint32_t channel_id;
   };
 
-  // Indicates that ME closed writer side of a channel.
-  // Caller should call CloseChannel() if it hasn't already.
+  // Indicates that ME closed writer side of a channel. No more IncomingData
+  // will follow, but data already buffered can still be read.
+  // Caller should call CloseChannel() once it has nothing more to send.
   struct ChannelClosed {
     uint32_t channel_id;
   };
 
-  // ME disconnected, caller should stop calling ProcessOneMessage()
+  // ME disconnected, caller should stop calling ProcessOneMessage() and
+  // call Disconnect(). All channels are gone.
   struct MeDisconnect {};
 
   // nullopt means no special action is needed.
@@ -209,44 +290,206 @@ public:
                    ChannelClosed, MeDisconnect>>
       MeRequest;
 
-  explicit AmtPortForwarding(std::string mei_dev);
+  // max_out_queue: number of queued outgoing messages after which channel
+  // data is held back in the channels' send_buf.
+  // max_early_data: bytes a channel can buffer while it's opening.
+  // Call Connect() before use.
+  explicit AmtPortForwarding(std::unique_ptr<MeiTransport> transport,
+                             size_t max_out_queue = 64, size_t max_early_data = 0);
   ~AmtPortForwarding();
 
+  // Connect to LME over the transport. Returns false on failure, it can be
+  // retried.
+  bool Connect();
+  // Close the MEI connection and drop all channels, without notifying the
+  // caller. Called after MeDisconnect before reconnecting.
+  void Disconnect();
+  // False after a MEI error, until reconnected.
+  bool connected() const { return connected_ && !disconnected_; }
+
   // Poll one message from MEI and dispatch it to
   // the corresponding Handler function.
   MeRequest ProcessOneMessage();
 
+  // There are queued messages, fd() should be polled for writing.
+  bool WantWrite() const { return !out_queue_.empty(); }
+  // Write queued messages. Returns completions of the channels which were
+  // blocked by a full queue.
+  std::vector<SendDataCompletion> HandleWritable();
+
+  static constexpr uint32_t kDefaultWindow = 4096;
+
   // port_from: TCP port of the initiator
   // port_to: port of the ME, must come from RequestTcpForward::port
+  // window: bytes ME may send before the received data is popped.
   // return: an assigned channel id.
-  uint32_t OpenChannel(uint32_t port_from, uint32_t port_to);
+  uint32_t OpenChannel(uint32_t port_from, uint32_t port_to,
+                       uint32_t window = kDefaultWindow);
 
   // Send data to channel.
+  // Before the channel is confirmed, data is buffered and the channel is
+  // blocked once max_early_data is reached. The buffered data is sent as
+  // the window allows right after ApfChannelOpenConfirmation, and dropped
+  // if the open fails.
   // Returns: if caller must wait for SendDataCompletion
   bool SendData(uint32_t channel_id, absl::Span<const uint8_t> data);
+  // The channel has data which can't be sent yet, a SendDataCompletion will
+  // follow. e.g. to check early data after OpenChannelResult.
+  bool IsBlocked(uint32_t channel_id) const;
+
+  // Cork mode: partial ChannelData frames are held back until a full
+  // max_msg_length frame is available, so small writes are coalesced.
+  // The caller is responsible for calling FlushCorked() after its delay.
+  // CloseChannel() flushes the held data.
+  void SetCork(uint32_t channel_id, bool corked);
+  // Returns true if data is held back by cork mode.
+  bool HasCorkedData(uint32_t channel_id) const;
+  // Send the data held back by cork mode, as far as the window allows.
+  void FlushCorked(uint32_t channel_id);
+
+  // While the MEI queue is full, channels held back are resumed round
+  // robin, each sending up to weight frames per turn. Default 1.
+  void SetWeight(uint32_t channel_id, uint32_t weight);
+
+  // Pacing mode: ChannelData frames of each channel are spread out at the
+  // rate of its SendPacer. The held back frames are sent by HandlePacing(),
+  // the caller should call it at NextPacingTime(). The round trips are
+  // measured regardless.
+  void SetPacing(bool enabled) { pacing_ = enabled; }
+  // InfiniteFuture if no channel is held back.
+  absl::Time NextPacingTime() const;
+  // Returns completions of the channels which were blocked by pacing.
+  std::vector<SendDataCompletion> HandlePacing(absl::Time now);
+  // nullptr if the channel doesn't exist.
+  const SendPacer *pacer(uint32_t channel_id) const;
+
+  // Liveness: ME is probed with ApfKeepAliveRequest once nothing has been
+  // received for idle. ME is stalled if nothing is received within timeout
+  // of a probe, or a queued message can't be written within timeout. On a
+  // stall the connection is dropped and the next ProcessOneMessage()
+  // reports MeDisconnect. Unanswered probes only count once ME has answered
+  // one, older firmware may ignore them.
+  // Call periodically. Returns false on a stall.
+  bool CheckLiveness(absl::Time now, absl::Duration idle, absl::Duration timeout);
+  // Time the last message was received from ME.
+  absl::Time last_receive() const { return last_receive_; }
+  // Keepalive round trips.
+  const LatencyHistogram &keepalive_rtt() const { return keepalive_rtt_; }
 
   // Read data from ME after receiving IncomingData.
+  // Returns the first contiguous chunk of received data, more may follow
+  // after it's popped. Empty if there's nothing to read, also once a closed
+  // channel was reclaimed by the PopData() of its last data.
   // After finishing using the data, call PopData() to remove the first N bytes.
-  const std::string *PeekData(uint32_t channel_id);
+  absl::Span<const uint8_t> PeekData(uint32_t channel_id);
   void PopData(uint32_t channel_id, uint32_t bytes_to_pop);
 
-  // Close the channel
-  // TODO graceful shutdown.
+  // Half-close the host-to-ME direction of the channel.
+  // Pending send data is flushed before ApfChannelClose is sent. The channel
+  // is reclaimed once ApfChannelClose has been both sent and received and
+  // all received data has been popped.
   void CloseChannel(uint32_t channel_id);
 
-  int fd() const { return fd_; }
+  // Close the channel without flushing. Buffered data is dropped and no
+  // more requests will be raised for this channel. If the channel is still
+  // opening, ApfChannelClose is sent once the ME confirms it.
+  // No-op if the channel has already been reclaimed.
+  void AbortChannel(uint32_t channel_id);
+
+  struct Stats {
+    uint64_t channels_opened;
+    uint64_t channels_reclaimed;
+    uint64_t channels_aborted;
+    // ApfChannelOpenFailure received.
+    uint64_t channels_open_failed;
+    // Bytes sent before the channel was confirmed.
+    uint64_t early_data;
+    // SendData() calls and ChannelData frames sent on corked channels,
+    // their difference is the number of frames saved.
+    uint64_t cork_writes;
+    uint64_t cork_frames;
+    // FlushCorked() calls which had data to send.
+    uint64_t cork_forced_flushes;
+    // Total time send_buf of corked channels stayed non-empty.
+    absl::Duration cork_delay;
+
+    // Messages which couldn't be written right away.
+    uint64_t out_queued;
+    uint64_t out_queue_peak;
+    // Times channel data was held back because the queue was full.
+    uint64_t out_queue_full;
+    // Total and max time messages stayed in the queue.
+    absl::Duration out_queue_delay;
+    absl::Duration out_queue_max_delay;
+
+    // Times a channel ran out of send window with data pending, and the
+    // total time until the window was adjusted.
+    uint64_t window_stalls;
+    absl::Duration window_stall_time;
+    // Times a channel was held back by pacing.
+    uint64_t paced;
+
+    // Probes sent and answered, keepalive requests from ME.
+    uint64_t keepalives_sent;
+    uint64_t keepalive_replies;
+    uint64_t keepalive_requests;
+    // Connections dropped by CheckLiveness().
+    uint64_t liveness_failures;
+  };
+  const Stats &stats() const { return stats_; }
+  // Number of channels not reclaimed yet, including pending opens.
+  size_t channel_count() const { return channels_.size(); }
+  size_t out_queue_depth() const { return out_queue_.size(); }
+  // Pool of max_msg_length sized buffers used for messages and channel data.
+  BufferPool::Stats pool_stats() const {
+    return pool_ == nullptr ? BufferPool::Stats{} : pool_->stats();
+  }
+
+  int fd() const { return transport_->fd(); }
 
 private:
   struct OpenedChannel {
-    uint32_t peer_channel_id;
+    OpenedChannel(uint32_t id, BufferPool *pool)
+        : id(id), send_buf(pool), recv_buf(pool),
+          pacer(pool->buffer_size() - ApfChannelData::kHeaderSize) {}
 
-    uint32_t send_window;
+    // Local channel id, key of channels_.
+    uint32_t id;
+    uint32_t peer_channel_id = 0;
+    // Set after receiving ApfChannelOpenConfirmation.
+    bool confirmed = false;
+
+    uint32_t send_window = 0;
     // data to be sent to ME
-    std::string send_buf;
+    BufferQueue send_buf;
     // data received from ME
-    std::string recv_buf;
-
-    bool want_send_completion;
+    BufferQueue recv_buf;
+
+    bool want_send_completion = false;
+
+    uint32_t weight = 1;
+    // In queue_blocked_.
+    bool queue_blocked = false;
+
+    SendPacer pacer;
+    // In paced_, the flush to resume was forced.
+    bool paced = false;
+    bool paced_force = false;
+    // send_window ran out with data pending.
+    bool window_stalled = false;
+    absl::Time stalled_since;
+
+    bool corked = false;
+    // When send_buf of a corked channel became non-empty.
+    absl::Time corked_since;
+
+    // Channel lifecycle. Close is requested by the caller, but
+    // ApfChannelClose is only sent after send_buf is drained.
+    bool close_requested = false;
+    bool close_sent = false;
+    bool close_received = false;
+    // Caller gave up on the channel, see AbortChannel().
+    bool aborted = false;
   };
 
   // Process message and fill ret.
@@ -256,24 +499,80 @@ private:
   bool Process(const ApfServiceRequest &msg, MeRequest &ret);
   bool Process(const ApfGlobalMessage &msg, MeRequest &ret);
   bool Process(const ApfChannelOpenConfirmation &msg, MeRequest &ret);
+  bool Process(const ApfChannelOpenFailure &msg, MeRequest &ret);
   bool Process(const ApfChannelClose &msg, MeRequest &ret);
   bool Process(const ApfChannelData &msg, MeRequest &ret);
   bool Process(const ApfChannelWindowAdjust &msg, MeRequest &ret);
+  bool Process(const ApfKeepAliveRequest &msg, MeRequest &ret);
+  bool Process(const ApfKeepAliveReply &msg, MeRequest &ret);
+  bool Process(const ApfKeepAliveOptionsRequest &msg, MeRequest &ret);
+  bool Process(const ApfKeepAliveOptionsReply &msg, MeRequest &ret);
+
+  struct QueuedMessage {
+    BufferPool::Buffer buf;
+    size_t len;
+    absl::Time enqueued;
+  };
 
-  // Send to ME via MEI
-  void Send(std::string data);
-  // Send send_buf to ME
-  void FlushSendBuffer(OpenedChannel &channel);
+  // Send to ME via MEI, queue the message if MEI would block.
+  void Send(const std::string &data);
+  void Send(absl::Span<const uint8_t> data);
+  void Send(BufferPool::Buffer msg, size_t len);
+  // Returns false if MEI would block.
+  bool TryWrite(absl::Span<const uint8_t> data);
+  bool OutQueueFull() const { return out_queue_.size() >= max_out_queue_; }
+  // Send send_buf to ME. In cork mode the last partial frame is held back
+  // unless force is set. With max_frames, the channel goes to the back of
+  // queue_blocked_ after sending that many frames.
+  void FlushSendBuffer(OpenedChannel &channel, bool force = false,
+                       uint32_t max_frames = 0);
+  // Append the channel to queue_blocked_, resumed by HandleWritable().
+  void QueueBlocked(OpenedChannel &channel);
+  // Flush a channel held back by the queue or pacing, and raise its
+  // completion once it's unblocked.
+  void Resume(OpenedChannel &channel, bool force, uint32_t max_frames,
+              std::vector<SendDataCompletion> &completions);
+  // send_buf has data which can't be sent until the window is adjusted.
+  bool IsBlocked(const OpenedChannel &channel) const;
+  // Send ApfChannelClose if requested and send_buf is drained.
+  void MaybeSendClose(OpenedChannel &channel);
+  // Erase the channel if both sides are closed and recv_buf is consumed.
+  // Returns true if the channel was erased.
+  bool MaybeReclaim(uint32_t channel_id);
+
+  std::unique_ptr<MeiTransport> transport_;
+  bool connected_ = false;
+  // Set on a read or write error, the transport is closed by Disconnect().
+  bool disconnected_ = false;
 
   uint64_t max_msg_length_;
-  uint64_t buffer_length_;
-  std::unique_ptr<uint8_t[]> buffer_;
+  // Must outlive all the buffers below.
+  std::unique_ptr<BufferPool> pool_;
+  BufferPool::Buffer read_buf_;
+
+  size_t max_out_queue_;
+  size_t max_early_data_;
+  std::deque<QueuedMessage> out_queue_;
+  // Channels with data held back by a full out_queue_, in the order they
+  // are resumed.
+  std::deque<uint32_t> queue_blocked_;
+  bool pacing_ = false;
+  // Channels with data held back by pacing.
+  std::unordered_set<uint32_t> paced_;
+
+  absl::Time last_receive_;
+  // Outstanding probe, probe_sent_ is InfinitePast if none.
+  uint32_t probe_cookie_ = 0;
+  absl::Time probe_sent_ = absl::InfinitePast();
+  // ME answered a probe on this connection.
+  bool answers_probes_ = false;
+  LatencyHistogram keepalive_rtt_;
 
   // channel buffers, key is local channel id.
   std::unordered_map<uint32_t, OpenedChannel> channels_;
   // std::unordered_map<uint32_t, uint32_t> local_to_me_channel_;
   uint32_t next_channel_id_ = 0;
-  int fd_ = -1;
+  Stats stats_{};
 };
 
 } // namespace amt
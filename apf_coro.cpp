@@ -0,0 +1,295 @@
+#include "apf_coro.h"
+
+#include <sys/epoll.h>
+
+#include <algorithm>
+#include <cstring>
+
+namespace amt {
+
+//
+// CoTask
+//
+
+CoTask::promise_type::~promise_type() {
+  if (executor != nullptr) {
+    executor->tasks_.erase(this);
+  }
+}
+
+//
+// CoChannel
+//
+
+CoChannel::~CoChannel() {
+  if (executor_ == nullptr) {
+    return;
+  }
+  if (state_->gone) {
+    executor_->channels_.erase(id_);
+    return;
+  }
+  if (!closed_) {
+    executor_->apf_.AbortChannel(id_);
+    executor_->channels_.erase(id_);
+    return;
+  }
+  // The channel is reclaimed once ME closes it and everything is popped.
+  executor_->Drain(id_);
+  if (state_->eof) {
+    executor_->channels_.erase(id_);
+  } else {
+    state_->detached = true;
+  }
+}
+
+void CoChannel::Close() {
+  if (closed_) {
+    return;
+  }
+  closed_ = true;
+  if (!state_->gone) {
+    executor_->apf_.CloseChannel(id_);
+  }
+}
+
+bool CoChannel::ReadAwaiter::await_ready() const {
+  const CoChannelState &state = *channel->state_;
+  return buf.empty() || state.eof || state.gone ||
+         !channel->executor_->apf_.PeekData(channel->id_).empty();
+}
+
+void CoChannel::ReadAwaiter::await_suspend(std::coroutine_handle<> caller) {
+  channel->state_->reader = caller;
+}
+
+size_t CoChannel::ReadAwaiter::await_resume() {
+  ApfExecutor *executor = channel->executor_;
+  if (channel->state_->gone) {
+    return 0;
+  }
+  size_t len = 0;
+  while (len < buf.size()) {
+    absl::Span<const uint8_t> data = executor->apf_.PeekData(channel->id_);
+    if (data.empty()) {
+      break;
+    }
+    size_t n = std::min(data.size(), buf.size() - len);
+    memcpy(buf.data() + len, data.data(), n);
+    executor->apf_.PopData(channel->id_, n);
+    len += n;
+  }
+  return len;
+}
+
+bool CoChannel::WriteAwaiter::await_suspend(std::coroutine_handle<> caller) {
+  ApfExecutor *executor = channel->executor_;
+  CoChannelState &state = *channel->state_;
+  if (state.gone || !executor->connected() || data.empty()) {
+    return false;
+  }
+  if (!executor->apf_.SendData(channel->id_, data)) {
+    return false;
+  }
+  // Resumed by SendDataCompletion.
+  state.writer = caller;
+  return true;
+}
+
+bool CoChannel::WriteAwaiter::await_resume() const {
+  return !channel->state_->gone && channel->executor_->connected();
+}
+
+//
+// ApfExecutor
+//
+
+ApfExecutor::~ApfExecutor() {
+  ready_.clear();
+  waiting_forward_.clear();
+  std::unordered_set<CoTask::promise_type *> tasks = std::move(tasks_);
+  tasks_.clear();
+  for (CoTask::promise_type *promise : tasks) {
+    promise->executor = nullptr;
+  }
+  // Channels owned by the frames are aborted.
+  for (CoTask::promise_type *promise : tasks) {
+    std::coroutine_handle<CoTask::promise_type>::from_promise(*promise).destroy();
+  }
+}
+
+void ApfExecutor::Spawn(CoTask task) {
+  std::coroutine_handle<CoTask::promise_type> handle =
+      std::exchange(task.handle_, nullptr);
+  handle.promise().executor = this;
+  tasks_.insert(&handle.promise());
+  handle.resume();
+}
+
+void ApfExecutor::OpenAwaiter::await_suspend(std::coroutine_handle<> caller) {
+  handle = caller;
+  if (executor->forwarded_.count(port_to) > 0) {
+    executor->StartOpen(*this);
+  } else {
+    executor->waiting_forward_[port_to].push_back(this);
+  }
+}
+
+std::optional<CoChannel> ApfExecutor::OpenAwaiter::await_resume() {
+  if (!channel_id.has_value()) {
+    return std::nullopt;
+  }
+  auto it = executor->channels_.find(*channel_id);
+  if (it == executor->channels_.end()) {
+    return std::nullopt;
+  }
+  if (!it->second.open_success || it->second.gone) {
+    executor->channels_.erase(it);
+    return std::nullopt;
+  }
+  return CoChannel(executor, &it->second, *channel_id);
+}
+
+uint32_t ApfExecutor::events() const {
+  return EPOLLIN | (apf_.WantWrite() ? EPOLLOUT : 0);
+}
+
+void ApfExecutor::HandleEvents(uint32_t events) {
+  if (disconnected_) {
+    return;
+  }
+  if (events & EPOLLOUT) {
+    for (const auto &comp : apf_.HandleWritable()) {
+      Dispatch(comp);
+    }
+  }
+  // Errors are reported as MeDisconnect.
+  if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+    Dispatch(apf_.ProcessOneMessage());
+  }
+  RunReady();
+}
+
+void ApfExecutor::Dispatch(AmtPortForwarding::MeRequest req) {
+  if (!req.has_value() || disconnected_) {
+    return;
+  }
+  if (const auto *fwd_req = std::get_if<AmtPortForwarding::RequestTcpForward>(&*req)) {
+    fwd_req->accept();
+    forwarded_.insert(fwd_req->port);
+    auto it = waiting_forward_.find(fwd_req->port);
+    if (it != waiting_forward_.end()) {
+      std::vector<OpenAwaiter *> waiters = std::move(it->second);
+      waiting_forward_.erase(it);
+      for (OpenAwaiter *waiter : waiters) {
+        StartOpen(*waiter);
+      }
+    }
+  } else if (std::holds_alternative<AmtPortForwarding::MeDisconnect>(*req)) {
+    OnDisconnect();
+    return;
+  }
+
+  uint32_t channel_id;
+  if (const auto *r = std::get_if<AmtPortForwarding::OpenChannelResult>(&*req)) {
+    channel_id = r->channel_id;
+  } else if (const auto *r = std::get_if<AmtPortForwarding::SendDataCompletion>(&*req)) {
+    channel_id = r->channel_id;
+  } else if (const auto *r = std::get_if<AmtPortForwarding::IncomingData>(&*req)) {
+    channel_id = r->channel_id;
+  } else if (const auto *r = std::get_if<AmtPortForwarding::ChannelClosed>(&*req)) {
+    channel_id = r->channel_id;
+  } else {
+    return;
+  }
+  auto it = channels_.find(channel_id);
+  if (it == channels_.end()) {
+    return;
+  }
+  CoChannelState &state = it->second;
+
+  if (const auto *r = std::get_if<AmtPortForwarding::OpenChannelResult>(&*req)) {
+    state.open_success = r->success;
+    state.gone = !r->success;
+    Schedule(std::exchange(state.opener, nullptr));
+  } else if (std::holds_alternative<AmtPortForwarding::SendDataCompletion>(*req)) {
+    // Also raised after writes which didn't block, nobody waits then.
+    Schedule(std::exchange(state.writer, nullptr));
+  } else if (std::holds_alternative<AmtPortForwarding::IncomingData>(*req)) {
+    if (state.detached) {
+      Drain(channel_id);
+    }
+    Schedule(std::exchange(state.reader, nullptr));
+  } else {
+    state.eof = true;
+    if (state.detached) {
+      Drain(channel_id);
+      channels_.erase(it);
+      return;
+    }
+    Schedule(std::exchange(state.reader, nullptr));
+  }
+}
+
+void ApfExecutor::StartOpen(OpenAwaiter &awaiter) {
+  uint32_t channel_id =
+      apf_.OpenChannel(awaiter.port_from, awaiter.port_to, awaiter.window);
+  awaiter.channel_id = channel_id;
+  channels_[channel_id].opener = awaiter.handle;
+}
+
+void ApfExecutor::Drain(uint32_t channel_id) {
+  while (true) {
+    absl::Span<const uint8_t> data = apf_.PeekData(channel_id);
+    if (data.empty()) {
+      break;
+    }
+    apf_.PopData(channel_id, data.size());
+  }
+}
+
+void ApfExecutor::OnDisconnect() {
+  disconnected_ = true;
+  for (auto it = channels_.begin(); it != channels_.end();) {
+    CoChannelState &state = it->second;
+    if (state.detached) {
+      it = channels_.erase(it);
+      continue;
+    }
+    state.gone = true;
+    Schedule(std::exchange(state.opener, nullptr));
+    Schedule(std::exchange(state.reader, nullptr));
+    Schedule(std::exchange(state.writer, nullptr));
+    ++it;
+  }
+  for (auto &[port, waiters] : waiting_forward_) {
+    for (OpenAwaiter *waiter : waiters) {
+      Schedule(waiter->handle);
+    }
+  }
+  waiting_forward_.clear();
+  forwarded_.clear();
+}
+
+void ApfExecutor::Schedule(std::coroutine_handle<> handle) {
+  if (handle) {
+    ready_.push_back(handle);
+  }
+}
+
+void ApfExecutor::RunReady() {
+  while (true) {
+    // e.g. a MEI write error.
+    if (!disconnected_ && !apf_.connected()) {
+      OnDisconnect();
+    }
+    if (ready_.empty()) {
+      break;
+    }
+    std::coroutine_handle<> handle = ready_.front();
+    ready_.pop_front();
+    handle.resume();
+  }
+}
+
+} // namespace amt
@@ -0,0 +1,216 @@
+#ifndef __APF_CORO_H__
+#define __APF_CORO_H__
+
+#include "apf.h"
+
+#include <cinttypes>
+#include <coroutine>
+#include <deque>
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <absl/types/span.h>
+
+// C++20 coroutine API on top of AmtPortForwarding, e.g.
+//
+//   CoTask Get(ApfExecutor &executor) {
+//     std::optional<CoChannel> channel = co_await executor.OpenChannel(16992);
+//     if (!channel) co_return;
+//     co_await channel->Write(request);
+//     while (size_t len = co_await channel->Read(buf)) { ... }
+//     channel->Close();
+//   }
+//   executor.Spawn(Get(executor));
+//
+// Everything runs on the thread driving the executor.
+
+namespace amt {
+
+class ApfExecutor;
+
+// class CoTask
+// Fire and forget coroutine, started by ApfExecutor::Spawn(). The frame is
+// freed when the coroutine returns, or by the executor if it's still
+// suspended when the executor is destroyed.
+class CoTask {
+public:
+  struct promise_type {
+    ApfExecutor *executor = nullptr;
+
+    CoTask get_return_object() {
+      return CoTask(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+    ~promise_type();
+  };
+
+  CoTask(CoTask &&other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+  CoTask(const CoTask &) = delete;
+  CoTask &operator=(const CoTask &) = delete;
+  // Not spawned.
+  ~CoTask() {
+    if (handle_) {
+      handle_.destroy();
+    }
+  }
+
+private:
+  friend class ApfExecutor;
+  explicit CoTask(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+
+  std::coroutine_handle<promise_type> handle_;
+};
+
+// struct CoChannelState
+// Per channel state shared by CoChannel and ApfExecutor.
+struct CoChannelState {
+  std::coroutine_handle<> opener;
+  std::coroutine_handle<> reader;
+  std::coroutine_handle<> writer;
+  bool open_success = false;
+  // ME closed its side.
+  bool eof = false;
+  // Open failed or ME disconnected.
+  bool gone = false;
+  // The CoChannel was destroyed after Close(), the rest of the data from ME
+  // is dropped.
+  bool detached = false;
+};
+
+// class CoChannel
+// A channel opened by ApfExecutor::OpenChannel(). At most one Read() and
+// one Write() may be pending at a time. Destroying the channel aborts it
+// unless Close() was called, data still arriving from ME is then dropped.
+class CoChannel {
+public:
+  struct ReadAwaiter {
+    CoChannel *channel;
+    absl::Span<uint8_t> buf;
+
+    bool await_ready() const;
+    void await_suspend(std::coroutine_handle<> caller);
+    size_t await_resume();
+  };
+
+  struct WriteAwaiter {
+    CoChannel *channel;
+    absl::Span<const uint8_t> data;
+
+    bool await_ready() const { return false; }
+    bool await_suspend(std::coroutine_handle<> caller);
+    bool await_resume() const;
+  };
+
+  CoChannel(CoChannel &&other) noexcept
+      : executor_(std::exchange(other.executor_, nullptr)), state_(other.state_),
+        id_(other.id_), closed_(other.closed_) {}
+  CoChannel(const CoChannel &) = delete;
+  CoChannel &operator=(const CoChannel &) = delete;
+  ~CoChannel();
+
+  uint32_t id() const { return id_; }
+
+  // Resumes with the number of bytes read, as much as is buffered up to
+  // buf.size(). 0 once ME closed the channel and everything was read, or
+  // after ME disconnected.
+  ReadAwaiter Read(absl::Span<uint8_t> buf) { return ReadAwaiter{this, buf}; }
+  // The data is copied. Suspends while the send window or the MEI queue is
+  // exhausted. Resumes with false if the channel is gone.
+  WriteAwaiter Write(absl::Span<const uint8_t> data) { return WriteAwaiter{this, data}; }
+  // Half-close once the written data is sent. Read() still works.
+  void Close();
+
+private:
+  friend class ApfExecutor;
+  CoChannel(ApfExecutor *executor, CoChannelState *state, uint32_t id)
+      : executor_(executor), state_(state), id_(id) {}
+
+  ApfExecutor *executor_;
+  // Owned by the executor, map nodes don't move.
+  CoChannelState *state_;
+  uint32_t id_;
+  bool closed_ = false;
+};
+
+// class ApfExecutor
+// Single threaded executor for CoTask, driven by the caller's epoll loop:
+// poll fd() for events() and pass what fired to HandleEvents(). The
+// MeRequests of AmtPortForwarding are turned into coroutine resumptions,
+// resumed coroutines run before HandleEvents() returns.
+// Every port ME requests to forward is accepted. The executor must own all
+// channels of the AmtPortForwarding it drives.
+class ApfExecutor {
+public:
+  struct OpenAwaiter {
+    ApfExecutor *executor;
+    uint32_t port_to;
+    uint32_t port_from;
+    uint32_t window;
+    std::coroutine_handle<> handle;
+    // Set once OpenChannel() was called.
+    std::optional<uint32_t> channel_id;
+
+    bool await_ready() const { return !executor->connected(); }
+    void await_suspend(std::coroutine_handle<> caller);
+    std::optional<CoChannel> await_resume();
+  };
+
+  // apf must be connected.
+  explicit ApfExecutor(AmtPortForwarding &apf) : apf_(apf) {}
+  ~ApfExecutor();
+
+  // Run the task until its first suspension.
+  void Spawn(CoTask task);
+
+  // Suspends until ME forwards port_to if it hasn't yet, then until the
+  // open is confirmed. Resumes with nullopt if ME rejects the open or
+  // disconnects.
+  OpenAwaiter OpenChannel(uint32_t port_to, uint32_t port_from = 0,
+                          uint32_t window = AmtPortForwarding::kDefaultWindow) {
+    return OpenAwaiter{this, port_to, port_from, window};
+  }
+
+  int fd() const { return apf_.fd(); }
+  // epoll events to wait for on fd().
+  uint32_t events() const;
+  void HandleEvents(uint32_t events);
+
+  // False after ME disconnected. All pending operations have been resumed
+  // with failures, the caller should Disconnect() the AmtPortForwarding.
+  bool connected() const { return !disconnected_ && apf_.connected(); }
+  // Suspended or not yet finished tasks.
+  size_t task_count() const { return tasks_.size(); }
+
+private:
+  friend class CoTask;
+  friend class CoChannel;
+
+  void Dispatch(AmtPortForwarding::MeRequest req);
+  void StartOpen(OpenAwaiter &awaiter);
+  // Pop everything buffered for the channel.
+  void Drain(uint32_t channel_id);
+  // Resume all waiters with failures.
+  void OnDisconnect();
+  void Schedule(std::coroutine_handle<> handle);
+  void RunReady();
+
+  AmtPortForwarding &apf_;
+  bool disconnected_ = false;
+  std::unordered_set<CoTask::promise_type *> tasks_;
+  std::deque<std::coroutine_handle<>> ready_;
+  // Ports forwarded by ME, and opens waiting for a port.
+  std::unordered_set<uint32_t> forwarded_;
+  std::unordered_map<uint32_t, std::vector<OpenAwaiter *>> waiting_forward_;
+  // Key is the channel id.
+  std::unordered_map<uint32_t, CoChannelState> channels_;
+};
+
+} // namespace amt
+
+#endif // __APF_CORO_H__
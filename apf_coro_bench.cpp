@@ -0,0 +1,333 @@
+#include "apf.h"
+#include "apf_coro.h"
+#include "die.h"
+#include "histogram.h"
+#include "mei_transport.h"
+#include "wsman_profiler.h"
+
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <absl/flags/flag.h>
+#include <absl/flags/parse.h>
+#include <absl/flags/usage.h>
+#include <absl/strings/match.h>
+#include <absl/strings/str_format.h>
+#include <absl/time/clock.h>
+#include <absl/time/time.h>
+
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+ABSL_FLAG(std::string, mei_device, "/dev/mei0",
+          "Path to the MEI chardev, or unix:<path> for a simulated ME "
+          "(apf_loadgen --simulate_me)");
+ABSL_FLAG(std::string, mode, "coro",
+          "coro: one CoTask per channel on ApfExecutor. callback: a hand-written "
+          "state machine on the MeRequests, like apfd");
+ABSL_FLAG(uint32_t, port, 16992, "Port forwarded by ME to open the channels to");
+ABSL_FLAG(uint32_t, channels, 16, "Number of concurrent channels");
+ABSL_FLAG(uint32_t, requests, 1000, "Back to back HTTP requests per channel");
+ABSL_FLAG(std::string, path, "/", "HTTP path to GET");
+
+namespace amt {
+namespace {
+
+constexpr size_t kReadChunk = 16384;
+
+absl::Span<const uint8_t> AsBytes(const std::string &s) {
+  return absl::MakeConstSpan(reinterpret_cast<const uint8_t *>(s.data()), s.size());
+}
+
+absl::Duration CpuTime() {
+  rusage usage;
+  die_if(getrusage(RUSAGE_SELF, &usage) != 0, "getrusage errno=%d", errno);
+  return absl::DurationFromTimeval(usage.ru_utime) +
+         absl::DurationFromTimeval(usage.ru_stime);
+}
+
+struct ResponseCounter : public HttpFramer::Handler {
+  uint32_t responses = 0;
+
+  bool OnHead(absl::string_view head) override { return true; }
+  void OnBody(absl::Span<const uint8_t> data) override {}
+  void OnEnd() override { responses++; }
+};
+
+// class Bench
+// Runs --channels channels of --requests request/response round trips
+// each, through one of the two ways of driving AmtPortForwarding. The time
+// and CPU are counted from the first request to the last response.
+class Bench {
+public:
+  Bench()
+      : port_(absl::GetFlag(FLAGS_port)), channels_(absl::GetFlag(FLAGS_channels)),
+        requests_(absl::GetFlag(FLAGS_requests)),
+        request_(absl::StrFormat("GET %s HTTP/1.1\r\nHost: localhost\r\n\r\n",
+                                 absl::GetFlag(FLAGS_path))),
+        apf_(MakeTransport()) {}
+
+  int Run() {
+    if (!apf_.Connect()) {
+      return 1;
+    }
+    epoll_fd_ = epoll_create(1);
+    die_if(epoll_fd_ < 0, "epoll_create errno=%d", errno);
+
+    std::string mode = absl::GetFlag(FLAGS_mode);
+    if (mode == "coro") {
+      RunCoro();
+    } else if (mode == "callback") {
+      RunCallback();
+    } else {
+      die("unknown mode %s", mode.c_str());
+    }
+
+    absl::Duration elapsed = end_ - start_;
+    absl::Duration cpu = cpu_end_ - cpu_start_;
+    absl::PrintF("mode=%s channels=%u requests=%u failures=%u time=%s rate=%.0f/s "
+                 "cpu=%s cpu_per_request=%s\n",
+                 mode, channels_, completed_, failures_, absl::FormatDuration(elapsed),
+                 completed_ / absl::ToDoubleSeconds(elapsed), absl::FormatDuration(cpu),
+                 absl::FormatDuration(completed_ > 0 ? cpu / completed_
+                                                     : absl::ZeroDuration()));
+    absl::PrintF("Request latency: %s\n", latency_.ToString());
+    return failures_ > 0 ? 1 : 0;
+  }
+
+private:
+  static std::unique_ptr<MeiTransport> MakeTransport() {
+    std::string dev = absl::GetFlag(FLAGS_mei_device);
+    if (absl::StartsWith(dev, "unix:")) {
+      return std::make_unique<MeiUnixSocket>(dev.substr(5));
+    }
+    return std::make_unique<MeiDevice>(dev);
+  }
+
+  // Wait for events on the MEI fd and pass them to handler.
+  template <typename Handler> void Poll(uint32_t events, Handler handler) {
+    if (events != apf_events_) {
+      epoll_event ev{.events = events, .data = {.fd = apf_.fd()}};
+      int op = apf_events_ == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+      die_if(epoll_ctl(epoll_fd_, op, apf_.fd(), &ev) == -1, "epoll_ctl errno=%d",
+             errno);
+      apf_events_ = events;
+    }
+    epoll_event ev;
+    int n = epoll_wait(epoll_fd_, &ev, 1, -1);
+    die_if(n < 0 && errno != EINTR, "epoll_wait errno=%d", errno);
+    if (n == 1) {
+      handler(ev.events);
+    }
+  }
+
+  void OnRequest() {
+    if (start_ == absl::InfinitePast()) {
+      start_ = absl::Now();
+      cpu_start_ = CpuTime();
+    }
+  }
+
+  void OnResponse(absl::Time request_start) {
+    end_ = absl::Now();
+    cpu_end_ = CpuTime();
+    latency_.Add(end_ - request_start);
+    completed_++;
+  }
+
+  //
+  // Coroutines
+  //
+
+  CoTask CoClient(ApfExecutor &executor) {
+    std::optional<CoChannel> channel = co_await executor.OpenChannel(port_);
+    if (!channel) {
+      failures_++;
+      co_return;
+    }
+    HttpFramer framer;
+    ResponseCounter counter;
+    uint8_t buf[kReadChunk];
+    for (uint32_t i = 0; i < requests_; i++) {
+      OnRequest();
+      absl::Time request_start = absl::Now();
+      if (!co_await channel->Write(AsBytes(request_))) {
+        failures_++;
+        co_return;
+      }
+      while (counter.responses == i) {
+        size_t len = co_await channel->Read(absl::MakeSpan(buf));
+        if (len == 0) {
+          failures_++;
+          co_return;
+        }
+        framer.Feed(absl::MakeConstSpan(buf, len), counter);
+      }
+      OnResponse(request_start);
+    }
+    channel->Close();
+  }
+
+  void RunCoro() {
+    ApfExecutor executor(apf_);
+    for (uint32_t i = 0; i < channels_; i++) {
+      executor.Spawn(CoClient(executor));
+    }
+    while (executor.task_count() > 0 && executor.connected()) {
+      Poll(executor.events(), [&](uint32_t events) { executor.HandleEvents(events); });
+    }
+  }
+
+  //
+  // Callbacks
+  //
+
+  struct Client {
+    uint32_t sent = 0;
+    // Waiting for SendDataCompletion, the next request is held back.
+    bool blocked = false;
+    bool want_send = false;
+    absl::Time request_start;
+    HttpFramer framer;
+    ResponseCounter counter;
+  };
+
+  void SendRequest(uint32_t channel_id, Client &client) {
+    if (client.blocked) {
+      client.want_send = true;
+      return;
+    }
+    OnRequest();
+    client.request_start = absl::Now();
+    client.sent++;
+    client.blocked = apf_.SendData(channel_id, AsBytes(request_));
+  }
+
+  void HandleMeRequest(AmtPortForwarding::MeRequest req) {
+    if (!req.has_value()) {
+      return;
+    }
+    if (const auto *fwd_req = std::get_if<AmtPortForwarding::RequestTcpForward>(&*req)) {
+      fwd_req->accept();
+      if (fwd_req->port == port_ && clients_.empty()) {
+        for (uint32_t i = 0; i < channels_; i++) {
+          clients_.try_emplace(apf_.OpenChannel(0, port_));
+        }
+      }
+      return;
+    }
+    if (std::holds_alternative<AmtPortForwarding::MeDisconnect>(*req)) {
+      failures_ += clients_.size();
+      clients_.clear();
+      return;
+    }
+
+    if (const auto *open_result =
+            std::get_if<AmtPortForwarding::OpenChannelResult>(&*req)) {
+      auto it = clients_.find(open_result->channel_id);
+      if (it == clients_.end()) {
+        return;
+      }
+      if (!open_result->success) {
+        failures_++;
+        clients_.erase(it);
+        return;
+      }
+      SendRequest(it->first, it->second);
+    } else if (const auto *comp =
+                   std::get_if<AmtPortForwarding::SendDataCompletion>(&*req)) {
+      auto it = clients_.find(comp->channel_id);
+      if (it == clients_.end()) {
+        return;
+      }
+      Client &client = it->second;
+      client.blocked = false;
+      if (client.want_send) {
+        client.want_send = false;
+        SendRequest(it->first, client);
+      }
+    } else if (const auto *incoming =
+                   std::get_if<AmtPortForwarding::IncomingData>(&*req)) {
+      auto it = clients_.find(incoming->channel_id);
+      if (it == clients_.end()) {
+        return;
+      }
+      uint32_t channel_id = it->first;
+      Client &client = it->second;
+      while (true) {
+        absl::Span<const uint8_t> data = apf_.PeekData(channel_id);
+        if (data.empty()) {
+          break;
+        }
+        client.framer.Feed(data, client.counter);
+        apf_.PopData(channel_id, data.size());
+      }
+      if (client.counter.responses < client.sent) {
+        return;
+      }
+      OnResponse(client.request_start);
+      if (client.sent < requests_) {
+        SendRequest(channel_id, client);
+      } else {
+        apf_.CloseChannel(channel_id);
+        clients_.erase(it);
+        done_++;
+      }
+    } else if (const auto *closed =
+                   std::get_if<AmtPortForwarding::ChannelClosed>(&*req)) {
+      // ME closed before all responses arrived.
+      if (clients_.erase(closed->channel_id) > 0) {
+        failures_++;
+      }
+    }
+  }
+
+  void RunCallback() {
+    while (done_ + failures_ < channels_ && apf_.connected()) {
+      uint32_t events = EPOLLIN | (apf_.WantWrite() ? EPOLLOUT : 0);
+      Poll(events, [&](uint32_t events) {
+        if (events & EPOLLOUT) {
+          for (const auto &comp : apf_.HandleWritable()) {
+            HandleMeRequest(comp);
+          }
+        }
+        if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+          HandleMeRequest(apf_.ProcessOneMessage());
+        }
+      });
+    }
+  }
+
+  uint32_t port_;
+  uint32_t channels_;
+  uint32_t requests_;
+  std::string request_;
+  AmtPortForwarding apf_;
+  int epoll_fd_ = -1;
+  uint32_t apf_events_ = 0;
+
+  // Callback mode, key is the channel id.
+  std::unordered_map<uint32_t, Client> clients_;
+  uint32_t done_ = 0;
+
+  uint32_t completed_ = 0;
+  uint32_t failures_ = 0;
+  absl::Time start_ = absl::InfinitePast();
+  absl::Time end_ = absl::InfinitePast();
+  absl::Duration cpu_start_;
+  absl::Duration cpu_end_;
+  LatencyHistogram latency_;
+};
+
+} // namespace
+} // namespace amt
+
+int main(int argc, char *argv[]) {
+  absl::SetProgramUsageMessage("Benchmark ApfExecutor against the MeRequest callbacks");
+  absl::ParseCommandLine(argc, argv);
+
+  amt::Bench bench;
+  return bench.Run();
+}
@@ -0,0 +1,682 @@
+#include "apf.h"
+#include "die.h"
+#include "histogram.h"
+#include "mei_transport.h"
+#include "wsman_profiler.h"
+
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <absl/flags/flag.h>
+#include <absl/flags/parse.h>
+#include <absl/flags/usage.h>
+#include <absl/strings/match.h>
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_format.h>
+#include <absl/time/clock.h>
+#include <absl/time/time.h>
+
+#include <arpa/inet.h>
+#include <endian.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+ABSL_FLAG(std::string, target, "127.0.0.1",
+          "Address apfd listens on, or unix:<dir> for its --unix_socket_dir");
+ABSL_FLAG(std::vector<std::string>, ports, {"16992"},
+          "Ports to connect to, connections are spread over them");
+ABSL_FLAG(uint32_t, connections, 16, "Number of concurrent connections");
+ABSL_FLAG(absl::Duration, duration, absl::Seconds(10), "How long to run");
+ABSL_FLAG(std::string, workload, "keepalive",
+          "churn: one request per connection, then reconnect. "
+          "keepalive: back to back requests on persistent connections. "
+          "bulk: like keepalive, with a large response body");
+ABSL_FLAG(std::string, path, "",
+          "HTTP path to GET, default / and /1048576 for bulk. The simulated ME "
+          "answers with as many body bytes as a numeric last path segment");
+ABSL_FLAG(absl::Duration, report_interval, absl::Seconds(1),
+          "Print the rates this often");
+ABSL_FLAG(std::string, simulate_me, "",
+          "Act as the ME on this unix socket, for apfd --mei_device=unix:<path>. "
+          "--ports are forwarded by the simulated ME");
+ABSL_FLAG(uint32_t, sim_response_size, 512,
+          "Body size of simulated ME responses without a numeric path");
+ABSL_FLAG(uint32_t, sim_max_msg_length, 4096, "max_msg_length of the simulated ME");
+ABSL_FLAG(uint32_t, sim_window, 4096, "Receive window of simulated ME channels");
+ABSL_FLAG(absl::Duration, sim_wedge_after, absl::ZeroDuration(),
+          "Stop answering apfd this long after it connects, to test its liveness "
+          "checks. 0 to disable");
+
+namespace amt {
+namespace {
+
+sockaddr *sa_ptr(sockaddr_in &sa) { return reinterpret_cast<sockaddr *>(&sa); }
+sockaddr *sa_ptr(sockaddr_un &sa) { return reinterpret_cast<sockaddr *>(&sa); }
+
+void epoll_ctl_add(int epfd, int fd, uint32_t events) {
+  struct epoll_event ev;
+  ev.events = events;
+  ev.data.fd = fd;
+  int err = epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+  die_if(err == -1, "epoll_ctl_add errno=%d", errno);
+}
+
+// Generated responses are held back while this many messages are queued.
+constexpr size_t kSimMaxOutQueue = 256;
+
+// class SimulatedMe
+// The ME end of APF on a SOCK_SEQPACKET unix socket (see MeiUnixSocket).
+// It forwards the given ports, confirms every channel and answers each
+// HTTP request on a channel with a 200 response, within the window
+// granted by apfd. One apfd is served at a time.
+class SimulatedMe {
+public:
+  SimulatedMe(const std::string &path, std::vector<uint32_t> ports, int epoll_fd)
+      : ports_(std::move(ports)), epoll_fd_(epoll_fd),
+        max_msg_length_(absl::GetFlag(FLAGS_sim_max_msg_length)),
+        window_(absl::GetFlag(FLAGS_sim_window)),
+        response_size_(absl::GetFlag(FLAGS_sim_response_size)),
+        wedge_after_(absl::GetFlag(FLAGS_sim_wedge_after)),
+        read_buf_(max_msg_length_) {
+    die_if(max_msg_length_ <= ApfChannelData::kHeaderSize,
+           "sim_max_msg_length too small");
+    sockaddr_un sa{};
+    sa.sun_family = AF_UNIX;
+    die_if(path.size() >= sizeof(sa.sun_path), "path too long: %s", path.c_str());
+    memcpy(sa.sun_path, path.data(), path.size());
+    unlink(path.c_str());
+
+    listen_fd_ = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0);
+    die_if(listen_fd_ < 0, "socket errno=%d", errno);
+    int err = bind(listen_fd_, sa_ptr(sa), sizeof(sa));
+    die_if(err == -1, "bind %s errno=%d", path.c_str(), errno);
+    err = listen(listen_fd_, 1);
+    die_if(err == -1, "listen errno=%d", errno);
+    epoll_ctl_add(epoll_fd_, listen_fd_, EPOLLIN);
+  }
+
+  bool Owns(int fd) const { return fd == listen_fd_ || (fd >= 0 && fd == fd_); }
+  // apfd accepted or rejected all the ports.
+  bool ready() const { return fd_ >= 0 && forward_replies_ == ports_.size(); }
+
+  void HandleEvent(int fd, uint32_t events) {
+    if (fd == listen_fd_) {
+      Accept();
+      return;
+    }
+    if (events & EPOLLOUT) {
+      FlushQueue();
+      for (auto &[id, channel] : channels_) {
+        FlushChannel(*channel);
+      }
+    }
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+      ReadMessages();
+    }
+  }
+
+private:
+  struct Channel : public HttpFramer::Handler {
+    SimulatedMe *me;
+    uint32_t host_id;
+    uint32_t me_id;
+    // Bytes apfd can take.
+    uint32_t host_window;
+    HttpFramer framer;
+    // Body size of the request being read.
+    uint64_t next_body = 0;
+    // Response not sent yet.
+    std::string out_head;
+    uint64_t out_body = 0;
+
+    bool OnHead(absl::string_view head) override {
+      // GET /1048576 HTTP/1.1
+      next_body = me->response_size_;
+      absl::string_view line = head.substr(0, head.find("\r\n"));
+      size_t path_begin = line.find(' ');
+      size_t path_end = line.rfind(' ');
+      if (path_begin != absl::string_view::npos && path_end > path_begin) {
+        absl::string_view path = line.substr(path_begin + 1, path_end - path_begin - 1);
+        uint64_t size;
+        if (absl::SimpleAtoi(path.substr(path.rfind('/') + 1), &size)) {
+          next_body = size;
+        }
+      }
+      return true;
+    }
+    void OnBody(absl::Span<const uint8_t> data) override {}
+    void OnEnd() override {
+      absl::StrAppendFormat(&out_head, "HTTP/1.1 200 OK\r\nContent-Length: %u\r\n\r\n",
+                            next_body);
+      out_body += next_body;
+    }
+  };
+
+  void Accept() {
+    int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK);
+    if (fd < 0) {
+      return;
+    }
+    if (fd_ >= 0) {
+      absl::PrintF("Simulated ME: new host connection, dropping the old one\n");
+      Drop();
+    }
+    fd_ = fd;
+    handshaken_ = false;
+    connected_at_ = absl::Now();
+    forward_replies_ = 0;
+    epoll_ctl_add(epoll_fd_, fd_, EPOLLIN | EPOLLOUT | EPOLLET);
+    ReadMessages();
+  }
+
+  void Drop() {
+    close(fd_);
+    fd_ = -1;
+    channels_.clear();
+    out_queue_.clear();
+  }
+
+  void ReadMessages() {
+    while (fd_ >= 0) {
+      ssize_t len = recv(fd_, read_buf_.data(), read_buf_.size(), 0);
+      if (len < 0 && errno == EAGAIN) {
+        return;
+      }
+      if (len <= 0) {
+        absl::PrintF("Simulated ME: host disconnected\n");
+        Drop();
+        return;
+      }
+      auto data = absl::MakeSpan(read_buf_.data(), len);
+      if (!handshaken_) {
+        // Client uuid, reply with the client properties.
+        uint8_t reply[MeiUnixSocket::kHandshakeSize];
+        uint32_t le = htole32(max_msg_length_);
+        memcpy(reply, &le, 4);
+        reply[4] = 1;
+        send(fd_, reply, sizeof(reply), MSG_NOSIGNAL);
+        handshaken_ = true;
+        Send(ApfProtocolVersion{.major = 1, .minor = 0, .uuid = {}}.Serialize());
+        continue;
+      }
+      // Messages are still read so that apfd isn't blocked writing.
+      if (wedge_after_ > absl::ZeroDuration() &&
+          absl::Now() - connected_at_ > wedge_after_) {
+        continue;
+      }
+      HandleMessage(data);
+    }
+  }
+
+  void HandleMessage(absl::Span<uint8_t> data) {
+    switch (data[0]) {
+    case ApfProtocolVersion::kType:
+      Send(ApfServiceRequest{.service_name = "pfwd@amt.intel.com"}.Serialize());
+      break;
+    case ApfServiceAccept::kType:
+      for (uint32_t port : ports_) {
+        ApfGlobalMessage msg{};
+        msg.request_string = "tcpip-forward";
+        msg.want_reply = true;
+        msg.address_to_bind = "0.0.0.0";
+        msg.port_to_bind = port;
+        Send(msg.Serialize());
+      }
+      break;
+    case ApfRequestSuccess::kType:
+    case ApfRequestFailure::kType:
+      if (data[0] == ApfRequestFailure::kType) {
+        absl::PrintF("Simulated ME: a port forward was rejected\n");
+      }
+      forward_replies_++;
+      break;
+    case ApfChannelOpenRequest::kType: {
+      ApfChannelOpenRequest req{};
+      if (!req.Deserialize(data)) {
+        break;
+      }
+      auto channel = std::make_unique<Channel>();
+      channel->me = this;
+      channel->host_id = req.sender_channel;
+      channel->me_id = next_channel_id_++;
+      channel->host_window = req.initial_window_size;
+      Send(ApfChannelOpenConfirmation{.recipient_channel = channel->host_id,
+                                      .sender_channel = channel->me_id,
+                                      .initial_window_size = window_}
+               .Serialize());
+      channels_[channel->me_id] = std::move(channel);
+    } break;
+    case ApfChannelData::kType: {
+      ApfChannelData msg{};
+      auto it = channels_.end();
+      if (msg.Deserialize(data)) {
+        it = channels_.find(msg.recipient_channel);
+      }
+      if (it == channels_.end()) {
+        break;
+      }
+      Channel &channel = *it->second;
+      channel.framer.Feed(msg.data, channel);
+      Send(ApfChannelWindowAdjust{.recipient_channel = channel.host_id,
+                                  .bytes_to_add = static_cast<uint32_t>(msg.data.size())}
+               .Serialize());
+      FlushChannel(channel);
+    } break;
+    case ApfChannelWindowAdjust::kType: {
+      ApfChannelWindowAdjust msg{};
+      if (msg.Deserialize(data)) {
+        if (auto it = channels_.find(msg.recipient_channel); it != channels_.end()) {
+          it->second->host_window += msg.bytes_to_add;
+          FlushChannel(*it->second);
+        }
+      }
+    } break;
+    case ApfChannelClose::kType: {
+      ApfChannelClose msg{};
+      if (msg.Deserialize(data)) {
+        if (auto it = channels_.find(msg.recipient_channel); it != channels_.end()) {
+          Send(ApfChannelClose{.recipient_channel = it->second->host_id}.Serialize());
+          channels_.erase(it);
+        }
+      }
+    } break;
+    case ApfKeepAliveRequest::kType: {
+      ApfKeepAliveRequest msg{};
+      if (msg.Deserialize(data)) {
+        Send(ApfKeepAliveReply{.cookie = msg.cookie}.Serialize());
+      }
+    } break;
+    default:
+      absl::PrintF("Simulated ME: unexpected message type %u\n", data[0]);
+    }
+  }
+
+  // Send the pending response within the window.
+  void FlushChannel(Channel &channel) {
+    const size_t max_data_len = max_msg_length_ - ApfChannelData::kHeaderSize;
+    while (out_queue_.size() < kSimMaxOutQueue && channel.host_window > 0 &&
+           (!channel.out_head.empty() || channel.out_body > 0)) {
+      size_t len = std::min<uint64_t>(
+          std::min<size_t>(channel.host_window, max_data_len),
+          channel.out_head.size() + channel.out_body);
+      std::string msg(ApfChannelData::kHeaderSize + len, 'x');
+      auto span = absl::MakeSpan(reinterpret_cast<uint8_t *>(msg.data()), msg.size());
+      ApfChannelData::FillHeader(span, channel.host_id, len);
+      size_t head_len = std::min(len, channel.out_head.size());
+      memcpy(span.data() + ApfChannelData::kHeaderSize, channel.out_head.data(),
+             head_len);
+      channel.out_head.erase(0, head_len);
+      channel.out_body -= len - head_len;
+      channel.host_window -= len;
+      Send(std::move(msg));
+    }
+  }
+
+  void Send(std::string msg) {
+    if (out_queue_.empty() && send(fd_, msg.data(), msg.size(), MSG_NOSIGNAL) ==
+                                  static_cast<ssize_t>(msg.size())) {
+      return;
+    }
+    out_queue_.push_back(std::move(msg));
+  }
+
+  void FlushQueue() {
+    while (!out_queue_.empty()) {
+      const std::string &msg = out_queue_.front();
+      if (send(fd_, msg.data(), msg.size(), MSG_NOSIGNAL) < 0) {
+        return;
+      }
+      out_queue_.pop_front();
+    }
+  }
+
+  std::vector<uint32_t> ports_;
+  int epoll_fd_;
+  uint32_t max_msg_length_;
+  uint32_t window_;
+  uint32_t response_size_;
+  absl::Duration wedge_after_;
+  std::vector<uint8_t> read_buf_;
+  int listen_fd_;
+  // -1 when apfd is not connected.
+  int fd_ = -1;
+  bool handshaken_ = false;
+  absl::Time connected_at_;
+  size_t forward_replies_ = 0;
+  uint32_t next_channel_id_ = 0;
+  // key is the ME channel id.
+  std::unordered_map<uint32_t, std::unique_ptr<Channel>> channels_;
+  std::deque<std::string> out_queue_;
+};
+
+class LoadGen {
+public:
+  LoadGen() {
+    for (const auto &p : absl::GetFlag(FLAGS_ports)) {
+      uint32_t port = 0;
+      if (!absl::SimpleAtoi(p, &port) || port == 0 || port > 65535) {
+        die("invalid port %s", p.c_str());
+      }
+      ports_.push_back(port);
+    }
+    die_if(ports_.empty(), "no ports");
+
+    std::string workload = absl::GetFlag(FLAGS_workload);
+    if (workload == "churn") {
+      churn_ = true;
+    } else if (workload != "keepalive" && workload != "bulk") {
+      die("unknown workload %s", workload.c_str());
+    }
+    std::string path = absl::GetFlag(FLAGS_path);
+    if (path.empty()) {
+      path = workload == "bulk" ? "/1048576" : "/";
+    }
+    std::string target = absl::GetFlag(FLAGS_target);
+    if (absl::StartsWith(target, "unix:")) {
+      unix_dir_ = target.substr(5);
+      target = "localhost";
+    } else {
+      target_.sin_family = AF_INET;
+      int ok = inet_aton(target.c_str(), &target_.sin_addr);
+      die_if(ok == 0, "invalid target");
+    }
+    request_ = absl::StrFormat("GET %s HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n\r\n",
+                               path, target, churn_ ? "close" : "keep-alive");
+  }
+
+  int Run() {
+    epoll_fd_ = epoll_create(1);
+    die_if(epoll_fd_ < 0, "epoll_create errno=%d", errno);
+
+    if (std::string path = absl::GetFlag(FLAGS_simulate_me); !path.empty()) {
+      sim_ = std::make_unique<SimulatedMe>(path, ports_, epoll_fd_);
+      absl::PrintF("Simulated ME listening on %s, waiting for apfd\n", path);
+      while (!sim_->ready()) {
+        Dispatch(-1);
+      }
+      absl::PrintF("Simulated ME ready\n");
+    }
+
+    absl::Time start = absl::Now();
+    for (uint32_t i = 0; i < absl::GetFlag(FLAGS_connections); i++) {
+      StartConn(ports_[i % ports_.size()]);
+    }
+    const absl::Time end = start + absl::GetFlag(FLAGS_duration);
+    const absl::Duration interval = absl::GetFlag(FLAGS_report_interval);
+    absl::Time next_report = start + interval;
+    Counters last;
+    while (true) {
+      absl::Time now = absl::Now();
+      if (now >= next_report || now >= end) {
+        Report(now - start, now - (next_report - interval), last);
+        last = total_;
+        next_report += interval;
+      }
+      if (now >= end) {
+        break;
+      }
+      absl::Duration wait = std::min(next_report, end) - now;
+      if (!retry_.empty()) {
+        // Don't spin on refused connections.
+        wait = std::min(wait, absl::Milliseconds(10));
+      }
+      Dispatch(absl::ToInt64Milliseconds(absl::Ceil(wait, absl::Milliseconds(1))));
+      std::vector<uint32_t> retry;
+      retry.swap(retry_);
+      for (uint32_t port : retry) {
+        StartConn(port);
+      }
+    }
+
+    absl::Duration elapsed = absl::Now() - start;
+    double secs = absl::ToDoubleSeconds(elapsed);
+    absl::PrintF("Total: %s conns=%u (%.0f/s) requests=%u (%.0f/s) %.2f MB/s "
+                 "errors=%u non_2xx=%u\n",
+                 absl::FormatDuration(absl::Trunc(elapsed, absl::Milliseconds(1))),
+                 total_.conns, total_.conns / secs, total_.requests,
+                 total_.requests / secs, total_.bytes / secs / 1e6, total_.errors,
+                 non_2xx_);
+    absl::PrintF("Connect latency: %s\n", connect_latency_.ToString());
+    absl::PrintF("Request latency: %s\n", request_latency_.ToString());
+    return 0;
+  }
+
+private:
+  struct Counters {
+    uint64_t conns = 0;
+    uint64_t requests = 0;
+    uint64_t bytes = 0;
+    uint64_t errors = 0;
+  };
+
+  struct Conn : public HttpFramer::Handler {
+    enum State {
+      kConnecting,
+      kSending,
+      kReceiving,
+    };
+    LoadGen *gen;
+    int fd;
+    uint32_t port;
+    State state = kConnecting;
+    size_t sent = 0;
+    absl::Time connect_start;
+    absl::Time request_start;
+    HttpFramer framer;
+    bool response_done = false;
+
+    bool OnHead(absl::string_view head) override {
+      // HTTP/1.1 200 OK
+      if (head.size() < 10 || head[9] != '2') {
+        gen->non_2xx_++;
+      }
+      return true;
+    }
+    void OnBody(absl::Span<const uint8_t> data) override {}
+    void OnEnd() override { response_done = true; }
+  };
+
+  void Dispatch(int timeout_ms) {
+    constexpr int kMaxEvents = 64;
+    epoll_event events[kMaxEvents];
+    int n = epoll_wait(epoll_fd_, events, kMaxEvents, timeout_ms);
+    die_if(n < 0 && errno != EINTR, "epoll_wait errno=%d", errno);
+    for (int i = 0; i < n; i++) {
+      int fd = events[i].data.fd;
+      if (sim_ != nullptr && sim_->Owns(fd)) {
+        sim_->HandleEvent(fd, events[i].events);
+        continue;
+      }
+      auto it = conns_.find(fd);
+      if (it != conns_.end()) {
+        HandleConn(*it->second, events[i].events);
+      }
+    }
+  }
+
+  void StartConn(uint32_t port) {
+    int domain = unix_dir_.empty() ? AF_INET : AF_UNIX;
+    int fd = socket(domain, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    die_if(fd < 0, "socket errno=%d", errno);
+    auto conn = std::make_unique<Conn>();
+    conn->gen = this;
+    conn->fd = fd;
+    conn->port = port;
+    conn->connect_start = absl::Now();
+    int err;
+    if (unix_dir_.empty()) {
+      sockaddr_in sa = target_;
+      sa.sin_port = htons(port);
+      err = connect(fd, sa_ptr(sa), sizeof(sa));
+    } else {
+      // apfd listens on <dir>/<port>.
+      sockaddr_un sa{};
+      sa.sun_family = AF_UNIX;
+      std::string path = absl::StrFormat("%s/%u", unix_dir_, port);
+      die_if(path.size() >= sizeof(sa.sun_path), "unix socket path too long");
+      memcpy(sa.sun_path, path.c_str(), path.size() + 1);
+      // Fails with EAGAIN instead of EINPROGRESS if the backlog is full.
+      err = connect(fd, sa_ptr(sa), sizeof(sa));
+    }
+    if (err == -1 && errno != EINPROGRESS) {
+      close(fd);
+      total_.errors++;
+      retry_.push_back(port);
+      return;
+    }
+    epoll_ctl_add(epoll_fd_, fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+    conns_[fd] = std::move(conn);
+  }
+
+  // Close the connection and start a new one on the same port.
+  void Restart(Conn &conn, bool error) {
+    uint32_t port = conn.port;
+    int fd = conn.fd;
+    if (error) {
+      total_.errors++;
+      retry_.push_back(port);
+    }
+    close(fd);
+    conns_.erase(fd);
+    if (!error) {
+      StartConn(port);
+    }
+  }
+
+  void HandleConn(Conn &conn, uint32_t events) {
+    if (conn.state == Conn::kConnecting) {
+      int err = 0;
+      socklen_t len = sizeof(err);
+      getsockopt(conn.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+      if (err != 0) {
+        Restart(conn, /*error=*/true);
+        return;
+      }
+      if (!(events & EPOLLOUT)) {
+        return;
+      }
+      total_.conns++;
+      connect_latency_.Add(absl::Now() - conn.connect_start);
+      if (!StartRequest(conn)) {
+        return;
+      }
+    } else if (conn.state == Conn::kSending && (events & EPOLLOUT)) {
+      if (!WriteRequest(conn)) {
+        return;
+      }
+    }
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+      ReadResponse(conn);
+    }
+  }
+
+  // Returns false if the connection is gone.
+  bool StartRequest(Conn &conn) {
+    conn.state = Conn::kSending;
+    conn.sent = 0;
+    conn.request_start = absl::Now();
+    return WriteRequest(conn);
+  }
+
+  // Returns false if the connection is gone.
+  bool WriteRequest(Conn &conn) {
+    while (conn.sent < request_.size()) {
+      ssize_t w = send(conn.fd, request_.data() + conn.sent, request_.size() - conn.sent,
+                       MSG_NOSIGNAL);
+      if (w < 0 && errno == EAGAIN) {
+        return true;
+      }
+      if (w < 0) {
+        Restart(conn, /*error=*/true);
+        return false;
+      }
+      conn.sent += w;
+    }
+    conn.state = Conn::kReceiving;
+    return true;
+  }
+
+  void ReadResponse(Conn &conn) {
+    uint8_t buf[65536];
+    while (true) {
+      ssize_t r = recv(conn.fd, buf, sizeof(buf), 0);
+      if (r < 0 && errno == EAGAIN) {
+        return;
+      }
+      if (r <= 0) {
+        // Closed by apfd or the ME before the response ended.
+        Restart(conn, /*error=*/true);
+        return;
+      }
+      total_.bytes += r;
+      conn.framer.Feed(absl::MakeConstSpan(buf, r), conn);
+      if (conn.framer.broken()) {
+        Restart(conn, /*error=*/true);
+        return;
+      }
+      if (!conn.response_done) {
+        continue;
+      }
+      conn.response_done = false;
+      total_.requests++;
+      absl::Time now = absl::Now();
+      request_latency_.Add(now - conn.request_start);
+      if (churn_) {
+        Restart(conn, /*error=*/false);
+        return;
+      }
+      if (!StartRequest(conn)) {
+        return;
+      }
+    }
+  }
+
+  void Report(absl::Duration at, absl::Duration interval, const Counters &last) {
+    double secs = std::max(absl::ToDoubleSeconds(interval), 1e-3);
+    absl::PrintF("%8s conns/s=%-7.0f req/s=%-7.0f MB/s=%-8.2f errors=%u open=%u\n",
+                 absl::FormatDuration(absl::Trunc(at, absl::Milliseconds(100))),
+                 (total_.conns - last.conns) / secs,
+                 (total_.requests - last.requests) / secs,
+                 (total_.bytes - last.bytes) / secs / 1e6, total_.errors - last.errors,
+                 conns_.size());
+  }
+
+  std::vector<uint32_t> ports_;
+  bool churn_ = false;
+  std::string request_;
+  sockaddr_in target_{};
+  // Set on --target=unix:<dir>.
+  std::string unix_dir_;
+
+  int epoll_fd_;
+  std::unique_ptr<SimulatedMe> sim_;
+  // key is fd
+  std::unordered_map<int, std::unique_ptr<Conn>> conns_;
+  // Ports to reconnect to after an error.
+  std::vector<uint32_t> retry_;
+
+  Counters total_;
+  uint64_t non_2xx_ = 0;
+  LatencyHistogram connect_latency_;
+  // First request byte to last response byte.
+  LatencyHistogram request_latency_;
+};
+
+} // namespace
+} // namespace amt
+
+int main(int argc, char *argv[]) {
+  absl::SetProgramUsageMessage("Load generator for apfd listeners");
+  absl::ParseCommandLine(argc, argv);
+
+  amt::LoadGen loadgen;
+  return loadgen.Run();
+}
@@ -157,7 +157,21 @@ bool ApfGlobalMessage::Deserialize(absl::Span<uint8_t> data) {
   return true;
 }
 
-std::string ApfGlobalMessage::Serialize() const { die("unimplemented"); }
+std::string ApfGlobalMessage::Serialize() const {
+  // Only TcpForwardRequest & TcpForwardCancelRequest, as sent by the ME.
+  const size_t len_r = request_string.size();
+  const size_t len_a = address_to_bind.size();
+  const size_t len = 1 + 4 + len_r + 1 + 4 + len_a + 4;
+  std::string ret(len, '\0');
+  auto data = absl::MakeSpan(reinterpret_cast<uint8_t *>(ret.data()), len);
+
+  Fill(data.subspan(0, 1), kType);
+  FillStringWithHeader(data.subspan(1, 4 + len_r), request_string);
+  Fill(data.subspan(5 + len_r, 1), static_cast<uint8_t>(want_reply ? 1 : 0));
+  FillStringWithHeader(data.subspan(6 + len_r, 4 + len_a), address_to_bind);
+  Fill(data.subspan(10 + len_r + len_a, 4), htonl(port_to_bind));
+  return ret;
+}
 
 std::string ApfGlobalMessage::ToString() const {
   return absl::StrFormat(
@@ -167,8 +181,14 @@ std::string ApfGlobalMessage::ToString() const {
 }
 
 bool ApfRequestSuccess::Deserialize(absl::Span<uint8_t> data) {
-  // TODO unimplemented
-  return false;
+  if (!VerifyType(data, kType) || (data.size() != 1 && data.size() != 5))
+    return false;
+  if (data.size() == 5) {
+    port_bound = ntohl(Extract<uint32_t>(data.subspan(1, 4)));
+  } else {
+    port_bound = std::nullopt;
+  }
+  return true;
 }
 
 std::string ApfRequestSuccess::Serialize() const {
@@ -202,8 +222,44 @@ std::string ApfRequestFailure::Serialize() const {
 std::string ApfRequestFailure::ToString() const { return "ApfRequestFailure{}"; }
 
 bool ApfChannelOpenRequest::Deserialize(absl::Span<uint8_t> data) {
-  // TODO unimplemented
-  return false;
+  // Reads a length prefixed string at off, advances off.
+  auto read_string = [&](size_t &off, std::string &to) {
+    if (data.size() < off + 4)
+      return false;
+    uint32_t len = ntohl(Extract<uint32_t>(data.subspan(off, 4)));
+    if (data.size() < off + 4 + len)
+      return false;
+    to = ExtractString(data.subspan(off + 4, len));
+    off += 4 + len;
+    return true;
+  };
+
+  if (!VerifyType(data, kType))
+    return false;
+  size_t off = 1;
+  std::string type;
+  if (!read_string(off, type))
+    return false;
+  if (type == "forwarded-tcpip") {
+    is_forwarded = true;
+  } else if (type == "direct-tcpip") {
+    is_forwarded = false;
+  } else {
+    return false;
+  }
+  if (data.size() < off + 12)
+    return false;
+  sender_channel = ntohl(Extract<uint32_t>(data.subspan(off, 4)));
+  initial_window_size = ntohl(Extract<uint32_t>(data.subspan(off + 4, 4)));
+  off += 12;
+  if (!read_string(off, connected_address) || data.size() < off + 4)
+    return false;
+  connected_port = ntohl(Extract<uint32_t>(data.subspan(off, 4)));
+  off += 4;
+  if (!read_string(off, originator_address) || data.size() != off + 4)
+    return false;
+  originator_port = ntohl(Extract<uint32_t>(data.subspan(off, 4)));
+  return true;
 }
 
 std::string ApfChannelOpenRequest::Serialize() const {
@@ -251,7 +307,17 @@ bool ApfChannelOpenConfirmation::Deserialize(absl::Span<uint8_t> data) {
   return true;
 }
 
-std::string ApfChannelOpenConfirmation::Serialize() const { die("unimplemented"); }
+std::string ApfChannelOpenConfirmation::Serialize() const {
+  constexpr uint32_t kReserved = 0xFFFFFFFFul;
+  std::string ret(17, '\0');
+  auto data = absl::MakeSpan(reinterpret_cast<uint8_t *>(ret.data()), 17);
+  Fill(data.subspan(0, 1), kType);
+  Fill(data.subspan(1, 4), htonl(recipient_channel));
+  Fill(data.subspan(5, 4), htonl(sender_channel));
+  Fill(data.subspan(9, 4), htonl(initial_window_size));
+  Fill(data.subspan(13, 4), kReserved);
+  return ret;
+}
 
 std::string ApfChannelOpenConfirmation::ToString() const {
   return absl::StrFormat("ApfChannelOpenConfirmation{recipient_channel=%u,sender_channel="
@@ -259,6 +325,31 @@ std::string ApfChannelOpenConfirmation::ToString() const {
                          recipient_channel, sender_channel, initial_window_size);
 }
 
+bool ApfChannelOpenFailure::Deserialize(absl::Span<uint8_t> data) {
+  // Followed by two reserved uint32.
+  if (!VerifyType(data, kType) || data.size() != 17)
+    return false;
+
+  recipient_channel = ntohl(Extract<uint32_t>(data.subspan(1, 4)));
+  reason = static_cast<ApfChannelOpenFailure::Reason>(
+      ntohl(Extract<uint32_t>(data.subspan(5, 4))));
+  return true;
+}
+
+std::string ApfChannelOpenFailure::Serialize() const {
+  std::string ret(17, '\0');
+  auto data = absl::MakeSpan(reinterpret_cast<uint8_t *>(ret.data()), 17);
+  Fill(data.subspan(0, 1), kType);
+  Fill(data.subspan(1, 4), htonl(recipient_channel));
+  Fill(data.subspan(5, 4), htonl(reason));
+  return ret;
+}
+
+std::string ApfChannelOpenFailure::ToString() const {
+  return absl::StrFormat("ApfChannelOpenFailure{recipient_channel=%u,reason=%u}",
+                         recipient_channel, reason);
+}
+
 bool ApfChannelClose::Deserialize(absl::Span<uint8_t> data) {
   if (!VerifyType(data, kType) || data.size() != 5)
     return false;
@@ -287,19 +378,26 @@ bool ApfChannelData::Deserialize(absl::Span<uint8_t> data) {
   }
 
   recipient_channel = ntohl(Extract<uint32_t>(data.subspan(1, 4)));
-  this->data = ExtractString(data.subspan(9));
+  this->data = data.subspan(9);
 
   return true;
 }
 
+void ApfChannelData::FillHeader(absl::Span<uint8_t> to, uint32_t recipient_channel,
+                                uint32_t data_len) {
+  die_if(to.size() < kHeaderSize, "buffer too small");
+  Fill(to.subspan(0, 1), kType);
+  Fill(to.subspan(1, 4), htonl(recipient_channel));
+  Fill(to.subspan(5, 4), htonl(data_len));
+}
+
 std::string ApfChannelData::Serialize() const {
-  uint32_t len = 9 + this->data.size();
+  uint32_t len = kHeaderSize + this->data.size();
   std::string ret(len, '\0');
   auto data = absl::MakeSpan(reinterpret_cast<uint8_t *>(ret.data()), len);
 
-  Fill(data.subspan(0, 1), kType);
-  Fill(data.subspan(1, 4), htonl(recipient_channel));
-  FillStringWithHeader(data.subspan(5), this->data);
+  FillHeader(data, recipient_channel, this->data.size());
+  FillRaw(data.subspan(kHeaderSize), this->data.data());
   return ret;
 }
 
@@ -331,4 +429,77 @@ std::string ApfChannelWindowAdjust::ToString() const {
   return absl::StrFormat("ApfChannelWindowAdjust{recipient_channel=%u,bytes_to_add=%u}",
                          recipient_channel, bytes_to_add);
 }
+
+bool ApfKeepAliveRequest::Deserialize(absl::Span<uint8_t> data) {
+  if (!VerifyType(data, kType) || data.size() != 5)
+    return false;
+  cookie = ntohl(Extract<uint32_t>(data.subspan(1, 4)));
+  return true;
+}
+
+std::string ApfKeepAliveRequest::Serialize() const {
+  std::string ret(5, '\0');
+  auto data = absl::MakeSpan(reinterpret_cast<uint8_t *>(ret.data()), 5);
+  Fill(data.subspan(0, 1), kType);
+  Fill(data.subspan(1, 4), htonl(cookie));
+  return ret;
+}
+
+std::string ApfKeepAliveRequest::ToString() const {
+  return absl::StrFormat("ApfKeepAliveRequest{cookie=%u}", cookie);
+}
+
+bool ApfKeepAliveReply::Deserialize(absl::Span<uint8_t> data) {
+  if (!VerifyType(data, kType) || data.size() != 5)
+    return false;
+  cookie = ntohl(Extract<uint32_t>(data.subspan(1, 4)));
+  return true;
+}
+
+std::string ApfKeepAliveReply::Serialize() const {
+  std::string ret(5, '\0');
+  auto data = absl::MakeSpan(reinterpret_cast<uint8_t *>(ret.data()), 5);
+  Fill(data.subspan(0, 1), kType);
+  Fill(data.subspan(1, 4), htonl(cookie));
+  return ret;
+}
+
+std::string ApfKeepAliveReply::ToString() const {
+  return absl::StrFormat("ApfKeepAliveReply{cookie=%u}", cookie);
+}
+
+bool ApfKeepAliveOptionsRequest::Deserialize(absl::Span<uint8_t> data) {
+  if (!VerifyType(data, kType) || data.size() != 9)
+    return false;
+  keepalive_interval = ntohl(Extract<uint32_t>(data.subspan(1, 4)));
+  read_timeout = ntohl(Extract<uint32_t>(data.subspan(5, 4)));
+  return true;
+}
+
+std::string ApfKeepAliveOptionsRequest::Serialize() const {
+  std::string ret(9, '\0');
+  auto data = absl::MakeSpan(reinterpret_cast<uint8_t *>(ret.data()), 9);
+  Fill(data.subspan(0, 1), kType);
+  Fill(data.subspan(1, 4), htonl(keepalive_interval));
+  Fill(data.subspan(5, 4), htonl(read_timeout));
+  return ret;
+}
+
+std::string ApfKeepAliveOptionsRequest::ToString() const {
+  return absl::StrFormat("ApfKeepAliveOptionsRequest{keepalive_interval=%u,"
+                         "read_timeout=%u}",
+                         keepalive_interval, read_timeout);
+}
+
+bool ApfKeepAliveOptionsReply::Deserialize(absl::Span<uint8_t> data) {
+  return VerifyType(data, kType) && data.size() == 1;
+}
+
+std::string ApfKeepAliveOptionsReply::Serialize() const {
+  return std::string(1, static_cast<char>(kType));
+}
+
+std::string ApfKeepAliveOptionsReply::ToString() const {
+  return "ApfKeepAliveOptionsReply{}";
+}
 } // namespace amt
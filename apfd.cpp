@@ -1,30 +1,194 @@
 #include "apf.h"
 #include "die.h"
+#include "histogram.h"
+#include "port_profile.h"
+#include "rate_limiter.h"
+#include "single_flight.h"
+#include "timer_wheel.h"
+#include "wsman_profiler.h"
 
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <optional>
 #include <string>
+#include <unordered_map>
 #include <unordered_set>
 
 #include <absl/flags/flag.h>
 #include <absl/flags/parse.h>
 #include <absl/flags/usage.h>
+#include <absl/strings/match.h>
 #include <absl/strings/numbers.h>
 #include <absl/strings/str_format.h>
+#include <absl/strings/str_split.h>
+#include <absl/time/clock.h>
+#include <absl/time/time.h>
 
 #include <arpa/inet.h>
+#include <grp.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sched.h>
+#include <signal.h>
 #include <sys/epoll.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
 
-ABSL_FLAG(std::string, mei_device, "/dev/mei0", "Path to the MEI chardev");
+ABSL_FLAG(std::string, mei_device, "/dev/mei0",
+          "Path to the MEI chardev, or unix:<path> for a simulated ME "
+          "(apf_loadgen --simulate_me)");
+ABSL_FLAG(std::string, mei_record, "",
+          "Record the MEI traffic to this trace file, for replaying with --mei_replay");
+ABSL_FLAG(std::string, mei_replay, "",
+          "Replay the ME side of a trace file instead of using --mei_device");
+ABSL_FLAG(double, mei_replay_speed, 1.0,
+          "Replay speed relative to the recording, 0 to replay without delays");
+ABSL_FLAG(absl::Duration, reconnect_backoff, absl::Milliseconds(100),
+          "Initial delay before reconnecting to ME, doubled on each failure");
+ABSL_FLAG(absl::Duration, reconnect_backoff_max, absl::Seconds(30),
+          "Max delay between reconnection attempts");
+ABSL_FLAG(absl::Duration, keepalive_interval, absl::Seconds(5),
+          "Probe ME with a keepalive when nothing has been received for this long, "
+          "0 to disable liveness checks");
+ABSL_FLAG(absl::Duration, keepalive_timeout, absl::Seconds(5),
+          "Reconnect to ME if a probe isn't answered, or MEI isn't writable, within "
+          "this time");
+ABSL_FLAG(uint32_t, mei_queue_depth, 64,
+          "Max messages queued for MEI before channel reads are paused");
 ABSL_FLAG(std::vector<std::string>, allowed_ports,
-          (std::vector<std::string>{"16992", "16993"}), "Which ports to forward");
+          (std::vector<std::string>{"16992", "16993"}),
+          "Which ports to forward, as port[:preset][:key=value]... Presets are "
+          "default, latency (16992, 16993) and throughput (5900, 16994, 16995). "
+          "Keys: window, read_chunk, cork, weight, nodelay, rcvbuf, sndbuf, backlog, "
+          "rate, burst, queue (new connections per second from each peer address or "
+          "unix uid, e.g. 16992:rate=5:burst=20)");
 ABSL_FLAG(std::string, listen_addr, "127.0.0.1", "Address to listen on");
+ABSL_FLAG(bool, prebind, false,
+          "Listen on --allowed_ports at startup, before ME requests them. Clients are "
+          "held until ME approves the port");
+ABSL_FLAG(absl::Duration, prebind_timeout, absl::Seconds(60),
+          "Stop listening on a prebound port if ME doesn't request it in time");
+ABSL_FLAG(uint32_t, prebind_queue, 64,
+          "Max clients held per prebound port, more wait in the listen backlog");
+ABSL_FLAG(std::string, control_socket, "",
+          "Unix socket a new apfd connects to for --takeover, empty to disable");
+ABSL_FLAG(bool, takeover, false,
+          "Take the listening sockets over from the apfd on --control_socket, which "
+          "then exits after its channels are drained");
+ABSL_FLAG(absl::Duration, handoff_timeout, absl::Minutes(5),
+          "After a takeover, exit even if channels are still open after this long");
+ABSL_FLAG(std::string, unix_socket_dir, "",
+          "Also listen on unix sockets <dir>/<port>, empty to disable");
+ABSL_FLAG(std::string, unix_socket_group, "",
+          "Only this group may connect to the --unix_socket_dir sockets, empty to "
+          "allow any local user like the loopback ports");
+ABSL_FLAG(uint32_t, early_data, 16384,
+          "Bytes read from a client while its channel is opening, sent to ME right "
+          "after the open is confirmed. 0 to only read once the channel is open");
+ABSL_FLAG(absl::Duration, open_timeout, absl::Seconds(10),
+          "Abort the channel if ME doesn't confirm the open within this time");
+ABSL_FLAG(absl::Duration, idle_timeout, absl::Minutes(10),
+          "Abort the channel if no data is transferred for this long, 0 to disable");
+ABSL_FLAG(absl::Duration, drain_timeout, absl::Seconds(30),
+          "Abort the channel if it's not fully closed this long after either side "
+          "closes");
+ABSL_FLAG(absl::Duration, busy_poll, absl::ZeroDuration(),
+          "Spin on the fds for up to this long before sleeping in epoll_wait, "
+          "0 to disable. The spin period adapts to how often spinning pays off");
+ABSL_FLAG(int32_t, cpu, -1, "Pin apfd to this CPU, -1 to disable");
+ABSL_FLAG(std::vector<std::string>, cork, {},
+          "Coalesce small writes to ME on these ports, as port:max_delay "
+          "(e.g. 5900:2ms). The delay is rounded up to 1ms. Overrides the cork "
+          "of the port profile");
+ABSL_FLAG(bool, send_pacing, false,
+          "Pace data to ME at a rate adapted to the measured window adjust round "
+          "trip, instead of sending as fast as the window allows");
+ABSL_FLAG(std::vector<std::string>, wsman_tap_ports, {},
+          "Profile WS-MAN request latency on these plaintext HTTP ports "
+          "(e.g. 16992), dumped on SIGUSR1");
+ABSL_FLAG(std::vector<std::string>, dedup_ports, {},
+          "Send identical concurrent WS-MAN requests on these plaintext HTTP ports "
+          "to ME only once and copy the response to all requesters");
+ABSL_FLAG(std::vector<std::string>, dedup_actions,
+          {"http://schemas.xmlsoap.org/ws/2004/09/transfer/Get"},
+          "WS-MAN actions eligible for --dedup_ports. Only list idempotent actions "
+          "whose response doesn't depend on the connection, e.g. not Pull, as "
+          "enumeration contexts are per requester");
+ABSL_FLAG(uint32_t, dedup_max_response, 1 << 20,
+          "Responses larger than this are not copied, waiting requests are sent "
+          "to ME instead");
 
 namespace amt {
 namespace {
 
 sockaddr *sa_ptr(sockaddr_in &sa) { return reinterpret_cast<sockaddr *>(&sa); }
 sockaddr *sa_ptr(sockaddr_storage &sa) { return reinterpret_cast<sockaddr *>(&sa); }
+sockaddr *sa_ptr(sockaddr_un &sa) { return reinterpret_cast<sockaddr *>(&sa); }
+
+// Hot restart: the new apfd connects to --control_socket of the old one
+// and receives messages of HandoffEntry records, with one fd per record
+// attached by SCM_RIGHTS, until the old one closes the connection.
+struct HandoffEntry {
+  enum Kind : uint32_t {
+    kListener = 0,
+    // Accepted client not attached to a channel yet.
+    kHeldClient = 1,
+  };
+  Kind kind;
+  uint32_t port;
+};
+// SCM_MAX_FD of the kernel, the most fds in one message.
+constexpr size_t kMaxHandoffFds = 253;
+// Connect() retry interval after a takeover, while the old apfd drains.
+constexpr absl::Duration kTakeoverReconnect = absl::Milliseconds(100);
+
+// Sends one message of the handoff. Returns false if it didn't go out whole.
+bool SendHandoff(int sock, absl::Span<const HandoffEntry> entries,
+                 absl::Span<const int> fds) {
+  iovec iov{
+      .iov_base = const_cast<HandoffEntry *>(entries.data()),
+      .iov_len = entries.size() * sizeof(HandoffEntry),
+  };
+  std::vector<char> control(CMSG_SPACE(fds.size() * sizeof(int)));
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.data();
+  msg.msg_controllen = control.size();
+  cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(fds.size() * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), fds.data(), fds.size() * sizeof(int));
+  return sendmsg(sock, &msg, MSG_NOSIGNAL) == static_cast<ssize_t>(iov.iov_len);
+}
+
+absl::Span<const uint8_t> AsBytes(const std::string &s) {
+  return absl::MakeConstSpan(reinterpret_cast<const uint8_t *>(s.data()), s.size());
+}
+
+std::unique_ptr<MeiTransport> MakeMeiTransport() {
+  std::unique_ptr<MeiTransport> transport;
+  if (std::string replay = absl::GetFlag(FLAGS_mei_replay); !replay.empty()) {
+    transport =
+        std::make_unique<MeiReplayer>(replay, absl::GetFlag(FLAGS_mei_replay_speed));
+  } else if (std::string dev = absl::GetFlag(FLAGS_mei_device);
+             absl::StartsWith(dev, "unix:")) {
+    transport = std::make_unique<MeiUnixSocket>(dev.substr(5));
+  } else {
+    transport = std::make_unique<MeiDevice>(dev);
+  }
+  if (std::string record = absl::GetFlag(FLAGS_mei_record); !record.empty()) {
+    transport = std::make_unique<MeiRecorder>(std::move(transport), record);
+  }
+  return transport;
+}
 
 void epoll_ctl_add(int epfd, int fd, uint32_t events) {
   struct epoll_event ev;
@@ -34,6 +198,14 @@ void epoll_ctl_add(int epfd, int fd, uint32_t events) {
   die_if(err == -1, "epoll_ctl_add errno=%d", errno);
 }
 
+void epoll_ctl_mod(int epfd, int fd, uint32_t events) {
+  struct epoll_event ev;
+  ev.events = events;
+  ev.data.fd = fd;
+  int err = epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+  die_if(err == -1, "epoll_ctl_mod errno=%d", errno);
+}
+
 void epoll_ctl_del(int epfd, int fd) {
   int err = epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
   die_if(err == -1, "epoll_ctl_DEL errno=%d", errno);
@@ -41,93 +213,754 @@ void epoll_ctl_del(int epfd, int fd) {
 
 class Apfd {
 public:
-  Apfd() : apf_(absl::GetFlag(FLAGS_mei_device)) {
+  Apfd()
+      : apf_(MakeMeiTransport(), absl::GetFlag(FLAGS_mei_queue_depth),
+             absl::GetFlag(FLAGS_early_data)),
+        single_flight_(absl::GetFlag(FLAGS_dedup_actions),
+                       absl::GetFlag(FLAGS_dedup_max_response)) {
     for (const auto &p : absl::GetFlag(FLAGS_allowed_ports)) {
       uint32_t port = 0;
-      bool success = absl::SimpleAtoi(p, &port);
-      if (!success || port > 65535) {
-        die("invalid port %s", p);
+      PortProfile profile;
+      if (!ParsePortProfile(p, port, profile)) {
+        die("invalid port %s", p.c_str());
       }
       allowed_ports_.insert(port);
+      profiles_[port] = profile;
+    }
+    for (const auto &c : absl::GetFlag(FLAGS_cork)) {
+      std::vector<std::string> parts = absl::StrSplit(c, ':');
+      uint32_t port = 0;
+      absl::Duration delay;
+      if (parts.size() != 2 || !absl::SimpleAtoi(parts[0], &port) || port > 65535 ||
+          !absl::ParseDuration(parts[1], &delay) || delay <= absl::ZeroDuration()) {
+        die("invalid cork %s", c.c_str());
+      }
+      profiles_.try_emplace(port, DefaultPortProfile(port)).first->second.cork_delay =
+          delay;
+    }
+    for (const auto &p : absl::GetFlag(FLAGS_wsman_tap_ports)) {
+      uint32_t port = 0;
+      if (!absl::SimpleAtoi(p, &port) || port > 65535) {
+        die("invalid tap port %s", p.c_str());
+      }
+      wsman_tap_ports_.insert(port);
+    }
+    for (const auto &p : absl::GetFlag(FLAGS_dedup_ports)) {
+      uint32_t port = 0;
+      if (!absl::SimpleAtoi(p, &port) || port > 65535) {
+        die("invalid dedup port %s", p.c_str());
+      }
+      dedup_ports_.insert(port);
     }
   }
 
   int Run() {
+    if (int cpu = absl::GetFlag(FLAGS_cpu); cpu >= 0) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(cpu, &set);
+      die_if(sched_setaffinity(0, sizeof(set), &set) != 0, "sched_setaffinity errno=%d",
+             errno);
+    }
+
     epoll_fd_ = epoll_create(1);
     die_if(epoll_fd_ < 0, "epoll_create errno=%d", errno);
-    epoll_ctl_add(epoll_fd_, apf_.fd(), EPOLLIN);
+    apf_.SetPacing(absl::GetFlag(FLAGS_send_pacing));
+    reconnect_backoff_ = absl::GetFlag(FLAGS_reconnect_backoff);
+    if (absl::GetFlag(FLAGS_takeover)) {
+      // The old apfd holds LME until it has drained, Connect() is retried at
+      // a fixed interval until then so the held clients start right away.
+      taking_over_ = true;
+      TakeOver();
+    }
+    if (apf_.Connect()) {
+      OnConnected();
+    } else {
+      ScheduleReconnect();
+    }
+    if (!absl::GetFlag(FLAGS_control_socket).empty()) {
+      ListenControl();
+    }
+
+    // SIGUSR1 dumps stats.
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    die_if(sigprocmask(SIG_BLOCK, &mask, nullptr) == -1, "sigprocmask errno=%d", errno);
+    signal_fd_ = signalfd(-1, &mask, SFD_NONBLOCK);
+    die_if(signal_fd_ < 0, "signalfd errno=%d", errno);
+    epoll_ctl_add(epoll_fd_, signal_fd_, EPOLLIN);
+
+    if (absl::GetFlag(FLAGS_prebind)) {
+      for (uint32_t port : allowed_ports_) {
+        // Taken over ports are prebound already.
+        if (prebound_.find(port) == prebound_.end()) {
+          Prebind(port);
+        }
+      }
+    }
 
     while (true) {
       epoll_event events[1024];
-      int event_count = epoll_wait(epoll_fd_, events, 1024, -1);
-      die_if(event_count == -1, "epoll_wait errno=%d", errno);
+      int event_count = Poll(events, 1024);
+      // Advance before handling events so new timers are armed relative to now.
+      timers_.Advance(absl::Now());
       for (int i = 0; i < event_count; i++) {
         int fd = events[i].data.fd;
 
-        if (fd == apf_.fd()) {
+        if (fd == apf_fd_) {
           // std::cerr << "poll apf" << std::endl;
-          HandleMeRequest(apf_.ProcessOneMessage());
+          if (events[i].events & EPOLLOUT) {
+            for (const auto &comp : apf_.HandleWritable()) {
+              HandleMeRequest(comp);
+            }
+          }
+          // Errors are reported as MeDisconnect.
+          if (apf_fd_ >= 0 && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+            HandleMeRequest(apf_.ProcessOneMessage());
+          }
+        } else if (fd == signal_fd_) {
+          HandleSignal();
+        } else if (fd == control_fd_) {
+          HandleHandoff();
         } else if (auto it = listen_fd_port_.find(fd); it != listen_fd_port_.end()) {
           HandleIncomingConnection(fd);
         } else if (auto it = channel_fd_id_.find(fd); it != channel_fd_id_.end()) {
           auto it2 = channels_.find(it->second);
           die_if(it2 == channels_.end(), "inconsistent state");
-          if (events[i].events & EPOLLIN) {
+          ChannelInfo &channel = it2->second;
+          if (events[i].events & EPOLLERR) {
+            AbortFd(channel);
+          }
+          // HUP and RDHUP are handled as reads: the pending data is read
+          // first, then read() returns EOF.
+          if (channel.fd >= 0 && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLRDHUP))) {
             // std::cerr << "poll fd in " << fd << std::endl;
-            HandleFdToApfData(/*is_fd=*/true, it2->second);
+            HandleFdToApfData(/*is_fd=*/true, channel);
           }
-          if (events[i].events & EPOLLOUT) {
+          if (channel.fd >= 0 && (events[i].events & EPOLLOUT)) {
             // std::cerr << "poll fd out " << fd << std::endl;
-            HandleApfToFdData(/*is_fd=*/true, it2->second);
-          }
-          if (events[i].events & (EPOLLHUP | EPOLLRDHUP)) {
-            HandleChannelClosure(/*is_fd=*/true, it2->second);
+            HandleApfToFdData(/*is_fd=*/true, channel);
           }
+          MaybeReclaim(channel.channel_id);
         } else {
-          die("impossible");
+          // Channel fd was closed by a timer.
         }
       }
+      // A write may have failed while handling client events.
+      if (apf_fd_ >= 0 && !apf_.connected()) {
+        OnMeDisconnect();
+      }
+      UpdatePacingTimer();
+      UpdateApfEvents();
+      if (handed_off_ && channels_.empty()) {
+        absl::PrintF("Handoff complete, exiting\n");
+        break;
+      }
     }
 
     return 0;
   }
 
 private:
+  // Channel lifecycle:
+  // - Client EOF: CloseChannel() is called, APF flushes the pending data
+  //   then sends ApfChannelClose. Data from ME is still forwarded.
+  // - ME close: remaining data is written to the client, then the close is
+  //   propagated with shutdown(SHUT_WR).
+  // The fd is closed after both directions are closed, and the slot is
+  // reclaimed after both the fd and the APF channel are closed.
   struct ChannelInfo {
+    // -1 after the fd is closed.
     int fd;
     uint32_t channel_id;
+    // ME port the client connected to.
+    uint32_t port;
     // Waiting for SendDataCompletion
     bool apf_blocked;
     // Has incoming data from APF.
     bool apf_incoming;
+    // Client EOF or error, CloseChannel() has been called.
+    bool fd_read_closed;
+    // Client write side has been shut down, or the client is gone.
+    bool fd_write_closed;
+    // ME sent ApfChannelClose.
+    bool apf_closed;
+    // fd is registered to epoll, right away with --early_data, otherwise
+    // after OpenChannelResult.
+    bool polling;
+
+    absl::Time accepted;
+    absl::Time last_active;
+    TimerWheel::TimerId open_timer;
+    TimerWheel::TimerId idle_timer;
+    TimerWheel::TimerId drain_timer;
+
+    // When data was sent to ME without a reply yet, InfinitePast if none.
+    absl::Time me_request_sent;
+
+    // Max time small writes are held back, 0 if not corked.
+    absl::Duration cork_delay;
+    TimerWheel::TimerId cork_timer;
+    // Bytes per read() from the client.
+    uint32_t read_chunk;
+
+    // Set on --wsman_tap_ports.
+    std::unique_ptr<WsmanProfiler::Stream> tap;
+
+    // Set on --dedup_ports, until the client sends something SingleFlight
+    // can't handle.
+    std::unique_ptr<DedupStream> dedup;
+    // Leads a SingleFlight, the response is teed to single_flight_.
+    bool dedup_leader;
+    // Waits for the response to dedup_request from a leader, the client
+    // isn't read meanwhile.
+    bool dedup_waiting;
+    std::string dedup_request;
+    // Response copied from a leader, not written to the client yet.
+    std::string dedup_out;
   };
 
+  // Busy poll mode: spin with a zero timeout for spin_budget_ first. The
+  // budget doubles when spinning finds events and halves when it doesn't,
+  // between 1/16 of --busy_poll and --busy_poll.
+  int Poll(epoll_event *events, int max_events) {
+    const absl::Duration max_budget = absl::GetFlag(FLAGS_busy_poll);
+    if (max_budget > absl::ZeroDuration()) {
+      if (spin_budget_ == absl::ZeroDuration()) {
+        spin_budget_ = max_budget;
+      }
+      absl::Time start = absl::Now();
+      absl::Time now = start;
+      int n = 0;
+      while (n == 0 && now - start < spin_budget_) {
+        n = epoll_wait(epoll_fd_, events, max_events, 0);
+        die_if(n == -1 && errno != EINTR, "epoll_wait errno=%d", errno);
+        n = std::max(n, 0);
+        now = absl::Now();
+      }
+      spin_time_ += now - start;
+      if (n > 0) {
+        spin_hits_++;
+        spin_budget_ = std::min(spin_budget_ * 2, max_budget);
+        return n;
+      }
+      spin_misses_++;
+      spin_budget_ = std::max(spin_budget_ / 2, max_budget / 16);
+    }
+
+    int n = epoll_wait(epoll_fd_, events, max_events, timers_.NextTimeoutMs(absl::Now()));
+    die_if(n == -1 && errno != EINTR, "epoll_wait errno=%d", errno);
+    return std::max(n, 0);
+  }
+
+  void RegisterApf() {
+    apf_fd_ = apf_.fd();
+    apf_events_ = EPOLLIN;
+    epoll_ctl_add(epoll_fd_, apf_fd_, apf_events_);
+  }
+
+  // Tear down the channels but keep the listeners. Clients are held like
+  // prebound ones until the reconnected ME requests their port again.
+  void OnMeDisconnect() {
+    if (apf_fd_ < 0) {
+      return;
+    }
+    absl::PrintF("ME disconnected, dropping %u channels\n", channels_.size());
+    if (handed_off_) {
+      // Channels are gone and the listeners belong to the new apfd.
+      epoll_ctl_del(epoll_fd_, apf_fd_);
+      apf_fd_ = -1;
+      apf_.Disconnect();
+      ReleaseAllChannels();
+      return;
+    }
+    epoll_ctl_del(epoll_fd_, apf_fd_);
+    apf_fd_ = -1;
+    apf_.Disconnect();
+    me_disconnects_++;
+    disconnected_since_ = absl::Now();
+
+    ReleaseAllChannels();
+    for (const auto &[fd, port] : listen_fd_port_) {
+      // Release timers are armed once reconnected.
+      prebound_.try_emplace(port);
+    }
+    ScheduleReconnect();
+  }
+
+  void ScheduleReconnect() {
+    if (taking_over_) {
+      timers_.Arm(kTakeoverReconnect, [this]() { Reconnect(); });
+      return;
+    }
+    absl::PrintF("Reconnecting to ME in %s\n", absl::FormatDuration(reconnect_backoff_));
+    timers_.Arm(reconnect_backoff_, [this]() { Reconnect(); });
+  }
+
+  void Reconnect() {
+    if (!apf_.Connect()) {
+      if (!taking_over_) {
+        reconnect_backoff_ = std::min(reconnect_backoff_ * 2,
+                                      absl::GetFlag(FLAGS_reconnect_backoff_max));
+      }
+      ScheduleReconnect();
+      return;
+    }
+    OnConnected();
+  }
+
+  void OnConnected() {
+    taking_over_ = false;
+    RegisterApf();
+    ArmLivenessCheck();
+    reconnect_backoff_ = absl::GetFlag(FLAGS_reconnect_backoff);
+    if (disconnected_since_ != absl::InfinitePast()) {
+      mei_reconnect_time_.Add(absl::Now() - disconnected_since_);
+    }
+    for (auto &[port, prebound] : prebound_) {
+      if (prebound.release_timer == 0) {
+        ArmPrebindRelease(port);
+      }
+    }
+  }
+
+  // A stall is detected at most a quarter of the interval or timeout late.
+  void ArmLivenessCheck() {
+    absl::Duration interval = absl::GetFlag(FLAGS_keepalive_interval);
+    absl::Duration timeout = absl::GetFlag(FLAGS_keepalive_timeout);
+    if (interval <= absl::ZeroDuration()) {
+      return;
+    }
+    timers_.Cancel(liveness_timer_);
+    liveness_timer_ =
+        timers_.Arm(std::min(interval, timeout) / 4, [this, interval, timeout]() {
+          liveness_timer_ = 0;
+          if (apf_fd_ < 0) {
+            return;
+          }
+          // A stall is handled as a MEI error by the main loop.
+          if (apf_.CheckLiveness(absl::Now(), interval, timeout)) {
+            ArmLivenessCheck();
+          }
+        });
+  }
+
+  // Poll MEI for writing while APF has queued messages.
+  void UpdateApfEvents() {
+    if (apf_fd_ < 0) {
+      return;
+    }
+    uint32_t events = EPOLLIN | (apf_.WantWrite() ? EPOLLOUT : 0);
+    if (events != apf_events_) {
+      epoll_ctl_mod(epoll_fd_, apf_fd_, events);
+      apf_events_ = events;
+    }
+  }
+
+  // Wake up when the next channel held back by send pacing may send.
+  void UpdatePacingTimer() {
+    absl::Time next = apf_.NextPacingTime();
+    if (pacing_timer_ != 0 && pacing_deadline_ <= next) {
+      return;
+    }
+    timers_.Cancel(pacing_timer_);
+    pacing_timer_ = 0;
+    if (next == absl::InfiniteFuture()) {
+      return;
+    }
+    pacing_deadline_ = next;
+    pacing_timer_ =
+        timers_.Arm(std::max(next - absl::Now(), absl::ZeroDuration()), [this]() {
+          pacing_timer_ = 0;
+          for (const auto &comp : apf_.HandlePacing(absl::Now())) {
+            HandleMeRequest(comp);
+          }
+        });
+  }
+
+  void ReleaseAllChannels() {
+    // Waiters can't fall back to ME anymore.
+    single_flight_.Clear();
+    for (auto &[id, channel] : channels_) {
+      CancelTimers(channel);
+      if (channel.fd >= 0) {
+        CloseFd(channel);
+      }
+    }
+    channels_.clear();
+  }
+
+  //
+  // Hot restart
+  //
+
+  void ListenControl() {
+    sockaddr_un sa{};
+    std::string path = absl::GetFlag(FLAGS_control_socket);
+    die_if(path.size() >= sizeof(sa.sun_path), "control socket path too long");
+    sa.sun_family = AF_UNIX;
+    memcpy(sa.sun_path, path.c_str(), path.size() + 1);
+
+    control_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    die_if(control_fd_ < 0, "socket creation fail");
+    // The old apfd's socket, if any, has been handed off already.
+    unlink(path.c_str());
+    int err = bind(control_fd_, sa_ptr(sa), sizeof(sa));
+    die_if(err == -1, "bind %s errno=%d", path.c_str(), errno);
+    chmod(path.c_str(), 0600);
+    err = listen(control_fd_, 1);
+    die_if(err == -1, "listen");
+    epoll_ctl_add(epoll_fd_, control_fd_, EPOLLIN);
+  }
+
+  // Old side: send the listeners and held clients to the new apfd, then
+  // stop accepting and exit once the channels are drained.
+  void HandleHandoff() {
+    int fd = accept4(control_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd < 0) {
+      return;
+    }
+    ucred cred{};
+    socklen_t cred_len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0 ||
+        cred.uid != getuid()) {
+      absl::PrintF("Rejected handoff to uid=%u\n", cred.uid);
+      close(fd);
+      return;
+    }
+
+    // Held clients with their peer for the log, should their message fail.
+    std::vector<HandoffEntry> entries;
+    std::vector<int> fds;
+    std::vector<std::string> peers;
+    for (const auto &[listen_fd, port] : listen_fd_port_) {
+      entries.push_back(HandoffEntry{HandoffEntry::kListener, port});
+      fds.push_back(listen_fd);
+      peers.emplace_back();
+    }
+    die_if(fds.size() > kMaxHandoffFds, "too many listeners to hand off");
+    for (const auto &[port, prebound] : prebound_) {
+      for (const HeldClient &client : prebound.held) {
+        entries.push_back(HandoffEntry{HandoffEntry::kHeldClient, port});
+        fds.push_back(client.fd);
+        peers.push_back(absl::StrFormat("%s:%u", client.peer_ip, client.peer_port));
+      }
+    }
+    // Rate limited clients are held by the new apfd without a delay.
+    for (const auto &[fd, delayed] : delayed_) {
+      entries.push_back(HandoffEntry{HandoffEntry::kHeldClient, delayed.port});
+      fds.push_back(fd);
+      peers.push_back(absl::StrFormat("%s:%u", delayed.client.peer_ip,
+                                      delayed.client.peer_port));
+    }
+
+    // The listeners all go in the first message, so the new apfd either
+    // gets all of them or nothing is handed off.
+    size_t sent = 0;
+    while (sent < fds.size()) {
+      size_t n = std::min(fds.size() - sent, kMaxHandoffFds);
+      if (!SendHandoff(fd, absl::MakeConstSpan(entries).subspan(sent, n),
+                       absl::MakeConstSpan(fds).subspan(sent, n))) {
+        break;
+      }
+      sent += n;
+    }
+    int send_errno = errno;
+    close(fd);
+    if (sent == 0 && !fds.empty()) {
+      absl::PrintF("Handoff failed errno=%d\n", send_errno);
+      return;
+    }
+    // Held clients of a later message that failed are reset when closed
+    // below. The ones sent are only closed, the new apfd has them now.
+    for (size_t i = sent; i < fds.size(); i++) {
+      absl::PrintF("Handoff failed errno=%d, resetting %s port=%u\n", send_errno,
+                   peers[i], entries[i].port);
+      ResetFd(fds[i]);
+    }
+
+    absl::PrintF("Handed off %u fds, dropped %u held clients, draining %u channels\n",
+                 sent, fds.size() - sent, channels_.size());
+    for (const auto &[listen_fd, port] : listen_fd_port_) {
+      epoll_ctl_del(epoll_fd_, listen_fd);
+      close(listen_fd);
+    }
+    listen_fd_port_.clear();
+    for (auto &[port, prebound] : prebound_) {
+      timers_.Cancel(prebound.release_timer);
+      for (const HeldClient &client : prebound.held) {
+        close(client.fd);
+      }
+    }
+    prebound_.clear();
+    for (auto &[fd, delayed] : delayed_) {
+      timers_.Cancel(delayed.timer);
+      rate_limiter_.Dequeue(delayed.source);
+      close(fd);
+    }
+    delayed_.clear();
+    // The socket path now belongs to the new apfd.
+    epoll_ctl_del(epoll_fd_, control_fd_);
+    close(control_fd_);
+    control_fd_ = -1;
+
+    handed_off_ = true;
+    timers_.Arm(absl::GetFlag(FLAGS_handoff_timeout), [this]() {
+      absl::PrintF("Handoff timeout, dropping %u channels\n", channels_.size());
+      for (auto it = channels_.begin(); it != channels_.end();) {
+        ReleaseChannel((it++)->first);
+      }
+    });
+  }
+
+  // New side: receive the listeners from the old apfd. Ports are held like
+  // prebound ones until ME requests them from this process.
+  void TakeOver() {
+    sockaddr_un sa{};
+    std::string path = absl::GetFlag(FLAGS_control_socket);
+    die_if(path.empty(), "--takeover requires --control_socket");
+    die_if(path.size() >= sizeof(sa.sun_path), "control socket path too long");
+    sa.sun_family = AF_UNIX;
+    memcpy(sa.sun_path, path.c_str(), path.size() + 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    die_if(fd < 0, "socket creation fail");
+    int err = connect(fd, sa_ptr(sa), sizeof(sa));
+    die_if(err == -1, "connect %s errno=%d", path.c_str(), errno);
+
+    // Messages of up to kMaxHandoffFds records until the old apfd closes the
+    // connection. Every message carries fds, so the kernel never merges two.
+    std::vector<HandoffEntry> entries(kMaxHandoffFds);
+    std::vector<char> control(CMSG_SPACE(kMaxHandoffFds * sizeof(int)));
+    size_t total = 0;
+    for (;;) {
+      iovec iov{
+          .iov_base = entries.data(),
+          .iov_len = entries.size() * sizeof(HandoffEntry),
+      };
+      msghdr msg{};
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = control.data();
+      msg.msg_controllen = control.size();
+      ssize_t r = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+      die_if(r < 0, "recvmsg errno=%d", errno);
+      if (r == 0) {
+        break;
+      }
+      die_if(msg.msg_flags & MSG_CTRUNC, "handoff fds truncated");
+
+      std::vector<int> fds;
+      for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr;
+           cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+          size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+          fds.resize(n);
+          memcpy(fds.data(), CMSG_DATA(cmsg), n * sizeof(int));
+        }
+      }
+      size_t count = r / sizeof(HandoffEntry);
+      die_if(r % sizeof(HandoffEntry) != 0 || fds.size() != count,
+             "handoff mismatch bytes=%d fds=%u", r, fds.size());
+
+      for (size_t i = 0; i < count; i++) {
+        const HandoffEntry &entry = entries[i];
+        if (entry.kind == HandoffEntry::kListener) {
+          listen_fd_port_[fds[i]] = entry.port;
+          epoll_ctl_add(epoll_fd_, fds[i], EPOLLIN);
+          prebound_.try_emplace(entry.port);
+        } else {
+          // The client may have reset since the old apfd accepted it.
+          sockaddr_storage ss{};
+          socklen_t sslen = sizeof(ss);
+          std::optional<std::pair<std::string, uint32_t>> peer;
+          if (getpeername(fds[i], sa_ptr(ss), &sslen) == 0) {
+            peer = PeerAddress(ss);
+          }
+          if (!peer) {
+            absl::PrintF("Dropping handed off client port=%u errno=%d\n", entry.port,
+                         errno);
+            close(fds[i]);
+            continue;
+          }
+          HoldClient(entry.port, fds[i], peer->first, peer->second);
+        }
+      }
+      total += count;
+    }
+    close(fd);
+    absl::PrintF("Took over %u fds from %s\n", total, path);
+    // Count the downtime as a recovery.
+    disconnected_since_ = absl::Now();
+  }
+
+  // Returns peer ip and port, unix peers get a synthetic port. Returns
+  // nullopt for other families, e.g. AF_UNSPEC of a reset connection.
+  std::optional<std::pair<std::string, uint32_t>> PeerAddress(
+      const sockaddr_storage &ss) {
+    char buf[INET_ADDRSTRLEN];
+    if (ss.ss_family == AF_UNIX) {
+      // Unix peers have no port, make up one from the ephemeral range for
+      // the ApfChannelOpenRequest.
+      uint32_t peer_port = next_unix_peer_port_;
+      next_unix_peer_port_ =
+          next_unix_peer_port_ == 65535 ? 49152 : next_unix_peer_port_ + 1;
+      return std::make_pair("unix", peer_port);
+    }
+    if (ss.ss_family != AF_INET) {
+      return std::nullopt;
+    }
+    // get peer ip and port
+    auto *sa = reinterpret_cast<const sockaddr_in *>(&ss);
+    const char *ret = inet_ntop(ss.ss_family, &sa->sin_addr, buf, sizeof(buf));
+    die_if(ret == nullptr, "inet_ntop");
+    return std::make_pair(std::string(buf), uint32_t{ntohs(sa->sin_port)});
+  }
+
   void HandleIncomingConnection(int listen_fd) {
     sockaddr_storage ss{};
     socklen_t sslen = sizeof(ss);
-    char buf[4096];
 
     int client_fd = accept4(listen_fd, sa_ptr(ss), &sslen, SOCK_NONBLOCK);
     die_if(client_fd < 0, "accept errno=%d", errno);
-    die_if(ss.ss_family != AF_INET, "bad family");
-
-    // get peer ip and port
-    auto *sa = reinterpret_cast<const sockaddr_in *>(&ss);
-    const char *ret = inet_ntop(ss.ss_family, &sa->sin_addr, buf, 4096);
-    die_if(ret == nullptr, "inet_ntop");
-    std::string peer_ip = buf;
-    uint32_t peer_port = ntohs(sa->sin_port);
+    std::optional<std::pair<std::string, uint32_t>> peer = PeerAddress(ss);
+    if (!peer) {
+      absl::PrintF("Rejected client of family=%u\n", ss.ss_family);
+      close(client_fd);
+      return;
+    }
+    auto [peer_ip, peer_port] = *peer;
 
     uint32_t listen_port = listen_fd_port_[listen_fd];
-    uint32_t channel_id = apf_.OpenChannel(peer_port, listen_port);
+    if (const PortProfile profile = Profile(listen_port); profile.conn_rate > 0) {
+      std::string source = RateLimitSource(client_fd, listen_port, peer_ip);
+      RateLimiter::Decision decision = rate_limiter_.Admit(
+          source, {profile.conn_rate, profile.conn_burst, profile.conn_queue},
+          absl::Now());
+      if (decision.verdict == RateLimiter::Decision::kReject) {
+        absl::PrintF("Rate limited, rejected %s:%u source=%s\n", peer_ip, peer_port,
+                     source);
+        ResetFd(client_fd);
+        close(client_fd);
+        return;
+      }
+      if (decision.verdict == RateLimiter::Decision::kDelay) {
+        DelayClient(client_fd, peer_ip, peer_port, listen_port, std::move(source),
+                    decision.delay);
+        return;
+      }
+    }
+    AdmitClient(client_fd, peer_ip, peer_port, listen_port);
+  }
+
+  // Rate limiting key: the port and the peer address, or the uid on unix
+  // sockets as all their peers look the same.
+  std::string RateLimitSource(int fd, uint32_t port, const std::string &peer_ip) {
+    if (peer_ip != "unix") {
+      return absl::StrFormat("%u/%s", port, peer_ip);
+    }
+    ucred cred{};
+    socklen_t cred_len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0) {
+      return absl::StrFormat("%u/unix", port);
+    }
+    return absl::StrFormat("%u/uid:%u", port, cred.uid);
+  }
+
+  // Not polled until the delay is over, data stays in the socket like on
+  // held clients.
+  void DelayClient(int fd, const std::string &peer_ip, uint32_t peer_port,
+                   uint32_t port, std::string source, absl::Duration delay) {
+    absl::PrintF("Rate limited, delaying %s:%u by %s fd=%d\n", peer_ip, peer_port,
+                 absl::FormatDuration(delay), fd);
+    TimerWheel::TimerId timer = timers_.Arm(delay, [this, fd]() {
+      auto it = delayed_.find(fd);
+      if (it == delayed_.end()) {
+        return;
+      }
+      DelayedClient delayed = std::move(it->second);
+      delayed_.erase(it);
+      rate_limiter_.Dequeue(delayed.source);
+      rate_limit_delay_.Add(absl::Now() - delayed.queued);
+      AdmitClient(fd, delayed.client.peer_ip, delayed.client.peer_port, delayed.port);
+    });
+    delayed_[fd] = DelayedClient{HeldClient{fd, peer_ip, peer_port}, port,
+                                 std::move(source), absl::Now(), timer};
+  }
+
+  // Start a channel for an accepted client, or hold it if ME hasn't
+  // requested the port yet.
+  void AdmitClient(int client_fd, const std::string &peer_ip, uint32_t peer_port,
+                   uint32_t listen_port) {
+    if (prebound_.find(listen_port) != prebound_.end()) {
+      absl::PrintF("Holding %s:%u fd=%d\n", peer_ip, peer_port, client_fd);
+      HoldClient(listen_port, client_fd, peer_ip, peer_port);
+      return;
+    }
+    StartChannel(client_fd, peer_ip, peer_port, listen_port);
+  }
+
+  // Not polled until ME approves the port, data stays in the socket. Once
+  // prebind_queue clients are held, accepting stops and later clients wait
+  // in the listen backlog instead of being refused.
+  void HoldClient(uint32_t port, int fd, const std::string &peer_ip,
+                  uint32_t peer_port) {
+    PrebindPort &prebound = prebound_[port];
+    prebound.held.push_back(HeldClient{fd, peer_ip, peer_port});
+    if (!prebound.paused && prebound.held.size() >= absl::GetFlag(FLAGS_prebind_queue)) {
+      absl::PrintF("Prebind queue full, pausing accept on port %u\n", port);
+      prebound.paused = true;
+      prebind_paused_++;
+      SetAccepting(port, false);
+    }
+  }
+
+  void SetAccepting(uint32_t port, bool accepting) {
+    for (const auto &[fd, listen_port] : listen_fd_port_) {
+      if (listen_port == port) {
+        epoll_ctl_mod(epoll_fd_, fd, accepting ? EPOLLIN : 0);
+      }
+    }
+  }
+
+  void StartChannel(int client_fd, const std::string &peer_ip, uint32_t peer_port,
+                    uint32_t listen_port) {
+    const PortProfile profile = Profile(listen_port);
+    uint32_t channel_id = apf_.OpenChannel(peer_port, listen_port, profile.window);
+    apf_.SetWeight(channel_id, profile.weight);
+    ApplySocketOptions(client_fd, profile);
     channel_fd_id_[client_fd] = channel_id;
     channels_[channel_id] = ChannelInfo{
         .fd = client_fd,
         .channel_id = channel_id,
+        .port = listen_port,
+        .accepted = absl::Now(),
+        .last_active = absl::Now(),
+        .open_timer = timers_.Arm(absl::GetFlag(FLAGS_open_timeout),
+                                  [this, channel_id]() { OnOpenTimeout(channel_id); }),
+        .me_request_sent = absl::InfinitePast(),
+        .read_chunk = profile.read_chunk,
     };
+    if (wsman_tap_ports_.count(listen_port)) {
+      channels_[channel_id].tap =
+          std::make_unique<WsmanProfiler::Stream>(&wsman_profiler_);
+    }
+    if (dedup_ports_.count(listen_port)) {
+      channels_[channel_id].dedup = std::make_unique<DedupStream>();
+    }
 
     absl::PrintF("Incoming %s:%u fd=%d\n", peer_ip, peer_port, client_fd);
-    // Don't start poll the fd, wait for OpenChannelResult
+    if (absl::GetFlag(FLAGS_early_data) > 0) {
+      // APF buffers what's read until the channel is confirmed.
+      StartPolling(channels_[channel_id]);
+    }
+  }
+
+  void StartPolling(ChannelInfo &channel) {
+    epoll_ctl_add(epoll_fd_, channel.fd,
+                  EPOLLIN | EPOLLOUT | EPOLLHUP | EPOLLRDHUP | EPOLLET);
+    channel.polling = true;
   }
 
   void BeginListen(uint32_t port) {
@@ -145,11 +978,144 @@ private:
     err = bind(fd, sa_ptr(listen_sa), sizeof(listen_sa));
     die_if(err == -1, "bind");
 
-    err = listen(fd, 4096);
+    const PortProfile profile = Profile(port);
+    ApplySocketOptions(fd, profile);
+    err = listen(fd, profile.backlog);
+    die_if(err == -1, "listen");
+
+    listen_fd_port_[fd] = port;
+    epoll_ctl_add(epoll_fd_, fd, EPOLLIN);
+    absl::PrintF("Listening on port %u %s\n", port, profile.ToString());
+
+    if (!absl::GetFlag(FLAGS_unix_socket_dir).empty()) {
+      BeginListenUnix(port);
+    }
+  }
+
+  PortProfile Profile(uint32_t port) const {
+    auto it = profiles_.find(port);
+    return it == profiles_.end() ? DefaultPortProfile(port) : it->second;
+  }
+
+  // Set on listeners before listen(), so the buffer sizes also apply to
+  // the TCP window scale of accepted sockets, and again on each client
+  // since held and handed off clients were accepted elsewhere.
+  void ApplySocketOptions(int fd, const PortProfile &profile) {
+    int domain = AF_UNSPEC;
+    socklen_t len = sizeof(domain);
+    getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &len);
+    int one = 1;
+    if (profile.nodelay && domain != AF_UNIX &&
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) == -1) {
+      absl::PrintF("TCP_NODELAY failed fd=%d errno=%d\n", fd, errno);
+    }
+    if (profile.rcvbuf > 0 &&
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &profile.rcvbuf, sizeof(int)) == -1) {
+      absl::PrintF("SO_RCVBUF failed fd=%d errno=%d\n", fd, errno);
+    }
+    if (profile.sndbuf > 0 &&
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &profile.sndbuf, sizeof(int)) == -1) {
+      absl::PrintF("SO_SNDBUF failed fd=%d errno=%d\n", fd, errno);
+    }
+  }
+
+  void StopListen(uint32_t port) {
+    for (auto it = listen_fd_port_.begin(); it != listen_fd_port_.end();) {
+      if (it->second != port) {
+        ++it;
+        continue;
+      }
+      epoll_ctl_del(epoll_fd_, it->first);
+      close(it->first);
+      it = listen_fd_port_.erase(it);
+    }
+    if (const std::string dir = absl::GetFlag(FLAGS_unix_socket_dir); !dir.empty()) {
+      unlink(absl::StrFormat("%s/%u", dir, port).c_str());
+    }
+  }
+
+  // Listen before ME requests the port, accepted clients are held until
+  // then. Released if ME doesn't request the port within prebind_timeout.
+  void Prebind(uint32_t port) {
+    BeginListen(port);
+    prebound_[port];
+    ArmPrebindRelease(port);
+    absl::PrintF("Prebound port %u\n", port);
+  }
+
+  void ArmPrebindRelease(uint32_t port) {
+    prebound_[port].release_timer =
+        timers_.Arm(absl::GetFlag(FLAGS_prebind_timeout), [this, port]() {
+          auto it = prebound_.find(port);
+          if (it == prebound_.end()) {
+            return;
+          }
+          absl::PrintF("ME didn't request prebound port %u, releasing %u clients\n", port,
+                       it->second.held.size());
+          for (const HeldClient &client : it->second.held) {
+            close(client.fd);
+          }
+          prebound_.erase(it);
+          StopListen(port);
+        });
+  }
+
+  // ME approved a prebound port, start the held clients.
+  void ReleasePrebound(uint32_t port) {
+    auto it = prebound_.find(port);
+    PrebindPort prebound = std::move(it->second);
+    prebound_.erase(it);
+    timers_.Cancel(prebound.release_timer);
+    if (prebound.paused) {
+      SetAccepting(port, true);
+    }
+    for (const HeldClient &client : prebound.held) {
+      StartChannel(client.fd, client.peer_ip, client.peer_port, port);
+    }
+  }
+
+  // Same as BeginListen() but on <unix_socket_dir>/<port>, which saves the
+  // loopback TCP overhead for local clients.
+  void BeginListenUnix(uint32_t port) {
+    sockaddr_un listen_sa{};
+    int err;
+
+    std::string path =
+        absl::StrFormat("%s/%u", absl::GetFlag(FLAGS_unix_socket_dir), port);
+    die_if(path.size() >= sizeof(listen_sa.sun_path), "unix socket path too long");
+    listen_sa.sun_family = AF_UNIX;
+    memcpy(listen_sa.sun_path, path.c_str(), path.size() + 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    die_if(fd < 0, "socket creation fail");
+
+    // Replace a stale socket of an earlier run, but nothing else.
+    if (struct stat st; lstat(path.c_str(), &st) == 0) {
+      die_if(!S_ISSOCK(st.st_mode), "%s exists and is not a socket", path.c_str());
+      unlink(path.c_str());
+    }
+    err = bind(fd, sa_ptr(listen_sa), sizeof(listen_sa));
+    die_if(err == -1, "bind %s errno=%d", path.c_str(), errno);
+    // The same users as on the loopback port, unless restricted to a group.
+    if (std::string name = absl::GetFlag(FLAGS_unix_socket_group); !name.empty()) {
+      group *gr = getgrnam(name.c_str());
+      die_if(gr == nullptr, "unknown group %s", name.c_str());
+      err = chown(path.c_str(), -1, gr->gr_gid);
+      die_if(err == -1, "chown %s errno=%d", path.c_str(), errno);
+      err = chmod(path.c_str(), 0660);
+    } else {
+      err = chmod(path.c_str(), 0666);
+    }
+    die_if(err == -1, "chmod %s errno=%d", path.c_str(), errno);
+
+    const PortProfile profile = Profile(port);
+    ApplySocketOptions(fd, profile);
+    err = listen(fd, profile.backlog);
     die_if(err == -1, "listen");
 
     listen_fd_port_[fd] = port;
     epoll_ctl_add(epoll_fd_, fd, EPOLLIN);
+    absl::PrintF("Listening on %s\n", path);
   }
 
   void HandleMeRequest(AmtPortForwarding::MeRequest req) {
@@ -157,12 +1123,23 @@ private:
       return;
     }
     if (const auto *fwd_req = std::get_if<AmtPortForwarding::RequestTcpForward>(&*req)) {
-      if (allowed_ports_.find(fwd_req->port) == allowed_ports_.end()) {
+      if (allowed_ports_.find(fwd_req->port) == allowed_ports_.end() || handed_off_) {
         absl::PrintF("Rejected: %s:%u\n", fwd_req->addr, fwd_req->port);
         fwd_req->reject();
         return;
       }
 
+      if (prebound_.find(fwd_req->port) != prebound_.end()) {
+        fwd_req->accept();
+        absl::PrintF("Accept prebound: %s:%u\n", fwd_req->addr, fwd_req->port);
+        if (disconnected_since_ != absl::InfinitePast()) {
+          recovery_time_.Add(absl::Now() - disconnected_since_);
+          disconnected_since_ = absl::InfinitePast();
+        }
+        ReleasePrebound(fwd_req->port);
+        return;
+      }
+
       for (auto it : listen_fd_port_) {
         if (it.second == fwd_req->port) {
           absl::PrintF("Already listening on port %u\n", fwd_req->port);
@@ -183,17 +1160,48 @@ private:
         return;
       }
 
+      ChannelInfo &channel = it->second;
+      timers_.Cancel(channel.open_timer);
+      channel.open_timer = 0;
+      open_latency_.Add(absl::Now() - channel.accepted);
       if (!open_result->success) {
         absl::PrintF("OpenChannel failed channel=%u\n", open_result->channel_id);
-        channel_fd_id_.erase(it->second.fd);
-        close(it->second.fd);
-        channels_.erase(it);
+        open_failures_++;
+        if (channel.fd >= 0) {
+          ResetFd(channel.fd);
+        }
+        ReleaseChannel(open_result->channel_id);
         return;
       }
+      open_successes_++;
 
-      epoll_ctl_add(epoll_fd_, it->second.fd,
-                    EPOLLIN | EPOLLOUT | EPOLLHUP | EPOLLRDHUP | EPOLLET);
+      // With --early_data the client may be gone already, the channel is
+      // closed then and reclaimed once ME confirms the close.
+      if (!channel.polling && channel.fd >= 0) {
+        StartPolling(channel);
+      }
+      channel.last_active = absl::Now();
+      if (channel.me_request_sent != absl::InfinitePast()) {
+        // Early data was sent with the confirmation.
+        channel.me_request_sent = channel.last_active;
+      }
+      if (absl::Duration cork = Profile(channel.port).cork_delay;
+          cork > absl::ZeroDuration()) {
+        channel.cork_delay = cork;
+        apf_.SetCork(channel.channel_id, true);
+      }
+      absl::Duration idle_timeout = absl::GetFlag(FLAGS_idle_timeout);
+      if (idle_timeout > absl::ZeroDuration()) {
+        channel.idle_timer = timers_.Arm(
+            idle_timeout, [this, id = channel.channel_id]() { OnIdleTimeout(id); });
+      }
       absl::PrintF("Accepting data on channel %u\n", open_result->channel_id);
+      // Early data was flushed with the confirmation, read the rest unless
+      // it's still waiting for the window.
+      if (channel.apf_blocked && !apf_.IsBlocked(channel.channel_id)) {
+        HandleFdToApfData(/*is_fd=*/false, channel);
+        MaybeReclaim(open_result->channel_id);
+      }
     } else if (const auto *apf_data =
                    std::get_if<AmtPortForwarding::IncomingData>(&*req)) {
       auto it = channels_.find(apf_data->channel_id);
@@ -201,7 +1209,12 @@ private:
         absl::PrintF("unexpected data on channel=%u\n", apf_data->channel_id);
         return;
       }
+      if (it->second.me_request_sent != absl::InfinitePast()) {
+        me_latency_.Add(absl::Now() - it->second.me_request_sent);
+        it->second.me_request_sent = absl::InfinitePast();
+      }
       HandleApfToFdData(/*is_fd=*/false, it->second);
+      MaybeReclaim(apf_data->channel_id);
     } else if (const auto *comp =
                    std::get_if<AmtPortForwarding::SendDataCompletion>(&*req)) {
       auto it = channels_.find(comp->channel_id);
@@ -210,22 +1223,30 @@ private:
         return;
       }
       HandleFdToApfData(/*is_fd=*/false, it->second);
+      MaybeReclaim(comp->channel_id);
     } else if (const auto *closure =
                    std::get_if<AmtPortForwarding::ChannelClosed>(&*req)) {
       auto it = channels_.find(closure->channel_id);
       if (it == channels_.end()) {
-        // absl::PrintF("unexpected closure on channel=%u\n", closure->channel_id);
+        absl::PrintF("unexpected closure on channel=%u\n", closure->channel_id);
         return;
       }
-      HandleChannelClosure(/*is_fd=*/false, it->second);
+      it->second.apf_closed = true;
+      StartDraining(it->second);
+      // Flush what's left, then propagate the close to the client.
+      HandleApfToFdData(/*is_fd=*/false, it->second);
+      MaybeReclaim(closure->channel_id);
     } else if (std::get_if<AmtPortForwarding::MeDisconnect>(&*req)) {
-      die("ME disconnects");
+      OnMeDisconnect();
     } else {
       die("Unexpected variant");
     }
   }
 
   void HandleFdToApfData(bool is_fd, ChannelInfo &channel) {
+    if (channel.fd < 0 || channel.fd_read_closed) {
+      return;
+    }
     if (is_fd && channel.apf_blocked) {
       // Can't do much
       return;
@@ -234,60 +1255,524 @@ private:
     if (!is_fd) {
       // std::cerr << "Channel unblocked " << channel.fd << std::endl;
       channel.apf_blocked = false;
+      if (channel.tap) {
+        channel.tap->SetStalled(false, absl::Now());
+      }
+    }
+    if (channel.dedup_waiting || !channel.dedup_out.empty()) {
+      // Resumed once the response is written.
+      return;
     }
 
     // Either APF is unblocked or new data arrives.
-    uint8_t buf[4096];
-    int r = read(channel.fd, buf, 4096);
-    if (r < 0 && errno == EAGAIN) {
+    // Read until the fd is drained or APF blocks, so that corked channels
+    // see all the available data before the partial frame is held back.
+    uint8_t buf[kMaxReadChunk];
+    while (true) {
+      int r = read(channel.fd, buf, channel.read_chunk);
+      if (r < 0 && errno == EAGAIN) {
+        break;
+      }
+      if (r == 0) {
+        absl::PrintF("EOF fd=%d\n", channel.fd);
+        channel.fd_read_closed = true;
+        CancelCork(channel);
+        apf_.CloseChannel(channel.channel_id);
+        StartDraining(channel);
+        return;
+      }
+      if (r < 0) {
+        absl::PrintF("read err fd=%d errno=%d\n", channel.fd, errno);
+        AbortFd(channel);
+        return;
+      }
+
+      channel.last_active = absl::Now();
+      if (channel.me_request_sent == absl::InfinitePast()) {
+        channel.me_request_sent = channel.last_active;
+      }
+      if (channel.tap) {
+        channel.tap->OnRequestData(absl::MakeConstSpan(buf, r), channel.last_active);
+      }
+      ForwardClientData(channel, absl::MakeConstSpan(buf, r));
+      if (channel.tap && channel.apf_blocked) {
+        channel.tap->SetStalled(true, channel.last_active);
+      }
+      if (channel.apf_blocked || channel.dedup_waiting ||
+          r < static_cast<int>(channel.read_chunk)) {
+        break;
+      }
+    }
+    MaybeArmCork(channel);
+  }
+
+  // Sends client data to ME, on --dedup_ports only once a complete
+  // request is read, unless an identical one is in flight already.
+  void ForwardClientData(ChannelInfo &channel, absl::Span<const uint8_t> data) {
+    if (!channel.dedup) {
+      channel.apf_blocked = apf_.SendData(channel.channel_id, data);
+      return;
+    }
+    DedupStream::Verdict verdict = channel.dedup->OnRequestData(data);
+    if (verdict == DedupStream::Verdict::kPartial) {
+      return;
+    }
+    std::string request = channel.dedup->TakeBuffered();
+    if (verdict == DedupStream::Verdict::kPassthrough) {
+      channel.dedup.reset();
+    } else if (channel.dedup->outstanding() == 0 && single_flight_.Eligible(request)) {
+      switch (single_flight_.Join(channel.port, request, channel.channel_id)) {
+      case SingleFlight::Role::kWaiter:
+        channel.dedup_waiting = true;
+        channel.dedup_request = std::move(request);
+        // Nothing is sent to ME.
+        channel.me_request_sent = absl::InfinitePast();
+        return;
+      case SingleFlight::Role::kLeader:
+        channel.dedup_leader = true;
+        break;
+      case SingleFlight::Role::kAlone:
+        break;
+      }
+    }
+    if (channel.dedup) {
+      channel.dedup->RequestSent();
+    }
+    channel.apf_blocked = apf_.SendData(channel.channel_id, AsBytes(request));
+  }
+
+  // Hands the leader's response to the waiters, or has them send their own
+  // request if there is none.
+  void FinishFlight(const SingleFlight::Result &result) {
+    for (uint32_t id : result.waiters) {
+      auto it = channels_.find(id);
+      if (it == channels_.end()) {
+        continue;
+      }
+      ChannelInfo &waiter = it->second;
+      waiter.dedup_waiting = false;
+      std::string request = std::move(waiter.dedup_request);
+      if (!result.response.empty()) {
+        waiter.dedup_out = result.response;
+        HandleApfToFdData(/*is_fd=*/false, waiter);
+        continue;
+      }
+      if (waiter.fd_read_closed || !apf_.connected()) {
+        continue;
+      }
+      waiter.dedup->RequestSent();
+      waiter.last_active = waiter.me_request_sent = absl::Now();
+      waiter.apf_blocked = apf_.SendData(id, AsBytes(request));
+      if (waiter.apf_blocked) {
+        if (waiter.tap) {
+          waiter.tap->SetStalled(true, waiter.last_active);
+        }
+      } else {
+        // Read the requests that came after.
+        HandleFdToApfData(/*is_fd=*/true, waiter);
+      }
+    }
+  }
+
+  void LeaveFlight(ChannelInfo &channel) {
+    if (channel.dedup_leader) {
+      channel.dedup_leader = false;
+      FinishFlight(single_flight_.Abort(channel.channel_id));
+    }
+    if (channel.dedup_waiting) {
+      channel.dedup_waiting = false;
+      single_flight_.Leave(channel.channel_id);
+    }
+  }
+
+  // Writes the response copied from a leader. Returns true once it's all
+  // written and reading the client is resumed.
+  bool FlushDedupOut(ChannelInfo &channel) {
+    while (!channel.dedup_out.empty()) {
+      ssize_t written = send(channel.fd, channel.dedup_out.data(),
+                             channel.dedup_out.size(), MSG_NOSIGNAL);
+      if (written < 0 && errno == EAGAIN) {
+        return false;
+      }
+      if (written <= 0) {
+        absl::PrintF("write err fd=%d errno=%d\n", channel.fd, errno);
+        AbortFd(channel);
+        return false;
+      }
+      channel.last_active = absl::Now();
+      if (channel.tap) {
+        channel.tap->OnResponseData(AsBytes(channel.dedup_out).subspan(0, written),
+                                    channel.last_active);
+      }
+      channel.dedup_out.erase(0, written);
+    }
+    HandleFdToApfData(/*is_fd=*/true, channel);
+    return true;
+  }
+
+  // Flush the held back data after cork_delay.
+  void MaybeArmCork(ChannelInfo &channel) {
+    if (channel.cork_delay == absl::ZeroDuration()) {
+      return;
+    }
+    if (!apf_.HasCorkedData(channel.channel_id)) {
+      CancelCork(channel);
       return;
     }
-    if (r == 0) {
-      absl::PrintF("EOF fd=%d\n", channel.fd);
+    if (channel.cork_timer != 0) {
       return;
     }
-    die_if(r < 0, "read err r=%d errno=%d", r, errno);
+    channel.cork_timer =
+        timers_.Arm(channel.cork_delay, [this, id = channel.channel_id]() {
+          auto it = channels_.find(id);
+          if (it == channels_.end()) {
+            return;
+          }
+          it->second.cork_timer = 0;
+          apf_.FlushCorked(id);
+        });
+  }
 
-    channel.apf_blocked = apf_.SendData(channel.channel_id, absl::MakeConstSpan(buf, r));
+  void CancelCork(ChannelInfo &channel) {
+    timers_.Cancel(channel.cork_timer);
+    channel.cork_timer = 0;
   }
 
   void HandleApfToFdData(bool is_fd, ChannelInfo &channel) {
-    if (is_fd && !channel.apf_incoming) {
+    if (is_fd && !channel.apf_incoming && channel.dedup_out.empty()) {
       // nothing to do.
       return;
     }
 
     // is_fd && apf_incoming || IncomingData event received.
-    const std::string *data = apf_.PeekData(channel.channel_id);
-    size_t off = 0;
-    size_t rem = data->size();
-    while (rem > 0) {
-      ssize_t written = write(channel.fd, data->data() + off, rem);
-      if (written < 0 && errno == EAGAIN) { // fd blocked.
+    if (channel.fd_write_closed) {
+      // Client is gone, drop the data so the APF channel can be reclaimed.
+      channel.apf_incoming = false;
+      channel.dedup_out.clear();
+      for (auto data = apf_.PeekData(channel.channel_id); !data.empty();
+           data = apf_.PeekData(channel.channel_id)) {
+        apf_.PopData(channel.channel_id, data.size());
+      }
+      return;
+    }
+
+    if (!channel.dedup_out.empty() &&
+        (!FlushDedupOut(channel) || channel.fd_write_closed)) {
+      return;
+    }
+
+    // Received data is chunked, write chunk by chunk until fd blocks.
+    size_t total = 0;
+    size_t rem = 0;
+    for (auto data = apf_.PeekData(channel.channel_id); !data.empty();
+         data = apf_.PeekData(channel.channel_id)) {
+      size_t off = 0;
+      rem = data.size();
+      while (rem > 0) {
+        ssize_t written = send(channel.fd, data.data() + off, rem, MSG_NOSIGNAL);
+        if (written < 0 && errno == EAGAIN) { // fd blocked.
+          break;
+        }
+        if (written <= 0) {
+          absl::PrintF("write err fd=%d errno=%d\n", channel.fd, errno);
+          AbortFd(channel);
+          return;
+        }
+        off += written;
+        rem -= written;
+      }
+      if (channel.tap && off > 0) {
+        channel.tap->OnResponseData(data.subspan(0, off), absl::Now());
+      }
+      if (channel.dedup && off > 0) {
+        channel.dedup->OnResponseData(data.subspan(0, off));
+      }
+      if (channel.dedup_leader && off > 0) {
+        if (auto result = single_flight_.OnResponse(channel.channel_id,
+                                                    data.subspan(0, off))) {
+          channel.dedup_leader = false;
+          FinishFlight(*result);
+        }
+      }
+      apf_.PopData(channel.channel_id, off);
+      total += off;
+      if (rem > 0) {
         break;
       }
-      die_if(written <= 0, "write");
-      off += written;
-      rem -= written;
     }
     channel.apf_incoming = rem > 0;
-    apf_.PopData(channel.channel_id, off);
+    if (total > 0) {
+      channel.last_active = absl::Now();
+    }
+
+    if (rem == 0) {
+      PropagateMeClose(channel);
+    }
+  }
+
+  // ME closed the channel and its data is written to the client: half-close
+  // the client. The APF channel may be reclaimed already, e.g. when the client
+  // sent EOF first, so this must not depend on it.
+  void PropagateMeClose(ChannelInfo &channel) {
+    if (!channel.apf_closed || channel.fd_write_closed) {
+      return;
+    }
+    LeaveFlight(channel);
+    shutdown(channel.fd, SHUT_WR);
+    channel.fd_write_closed = true;
+  }
+
+  // The client is gone: stop both directions. Data already read is still
+  // flushed to the ME by CloseChannel(), data from ME is discarded.
+  void AbortFd(ChannelInfo &channel) {
+    LeaveFlight(channel);
+    if (!channel.fd_read_closed) {
+      channel.fd_read_closed = true;
+      CancelCork(channel);
+      apf_.CloseChannel(channel.channel_id);
+    }
+    channel.fd_write_closed = true;
+    StartDraining(channel);
+    channel.apf_incoming = true;
+    HandleApfToFdData(/*is_fd=*/false, channel);
+  }
+
+  // Closes the fd once both directions are closed, then releases the slot
+  // once the APF channel is closed as well.
+  void MaybeReclaim(uint32_t channel_id) {
+    auto it = channels_.find(channel_id);
+    if (it == channels_.end()) {
+      return;
+    }
+    ChannelInfo &channel = it->second;
+    if (channel.fd >= 0 && channel.fd_read_closed && channel.fd_write_closed) {
+      CloseFd(channel);
+    }
+    if (channel.fd < 0 && channel.apf_closed) {
+      CancelTimers(channel);
+      channels_.erase(it);
+    }
   }
 
-  // If the closure is initiated by FD, we'll receive another request later by APF.
-  // But if it's initiated by APF, it will only be called once.
-  // TODO graceful shutdown
-  void HandleChannelClosure(bool is_fd, ChannelInfo &channel) {
-    epoll_ctl_del(epoll_fd_, channel.fd);
+  // Make the following close() send RST, so the client sees an error
+  // instead of an empty response.
+  void ResetFd(int fd) {
+    linger lin{.l_onoff = 1, .l_linger = 0};
+    if (setsockopt(fd, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin)) == -1) {
+      absl::PrintF("SO_LINGER failed fd=%d errno=%d\n", fd, errno);
+    }
+  }
+
+  void CloseFd(ChannelInfo &channel) {
+    LeaveFlight(channel);
+    if (channel.polling) {
+      epoll_ctl_del(epoll_fd_, channel.fd);
+      channel.polling = false;
+    }
     close(channel.fd);
-    apf_.CloseChannel(channel.channel_id);
     channel_fd_id_.erase(channel.fd);
-    channels_.erase(channel.channel_id);
-    return;
+    channel.fd = -1;
+  }
+
+  void CancelTimers(ChannelInfo &channel) {
+    timers_.Cancel(channel.open_timer);
+    timers_.Cancel(channel.idle_timer);
+    timers_.Cancel(channel.drain_timer);
+    timers_.Cancel(channel.cork_timer);
+    channel.open_timer = channel.idle_timer = channel.drain_timer = 0;
+    channel.cork_timer = 0;
+  }
+
+  // Drop the channel immediately, the ME channel is aborted.
+  void ReleaseChannel(uint32_t channel_id) {
+    auto it = channels_.find(channel_id);
+    if (it == channels_.end()) {
+      return;
+    }
+    ChannelInfo &channel = it->second;
+    CancelTimers(channel);
+    if (channel.fd >= 0) {
+      CloseFd(channel);
+    }
+    apf_.AbortChannel(channel_id);
+    channels_.erase(it);
+  }
+
+  void StartDraining(ChannelInfo &channel) {
+    if (channel.drain_timer != 0) {
+      return;
+    }
+    channel.drain_timer = timers_.Arm(absl::GetFlag(FLAGS_drain_timeout),
+                                      [this, id = channel.channel_id]() {
+                                        absl::PrintF("Drain timeout channel=%u\n", id);
+                                        ReleaseChannel(id);
+                                      });
+  }
+
+  void OnOpenTimeout(uint32_t channel_id) {
+    auto it = channels_.find(channel_id);
+    if (it == channels_.end()) {
+      return;
+    }
+    it->second.open_timer = 0;
+    absl::PrintF("Open timeout channel=%u\n", channel_id);
+    open_timeouts_++;
+    if (it->second.fd >= 0) {
+      ResetFd(it->second.fd);
+    }
+    ReleaseChannel(channel_id);
   }
 
+  void OnIdleTimeout(uint32_t channel_id) {
+    auto it = channels_.find(channel_id);
+    if (it == channels_.end()) {
+      return;
+    }
+    ChannelInfo &channel = it->second;
+    channel.idle_timer = 0;
+    // last_active is updated lazily, re-arm for the remaining time.
+    absl::Duration remaining =
+        channel.last_active + absl::GetFlag(FLAGS_idle_timeout) - absl::Now();
+    if (remaining > absl::ZeroDuration()) {
+      channel.idle_timer =
+          timers_.Arm(remaining, [this, channel_id]() { OnIdleTimeout(channel_id); });
+      return;
+    }
+    absl::PrintF("Idle timeout channel=%u\n", channel_id);
+    ReleaseChannel(channel_id);
+  }
+
+  void HandleSignal() {
+    signalfd_siginfo info;
+    while (read(signal_fd_, &info, sizeof(info)) == sizeof(info)) {
+    }
+    const AmtPortForwarding::Stats &apf_stats = apf_.stats();
+    absl::PrintF("Stats: channels=%u fds=%u apf_channels=%u opened=%u reclaimed=%u "
+                 "aborted=%u timers=%u\n",
+                 channels_.size(), channel_fd_id_.size(), apf_.channel_count(),
+                 apf_stats.channels_opened, apf_stats.channels_reclaimed,
+                 apf_stats.channels_aborted, timers_.size());
+    // Accept to OpenChannelResult, timeouts are not in the histogram.
+    absl::PrintF("Channel open: ok=%u failed=%u timeouts=%u early_data=%u %s\n",
+                 open_successes_, open_failures_, open_timeouts_, apf_stats.early_data,
+                 open_latency_.ToString());
+    if (apf_stats.cork_writes > 0) {
+      absl::PrintF("Cork: writes=%u frames=%u saved=%d forced_flushes=%u "
+                   "total_delay=%s\n",
+                   apf_stats.cork_writes, apf_stats.cork_frames,
+                   static_cast<int64_t>(apf_stats.cork_writes - apf_stats.cork_frames),
+                   apf_stats.cork_forced_flushes,
+                   absl::FormatDuration(apf_stats.cork_delay));
+    }
+    absl::PrintF("MEI queue: depth=%u peak=%u queued=%u full=%u avg_delay=%s "
+                 "max_delay=%s\n",
+                 apf_.out_queue_depth(), apf_stats.out_queue_peak, apf_stats.out_queued,
+                 apf_stats.out_queue_full,
+                 absl::FormatDuration(apf_stats.out_queued == 0
+                                          ? absl::ZeroDuration()
+                                          : apf_stats.out_queue_delay /
+                                                apf_stats.out_queued),
+                 absl::FormatDuration(apf_stats.out_queue_max_delay));
+    absl::PrintF("Send window: stalls=%u stall_time=%s paced=%u\n",
+                 apf_stats.window_stalls,
+                 absl::FormatDuration(apf_stats.window_stall_time), apf_stats.paced);
+    for (const auto &[id, channel] : channels_) {
+      const SendPacer *pacer = apf_.pacer(id);
+      if (pacer == nullptr || pacer->rtt_samples() == 0) {
+        continue;
+      }
+      absl::PrintF("  channel=%u port=%u rate=%.0fKB/s cwnd=%u srtt=%s min_rtt=%s "
+                   "stalls=%u\n",
+                   id, channel.port, pacer->rate() / 1024, pacer->cwnd(),
+                   absl::FormatDuration(pacer->srtt()),
+                   absl::FormatDuration(pacer->min_rtt()), pacer->stalls());
+    }
+    if (absl::GetFlag(FLAGS_busy_poll) > absl::ZeroDuration()) {
+      absl::PrintF("Busy poll: budget=%s spin_time=%s hits=%u misses=%u\n",
+                   absl::FormatDuration(spin_budget_), absl::FormatDuration(spin_time_),
+                   spin_hits_, spin_misses_);
+    }
+    // Recovery is until ME requests the first port again.
+    absl::PrintF("ME disconnects=%u connected=%d\n", me_disconnects_, apf_fd_ >= 0);
+    absl::PrintF("MEI reconnect time: %s\n", mei_reconnect_time_.ToString());
+    absl::PrintF("ME liveness: last_receive=%s ago probes=%u replies=%u failures=%u "
+                 "requests=%u\n",
+                 absl::FormatDuration(absl::Now() - apf_.last_receive()),
+                 apf_stats.keepalives_sent, apf_stats.keepalive_replies,
+                 apf_stats.liveness_failures, apf_stats.keepalive_requests);
+    absl::PrintF("Keepalive RTT: %s\n", apf_.keepalive_rtt().ToString());
+    absl::PrintF("Recovery time: %s\n", recovery_time_.ToString());
+    if (!prebound_.empty()) {
+      size_t held = 0;
+      for (const auto &[port, prebound] : prebound_) {
+        held += prebound.held.size();
+      }
+      absl::PrintF("Prebind: pending_ports=%u held=%u paused=%u\n", prebound_.size(),
+                   held, prebind_paused_);
+    }
+    if (const RateLimiter::Stats &limits = rate_limiter_.stats();
+        limits.accepted + limits.delayed + limits.rejected > 0) {
+      absl::PrintF("Rate limit: accepted=%u delayed=%u rejected=%u queued=%u peak=%u "
+                   "sources=%u\n",
+                   limits.accepted, limits.delayed, limits.rejected,
+                   rate_limiter_.queued(), limits.queued_peak, rate_limiter_.sources());
+      // Accept to the channel start of delayed connections.
+      absl::PrintF("Rate limit delay: %s\n", rate_limit_delay_.ToString());
+      for (const auto &[source, rejected] : rate_limiter_.TopRejected(5)) {
+        absl::PrintF("  source=%s rejected=%u\n", source, rejected);
+      }
+    }
+    // Time from client data to the next data from ME on the same channel.
+    absl::PrintF("ME response latency: %s\n", me_latency_.ToString());
+    if (!wsman_tap_ports_.empty()) {
+      absl::PrintF("WS-MAN latency:\n%s", wsman_profiler_.Dump());
+    }
+    if (!dedup_ports_.empty()) {
+      const SingleFlight::Stats &dedup = single_flight_.stats();
+      absl::PrintF("Dedup: flights=%u coalesced=%u fallbacks=%u oversized=%u\n",
+                   dedup.flights, dedup.coalesced, dedup.fallbacks, dedup.oversized);
+    }
+    const auto &pool = apf_.pool_stats();
+    absl::PrintF("Buffer pool: in_use=%u peak=%u idle=%u gets=%u allocs=%u\n",
+                 pool.in_use, pool.peak_in_use, pool.idle, pool.gets, pool.allocs);
+  }
+
+  struct HeldClient {
+    int fd;
+    std::string peer_ip;
+    uint32_t peer_port;
+  };
+  struct PrebindPort {
+    std::deque<HeldClient> held;
+    TimerWheel::TimerId release_timer;
+    // Not accepting, prebind_queue clients are held.
+    bool paused = false;
+  };
+  // Over the rate limit, started once its token refills.
+  struct DelayedClient {
+    HeldClient client;
+    uint32_t port;
+    std::string source;
+    absl::Time queued;
+    TimerWheel::TimerId timer;
+  };
+
   AmtPortForwarding apf_;
   std::unordered_set<uint32_t> allowed_ports_;
+  // Prebound ports not requested by ME yet.
+  std::unordered_map<uint32_t, PrebindPort> prebound_;
+  // Times a prebound port stopped accepting.
+  uint64_t prebind_paused_ = 0;
+  RateLimiter rate_limiter_;
+  // key is fd
+  std::unordered_map<int, DelayedClient> delayed_;
+  LatencyHistogram rate_limit_delay_;
+  // From --allowed_ports and --cork.
+  std::unordered_map<uint32_t, PortProfile> profiles_;
+  std::unordered_set<uint32_t> wsman_tap_ports_;
+  WsmanProfiler wsman_profiler_;
+  std::unordered_set<uint32_t> dedup_ports_;
+  SingleFlight single_flight_;
   // listen fd to listen port mapping
   std::unordered_map<int, uint32_t> listen_fd_port_;
   // key is channel id
@@ -295,7 +1780,39 @@ private:
   // map fd to channel id
   std::unordered_map<int, uint32_t> channel_fd_id_;
 
+  // 1ms is the granularity of epoll_wait() anyway.
+  TimerWheel timers_{absl::Milliseconds(1)};
+  uint32_t next_unix_peer_port_ = 49152;
+
+  absl::Duration spin_budget_;
+  absl::Duration spin_time_;
+  uint64_t spin_hits_ = 0;
+  uint64_t spin_misses_ = 0;
+  LatencyHistogram me_latency_;
+  uint64_t open_successes_ = 0;
+  uint64_t open_failures_ = 0;
+  uint64_t open_timeouts_ = 0;
+  LatencyHistogram open_latency_;
+  TimerWheel::TimerId pacing_timer_ = 0;
+  absl::Time pacing_deadline_;
+  TimerWheel::TimerId liveness_timer_ = 0;
+
   int epoll_fd_;
+  int signal_fd_;
+  // -1 while disconnected from ME.
+  int apf_fd_ = -1;
+  int control_fd_ = -1;
+  // Listeners were handed off, exit once channels_ is empty.
+  bool handed_off_ = false;
+  // Took over from an old apfd and not connected to ME yet.
+  bool taking_over_ = false;
+  uint32_t apf_events_ = EPOLLIN;
+
+  absl::Duration reconnect_backoff_;
+  uint64_t me_disconnects_ = 0;
+  absl::Time disconnected_since_ = absl::InfinitePast();
+  LatencyHistogram mei_reconnect_time_;
+  LatencyHistogram recovery_time_;
 };
 
 } // namespace
@@ -0,0 +1,136 @@
+#include "buffer_pool.h"
+#include "die.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace amt {
+
+//
+// BufferPool::Buffer
+//
+
+BufferPool::Buffer::Buffer(Buffer &&other) noexcept
+    : pool_(other.pool_), data_(other.data_) {
+  other.pool_ = nullptr;
+  other.data_ = nullptr;
+}
+
+BufferPool::Buffer &BufferPool::Buffer::operator=(Buffer &&other) noexcept {
+  if (this != &other) {
+    Release();
+    pool_ = other.pool_;
+    data_ = other.data_;
+    other.pool_ = nullptr;
+    other.data_ = nullptr;
+  }
+  return *this;
+}
+
+BufferPool::Buffer::~Buffer() { Release(); }
+
+void BufferPool::Buffer::Release() {
+  if (data_ != nullptr) {
+    pool_->Put(data_);
+    pool_ = nullptr;
+    data_ = nullptr;
+  }
+}
+
+//
+// BufferPool
+//
+
+BufferPool::BufferPool(size_t buffer_size, size_t max_idle)
+    : buffer_size_(buffer_size), max_idle_(max_idle) {
+  die_if(buffer_size == 0, "empty buffer size");
+}
+
+BufferPool::~BufferPool() {
+  die_if(stats_.in_use != 0, "%u buffers still in use", stats_.in_use);
+  for (uint8_t *data : free_) {
+    delete[] data;
+  }
+}
+
+BufferPool::Buffer BufferPool::Get() {
+  uint8_t *data;
+  if (free_.empty()) {
+    data = new uint8_t[buffer_size_];
+    stats_.allocs++;
+  } else {
+    data = free_.back();
+    free_.pop_back();
+  }
+  stats_.gets++;
+  stats_.in_use++;
+  stats_.peak_in_use = std::max(stats_.peak_in_use, stats_.in_use);
+  stats_.idle = free_.size();
+  return Buffer(this, data);
+}
+
+void BufferPool::Put(uint8_t *data) {
+  stats_.in_use--;
+  if (free_.size() < max_idle_) {
+    free_.push_back(data);
+  } else {
+    delete[] data;
+  }
+  stats_.idle = free_.size();
+}
+
+//
+// BufferQueue
+//
+
+void BufferQueue::Append(absl::Span<const uint8_t> data) {
+  while (!data.empty()) {
+    if (chunks_.empty() || chunks_.back().end == chunks_.back().buf.capacity()) {
+      chunks_.push_back(Chunk{pool_->Get(), 0, 0});
+    }
+    Chunk &tail = chunks_.back();
+    size_t len = std::min(data.size(), tail.buf.capacity() - tail.end);
+    memcpy(tail.buf.data() + tail.end, data.data(), len);
+    tail.end += len;
+    size_ += len;
+    data.remove_prefix(len);
+  }
+}
+
+absl::Span<const uint8_t> BufferQueue::Front() const {
+  if (chunks_.empty()) {
+    return {};
+  }
+  const Chunk &head = chunks_.front();
+  return absl::MakeConstSpan(head.buf.data() + head.begin, head.end - head.begin);
+}
+
+void BufferQueue::CopyTo(absl::Span<uint8_t> to) const {
+  die_if(to.size() > size_, "copying too many bytes");
+  for (auto it = chunks_.begin(); !to.empty(); ++it) {
+    size_t len = std::min(to.size(), it->end - it->begin);
+    memcpy(to.data(), it->buf.data() + it->begin, len);
+    to.remove_prefix(len);
+  }
+}
+
+void BufferQueue::Pop(size_t n) {
+  die_if(n > size_, "popping too many bytes");
+  size_ -= n;
+  while (n > 0) {
+    Chunk &head = chunks_.front();
+    size_t len = std::min(n, head.end - head.begin);
+    head.begin += len;
+    n -= len;
+    if (head.begin == head.end) {
+      chunks_.pop_front();
+    }
+  }
+}
+
+void BufferQueue::Clear() {
+  chunks_.clear();
+  size_ = 0;
+}
+
+} // namespace amt
@@ -0,0 +1,106 @@
+#ifndef __BUFFER_POOL_H__
+#define __BUFFER_POOL_H__
+
+#include <cinttypes>
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include <absl/types/span.h>
+
+namespace amt {
+
+// class BufferPool
+// Free list of fixed-size buffers, so that the per-message and per-channel
+// memory doesn't go through malloc on every message.
+// Buffers are returned to the pool when their handle is destroyed. At most
+// max_idle buffers are kept in the pool, the rest are freed.
+// Not thread-safe, the pool belongs to a single event loop.
+class BufferPool {
+public:
+  class Buffer {
+  public:
+    Buffer() = default;
+    Buffer(Buffer &&other) noexcept;
+    Buffer &operator=(Buffer &&other) noexcept;
+    Buffer(const Buffer &) = delete;
+    Buffer &operator=(const Buffer &) = delete;
+    ~Buffer();
+
+    uint8_t *data() const { return data_; }
+    size_t capacity() const { return pool_ == nullptr ? 0 : pool_->buffer_size_; }
+    absl::Span<uint8_t> span() const { return absl::MakeSpan(data_, capacity()); }
+    explicit operator bool() const { return data_ != nullptr; }
+
+  private:
+    friend class BufferPool;
+    Buffer(BufferPool *pool, uint8_t *data) : pool_(pool), data_(data) {}
+    void Release();
+
+    BufferPool *pool_ = nullptr;
+    uint8_t *data_ = nullptr;
+  };
+
+  BufferPool(size_t buffer_size, size_t max_idle);
+  ~BufferPool();
+  BufferPool(const BufferPool &) = delete;
+  BufferPool &operator=(const BufferPool &) = delete;
+
+  Buffer Get();
+  size_t buffer_size() const { return buffer_size_; }
+
+  struct Stats {
+    // Buffers handed out and not returned yet.
+    uint64_t in_use;
+    uint64_t peak_in_use;
+    // Buffers kept in the free list.
+    uint64_t idle;
+    uint64_t gets;
+    // Gets which had to allocate a new buffer.
+    uint64_t allocs;
+  };
+  const Stats &stats() const { return stats_; }
+
+private:
+  void Put(uint8_t *data);
+
+  size_t buffer_size_;
+  size_t max_idle_;
+  std::vector<uint8_t *> free_;
+  Stats stats_{};
+};
+
+// class BufferQueue
+// Byte FIFO backed by BufferPool buffers. Buffers are returned to the pool
+// as soon as they are consumed, so an idle queue holds no memory.
+class BufferQueue {
+public:
+  explicit BufferQueue(BufferPool *pool) : pool_(pool) {}
+
+  void Append(absl::Span<const uint8_t> data);
+  // First contiguous chunk of data, may be shorter than size().
+  absl::Span<const uint8_t> Front() const;
+  // Copy the first to.size() bytes without consuming them.
+  void CopyTo(absl::Span<uint8_t> to) const;
+  // Consume the first n bytes.
+  void Pop(size_t n);
+  void Clear();
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+private:
+  struct Chunk {
+    BufferPool::Buffer buf;
+    size_t begin;
+    size_t end;
+  };
+
+  BufferPool *pool_;
+  std::deque<Chunk> chunks_;
+  size_t size_ = 0;
+};
+
+} // namespace amt
+
+#endif // __BUFFER_POOL_H__
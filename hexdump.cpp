@@ -1,97 +1,261 @@
 #include "hexdump.h"
 
+#include <algorithm>
+#include <array>
 #include <cinttypes>
-#include <sstream>
+#include <cstring>
 #include <string>
 
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
 namespace {
 
-using std::string;
-const char *HEX = "0123456789ABCDEF";
-
-// clang-format off
-string to_hex_str(size_t number) {
-  char buf[9];
-  buf[8] = 0;
-  buf[7] = *(HEX+(number%16)); number /= 16;
-  buf[6] = *(HEX+(number%16)); number /= 16;
-  buf[5] = *(HEX+(number%16)); number /= 16;
-  buf[4] = *(HEX+(number%16)); number /= 16;
-  buf[3] = *(HEX+(number%16)); number /= 16;
-  buf[2] = *(HEX+(number%16)); number /= 16;
-  buf[1] = *(HEX+(number%16)); number /= 16;
-  buf[0] = *(HEX+(number%16));
-  return string(buf);
-}
-string to_hex_byte(uint8_t number) {
-  char buf[3];
-  buf[2] = 0;
-  buf[1] = *(HEX+(number%16)); number /= 16;
-  buf[0] = *(HEX+(number%16));
-  return string(buf);
-}
-// clang-format on
-
-void hexdump(const void *data_in, size_t len, std::ostream &printer,
-             bool print_header = true) {
-  const char *data = static_cast<const char *>(data_in);
-
-  if (len <= 0) {
-    printer << "hexdump: empty string" << std::endl;
-    return;
+// Bytes are encoded kBatch at a time, so the kernels run over several rows.
+constexpr size_t kBatch = 256;
+constexpr size_t kRowBytes = 16;
+
+constexpr char kEmpty[] = "hexdump: empty string\n";
+constexpr char kHeader[] =
+    "          +0 +1 +2 +3 +4 +5 +6 +7  +8 +9 +A +B +C +D +E +F\n";
+// A row without data, the offset, hex and ASCII columns are filled in.
+constexpr char kRowTemplate[] = "                                                  "
+                                "          |                |";
+constexpr size_t kRowSize = sizeof(kRowTemplate) - 1;
+constexpr size_t kHexColumn = 10;
+constexpr size_t kAsciiColumn = 61;
+static_assert(kRowSize == 78 && kRowTemplate[kAsciiColumn - 1] == '|');
+
+// Upper case digit pairs of every byte value.
+constexpr std::array<char, 512> kHexPairs = [] {
+  constexpr char kDigits[] = "0123456789ABCDEF";
+  std::array<char, 512> pairs{};
+  for (int i = 0; i < 256; i++) {
+    pairs[i * 2] = kDigits[i >> 4];
+    pairs[i * 2 + 1] = kDigits[i & 0xF];
   }
-  if (print_header) {
-    printer << "          +0 +1 +2 +3 +4 +5 +6 +7  +8 +9 +A +B +C +D +E +F" << std::endl;
+  return pairs;
+}();
+
+//
+// Kernels
+// hex: write 2 * n digits. ascii: graphic characters as is, '.' otherwise.
+//
+
+void HexScalar(const uint8_t *in, size_t n, char *out) {
+  for (size_t i = 0; i < n; i++) {
+    memcpy(out + i * 2, &kHexPairs[in[i] * 2], 2);
   }
+}
 
-  size_t pos = 0;
-  while (pos < len) {
-    size_t data_len = len - pos;
-    if (data_len > 16)
-      data_len = 16;
-    printer << to_hex_str(pos) << "  ";
-    for (size_t offset = 0; offset < 16; offset++) {
-      if (offset >= data_len) {
-        printer << "   ";
-      } else {
-        printer << to_hex_byte((uint8_t)data[pos + offset]) << ' ';
-      }
-      if (offset == 7)
-        printer << " ";
+void AsciiScalar(const uint8_t *in, size_t n, char *out) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] = in[i] > 0x20 && in[i] < 0x7F ? in[i] : '.';
+  }
+}
+
+#if defined(__SSE2__)
+
+// Nibbles to '0'-'9', 'A'-'F'.
+__m128i DigitsSse2(__m128i nibbles) {
+  __m128i letters = _mm_cmpgt_epi8(nibbles, _mm_set1_epi8(9));
+  __m128i digits = _mm_add_epi8(nibbles, _mm_set1_epi8('0'));
+  return _mm_add_epi8(digits, _mm_and_si128(letters, _mm_set1_epi8('A' - '0' - 10)));
+}
+
+void HexSse2(const uint8_t *in, size_t n, char *out) {
+  const __m128i low_nibble = _mm_set1_epi8(0x0F);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+    __m128i hi = DigitsSse2(_mm_and_si128(_mm_srli_epi16(bytes, 4), low_nibble));
+    __m128i lo = DigitsSse2(_mm_and_si128(bytes, low_nibble));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i * 2), _mm_unpacklo_epi8(hi, lo));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i * 2 + 16),
+                     _mm_unpackhi_epi8(hi, lo));
+  }
+  HexScalar(in + i, n - i, out + i * 2);
+}
+
+void AsciiSse2(const uint8_t *in, size_t n, char *out) {
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+    // Signed compares, bytes >= 0x80 are below 0x20.
+    __m128i graph = _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8(0x20)),
+                                  _mm_cmplt_epi8(bytes, _mm_set1_epi8(0x7F)));
+    __m128i ret = _mm_or_si128(_mm_and_si128(graph, bytes),
+                               _mm_andnot_si128(graph, _mm_set1_epi8('.')));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), ret);
+  }
+  AsciiScalar(in + i, n - i, out + i);
+}
+
+// Built without -mavx2, only called if the CPU supports it.
+#define HEXDUMP_AVX2 1
+
+__attribute__((target("avx2"))) __m256i DigitsAvx2(__m256i nibbles) {
+  __m256i letters = _mm256_cmpgt_epi8(nibbles, _mm256_set1_epi8(9));
+  __m256i digits = _mm256_add_epi8(nibbles, _mm256_set1_epi8('0'));
+  return _mm256_add_epi8(digits,
+                         _mm256_and_si256(letters, _mm256_set1_epi8('A' - '0' - 10)));
+}
+
+__attribute__((target("avx2"))) void HexAvx2(const uint8_t *in, size_t n, char *out) {
+  const __m256i low_nibble = _mm256_set1_epi8(0x0F);
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + i));
+    __m256i hi = DigitsAvx2(_mm256_and_si256(_mm256_srli_epi16(bytes, 4), low_nibble));
+    __m256i lo = DigitsAvx2(_mm256_and_si256(bytes, low_nibble));
+    // Unpacking is per 128 bit lane: bytes 0-7 and 16-23, 8-15 and 24-31.
+    __m256i a = _mm256_unpacklo_epi8(hi, lo);
+    __m256i b = _mm256_unpackhi_epi8(hi, lo);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i * 2),
+                        _mm256_permute2x128_si256(a, b, 0x20));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i * 2 + 32),
+                        _mm256_permute2x128_si256(a, b, 0x31));
+  }
+  HexSse2(in + i, n - i, out + i * 2);
+}
+
+__attribute__((target("avx2"))) void AsciiAvx2(const uint8_t *in, size_t n, char *out) {
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + i));
+    __m256i graph =
+        _mm256_and_si256(_mm256_cmpgt_epi8(bytes, _mm256_set1_epi8(0x20)),
+                         _mm256_cmpgt_epi8(_mm256_set1_epi8(0x7F), bytes));
+    __m256i ret = _mm256_blendv_epi8(_mm256_set1_epi8('.'), bytes, graph);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), ret);
+  }
+  AsciiSse2(in + i, n - i, out + i);
+}
+
+#endif // __SSE2__
+
+struct Kernel {
+  const char *name;
+  void (*hex)(const uint8_t *in, size_t n, char *out);
+  void (*ascii)(const uint8_t *in, size_t n, char *out);
+};
+
+constexpr Kernel kScalar = {"scalar", HexScalar, AsciiScalar};
+#if defined(__SSE2__)
+constexpr Kernel kSse2 = {"sse2", HexSse2, AsciiSse2};
+#endif
+#if defined(HEXDUMP_AVX2)
+constexpr Kernel kAvx2 = {"avx2", HexAvx2, AsciiAvx2};
+#endif
+
+bool Supported(const Kernel &kernel) {
+#if defined(HEXDUMP_AVX2)
+  if (&kernel == &kAvx2) {
+    // May run before libgcc's own initialization.
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+  }
+#endif
+  return true;
+}
+
+// Fastest first.
+constexpr const Kernel *kKernels[] = {
+#if defined(HEXDUMP_AVX2)
+    &kAvx2,
+#endif
+#if defined(__SSE2__)
+    &kSse2,
+#endif
+    &kScalar,
+};
+
+const Kernel *BestKernel() {
+  for (const Kernel *kernel : kKernels) {
+    if (Supported(*kernel)) {
+      return kernel;
     }
-    printer << " |";
-    for (size_t offset = 0; offset < 16; offset++) {
-      if (offset >= data_len) {
-        printer << " ";
-      } else {
-        char ch = data[pos + offset];
-        if (isgraph(ch)) {
-          printer << ch;
-        } else {
-          printer << ".";
-        }
+  }
+  return &kScalar;
+}
+
+const Kernel *active_kernel = BestKernel();
+
+// Format the row at offset, hex holds 2 * len digits.
+char *FormatRow(size_t offset, const char *hex, const char *ascii, size_t len,
+                char *out) {
+  memcpy(out, kRowTemplate, kRowSize);
+  // Low 32 bits, big endian.
+  const uint8_t be[4] = {static_cast<uint8_t>(offset >> 24),
+                         static_cast<uint8_t>(offset >> 16),
+                         static_cast<uint8_t>(offset >> 8), static_cast<uint8_t>(offset)};
+  HexScalar(be, 4, out);
+  for (size_t i = 0; i < len; i++) {
+    // An extra space after +7.
+    memcpy(out + kHexColumn + i * 3 + (i >= 8), hex + i * 2, 2);
+  }
+  memcpy(out + kAsciiColumn, ascii, len);
+  return out + kRowSize;
+}
+
+} // namespace
+
+size_t HexdumpSize(size_t len) {
+  if (len == 0) {
+    return sizeof(kEmpty) - 1;
+  }
+  // Rows are separated by newlines.
+  size_t rows = (len + kRowBytes - 1) / kRowBytes;
+  return sizeof(kHeader) - 1 + rows * (kRowSize + 1) - 1;
+}
+
+size_t HexdumpTo(const void *data, size_t len, char *out) {
+  if (len == 0) {
+    memcpy(out, kEmpty, sizeof(kEmpty) - 1);
+    return sizeof(kEmpty) - 1;
+  }
+  const uint8_t *in = static_cast<const uint8_t *>(data);
+  char *p = out;
+  memcpy(p, kHeader, sizeof(kHeader) - 1);
+  p += sizeof(kHeader) - 1;
+
+  char hex[kBatch * 2];
+  char ascii[kBatch];
+  for (size_t pos = 0; pos < len; pos += kBatch) {
+    size_t n = std::min(kBatch, len - pos);
+    active_kernel->hex(in + pos, n, hex);
+    active_kernel->ascii(in + pos, n, ascii);
+    for (size_t row = 0; row < n; row += kRowBytes) {
+      p = FormatRow(pos + row, hex + row * 2, ascii + row, std::min(kRowBytes, n - row),
+                    p);
+      if (pos + row + kRowBytes < len) {
+        *p++ = '\n';
       }
     }
-    printer << "|";
-    pos += 16;
-    if (pos < len)
-      printer << std::endl;
   }
+  return p - out;
 }
 
-} // namespace
+void HexdumpAppend(const void *data, size_t len, std::string &out) {
+  size_t size = out.size();
+  out.resize(size + HexdumpSize(len));
+  HexdumpTo(data, len, out.data() + size);
+}
+
+std::string Hexdump(const void *data, size_t len) {
+  std::string ret;
+  HexdumpAppend(data, len, ret);
+  return ret;
+}
 
-string Hexdump(const void *data, size_t len) {
-  std::stringstream ss;
-  hexdump(data, len, ss, true);
-  return ss.str();
+void HexStringTo(const void *data, size_t size, char *out) {
+  active_kernel->hex(static_cast<const uint8_t *>(data), size, out);
 }
 
 std::string HexString(const void *data, size_t size) {
-  std::string ret;
-  for (size_t i = 0; i < size; i++) {
-    ret += to_hex_byte(static_cast<const uint8_t *>(data)[i]);
-  }
+  std::string ret(size * 2, '\0');
+  HexStringTo(data, size, ret.data());
   return ret;
 }
 
@@ -99,12 +263,24 @@ std::string HexUuid(const void *data, size_t size) {
   if (size != 16) {
     return "invalid uuid " + HexString(data, size);
   }
-  std::string ret;
-  const char *ptr = static_cast<const char *>(data);
-  ret += HexString(ptr, 4) + "-";
-  ret += HexString(ptr + 4, 2) + "-";
-  ret += HexString(ptr + 6, 2) + "-";
-  ret += HexString(ptr + 8, 2) + "-";
-  ret += HexString(ptr + 10, 6);
+  const uint8_t *in = static_cast<const uint8_t *>(data);
+  std::string ret(36, '-');
+  HexScalar(in, 4, &ret[0]);
+  HexScalar(in + 4, 2, &ret[9]);
+  HexScalar(in + 6, 2, &ret[14]);
+  HexScalar(in + 8, 2, &ret[19]);
+  HexScalar(in + 10, 6, &ret[24]);
   return ret;
 }
+
+const char *HexKernel() { return active_kernel->name; }
+
+bool SetHexKernel(const std::string &name) {
+  for (const Kernel *kernel : kKernels) {
+    if (name == kernel->name && Supported(*kernel)) {
+      active_kernel = kernel;
+      return true;
+    }
+  }
+  return false;
+}
@@ -8,12 +8,28 @@
 //           +0 +1 +2 +3 +4 +5 +6 +7  +8 +9 +A +B +C  D  E  F
 // 00000000  00 01 02 03 04 05 06 07  08 09 0A 0B 0C 0D 0E 0F  |0123456789ABCDEF|
 std::string Hexdump(const void *data, size_t len);
+// Size of the Hexdump() output, without a terminating NUL.
+size_t HexdumpSize(size_t len);
+// Write the Hexdump() output to out, which must hold HexdumpSize(len)
+// bytes. Returns the bytes written.
+size_t HexdumpTo(const void *data, size_t len, char *out);
+// Append the Hexdump() output, e.g. to a reused trace buffer.
+void HexdumpAppend(const void *data, size_t len, std::string &out);
 
-// 0102030a0b0f
+// 0102030A0B0F
 std::string HexString(const void *data, size_t size);
+// Write 2 * size hex digits to out.
+void HexStringTo(const void *data, size_t size, char *out);
 
 // 00000000-0000-0000-0000-000000000000
 // size must be 16
 std::string HexUuid(const void *data, size_t size);
 
+// The encoding runs on SIMD kernels picked for the CPU at startup:
+// "avx2", "sse2" or "scalar".
+const char *HexKernel();
+// Use another kernel, e.g. to benchmark. Returns false if it's unknown or
+// not supported by the CPU. Not thread safe.
+bool SetHexKernel(const std::string &name);
+
 #endif // __HEXDUMP_H__
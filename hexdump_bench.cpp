@@ -0,0 +1,102 @@
+#include "die.h"
+#include "hexdump.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <absl/flags/flag.h>
+#include <absl/flags/parse.h>
+#include <absl/flags/usage.h>
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_format.h>
+#include <absl/time/clock.h>
+#include <absl/time/time.h>
+
+ABSL_FLAG(std::vector<std::string>, sizes,
+          (std::vector<std::string>{"16", "256", "4096", "65536"}),
+          "Input sizes in bytes");
+ABSL_FLAG(std::vector<std::string>, kernels,
+          (std::vector<std::string>{"scalar", "sse2", "avx2"}),
+          "Kernels to compare, the ones the CPU doesn't support are skipped");
+ABSL_FLAG(absl::Duration, min_time, absl::Milliseconds(200), "Run each case this long");
+
+namespace amt {
+namespace {
+
+// Runs fn until min_time has passed, returns the time per call.
+template <typename Fn> absl::Duration Measure(Fn fn) {
+  absl::Duration min_time = absl::GetFlag(FLAGS_min_time);
+  uint64_t calls = 0;
+  absl::Time start = absl::Now();
+  absl::Duration elapsed;
+  do {
+    for (int i = 0; i < 16; i++) {
+      fn();
+    }
+    calls += 16;
+    elapsed = absl::Now() - start;
+  } while (elapsed < min_time);
+  return elapsed / calls;
+}
+
+void Report(const std::string &kernel, const char *op, size_t size, absl::Duration t) {
+  absl::PrintF("%-7s %-13s %6u bytes %12s/call %9.1f MB/s\n", kernel, op, size,
+               absl::FormatDuration(t), size / absl::ToDoubleMicroseconds(t));
+}
+
+int Run() {
+  std::vector<size_t> sizes;
+  for (const std::string &s : absl::GetFlag(FLAGS_sizes)) {
+    size_t size;
+    die_if(!absl::SimpleAtoi(s, &size), "invalid size %s", s.c_str());
+    sizes.push_back(size);
+  }
+  // Frames are mostly printable with some binary headers.
+  std::vector<uint8_t> data(*std::max_element(sizes.begin(), sizes.end()));
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = i % 7 == 0 ? i * 131 : 'a' + i % 26;
+  }
+
+  absl::PrintF("Default kernel: %s\n", HexKernel());
+  std::string default_kernel = HexKernel();
+  die_if(!SetHexKernel("scalar"), "no scalar kernel");
+  std::vector<std::string> expected;
+  for (size_t size : sizes) {
+    expected.push_back(Hexdump(data.data(), size));
+  }
+
+  for (const std::string &kernel : absl::GetFlag(FLAGS_kernels)) {
+    if (!SetHexKernel(kernel)) {
+      absl::PrintF("%s: not supported\n", kernel);
+      continue;
+    }
+    std::string sink;
+    for (size_t i = 0; i < sizes.size(); i++) {
+      size_t size = sizes[i];
+      die_if(Hexdump(data.data(), size) != expected[i], "%s: output differs, size=%u",
+             kernel.c_str(), size);
+      Report(kernel, "Hexdump", size, Measure([&] { (void)Hexdump(data.data(), size); }));
+      // A reused trace buffer, no allocation.
+      sink.reserve(HexdumpSize(size));
+      Report(kernel, "HexdumpAppend", size, Measure([&] {
+               sink.clear();
+               HexdumpAppend(data.data(), size, sink);
+             }));
+      std::vector<char> out(size * 2);
+      Report(kernel, "HexStringTo", size,
+             Measure([&] { HexStringTo(data.data(), size, out.data()); }));
+    }
+  }
+  SetHexKernel(default_kernel);
+  return 0;
+}
+
+} // namespace
+} // namespace amt
+
+int main(int argc, char *argv[]) {
+  absl::SetProgramUsageMessage("Benchmark the hexdump kernels");
+  absl::ParseCommandLine(argc, argv);
+  return amt::Run();
+}
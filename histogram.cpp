@@ -0,0 +1,78 @@
+#include "histogram.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <absl/strings/str_format.h>
+
+namespace amt {
+
+int LatencyHistogram::BucketOf(uint64_t us) {
+  if (us < kSubBuckets) {
+    return us;
+  }
+  int exp = 63 - __builtin_clzll(us);
+  int sub = (us >> (exp - kSubBits)) & (kSubBuckets - 1);
+  return kSubBuckets + (exp - kSubBits) * kSubBuckets + sub;
+}
+
+uint64_t LatencyHistogram::UpperBound(int bucket) {
+  if (bucket < kSubBuckets) {
+    return bucket;
+  }
+  int exp = (bucket - kSubBuckets) / kSubBuckets + kSubBits;
+  uint64_t sub = (bucket - kSubBuckets) % kSubBuckets;
+  uint64_t lower = (uint64_t{1} << exp) + (sub << (exp - kSubBits));
+  return lower + (uint64_t{1} << (exp - kSubBits)) - 1;
+}
+
+void LatencyHistogram::Add(absl::Duration d) {
+  uint64_t us = std::max<int64_t>(absl::ToInt64Microseconds(d), 0);
+  buckets_[BucketOf(us)]++;
+  count_++;
+  sum_us_ += us;
+  max_us_ = std::max(max_us_, us);
+}
+
+void LatencyHistogram::Merge(const LatencyHistogram &other) {
+  for (int i = 0; i < kBuckets; i++) {
+    buckets_[i] += other.buckets_[i];
+  }
+  count_ += other.count_;
+  sum_us_ += other.sum_us_;
+  max_us_ = std::max(max_us_, other.max_us_);
+}
+
+absl::Duration LatencyHistogram::mean() const {
+  if (count_ == 0) {
+    return absl::ZeroDuration();
+  }
+  return absl::Microseconds(sum_us_ / count_);
+}
+
+absl::Duration LatencyHistogram::Percentile(double p) const {
+  if (count_ == 0) {
+    return absl::ZeroDuration();
+  }
+  uint64_t rank = std::max<uint64_t>(std::ceil(count_ * p / 100), 1);
+  uint64_t seen = 0;
+  for (int i = 0; i < kBuckets; i++) {
+    seen += buckets_[i];
+    if (seen >= rank) {
+      return absl::Microseconds(std::min(UpperBound(i), max_us_));
+    }
+  }
+  return max();
+}
+
+std::string LatencyHistogram::ToString() const {
+  return absl::StrFormat("count=%u mean=%s p50=%s p90=%s p99=%s p99.9=%s max=%s", count_,
+                         absl::FormatDuration(mean()),
+                         absl::FormatDuration(Percentile(50)),
+                         absl::FormatDuration(Percentile(90)),
+                         absl::FormatDuration(Percentile(99)),
+                         absl::FormatDuration(Percentile(99.9)),
+                         absl::FormatDuration(max()));
+}
+
+} // namespace amt
@@ -0,0 +1,48 @@
+#ifndef __HISTOGRAM_H__
+#define __HISTOGRAM_H__
+
+#include <array>
+#include <cinttypes>
+#include <string>
+
+#include <absl/time/time.h>
+
+namespace amt {
+
+// class LatencyHistogram
+// Log-linear histogram of durations in microseconds: every power of two
+// is split into 8 buckets, so percentiles are accurate to 12.5%.
+// Add() is O(1) and the histogram is fixed size.
+class LatencyHistogram {
+public:
+  void Add(absl::Duration d);
+  void Merge(const LatencyHistogram &other);
+  void Clear() { *this = LatencyHistogram(); }
+
+  uint64_t count() const { return count_; }
+  absl::Duration max() const { return absl::Microseconds(max_us_); }
+  absl::Duration mean() const;
+  // p in [0, 100]. Returns the upper bound of the bucket holding the
+  // percentile, 0 if empty.
+  absl::Duration Percentile(double p) const;
+
+  // "count=N mean=... p50=... p90=... p99=... p99.9=... max=..."
+  std::string ToString() const;
+
+private:
+  static constexpr int kSubBits = 3;
+  static constexpr int kSubBuckets = 1 << kSubBits;
+  static constexpr int kBuckets = kSubBuckets + (64 - kSubBits) * kSubBuckets;
+
+  static int BucketOf(uint64_t us);
+  static uint64_t UpperBound(int bucket);
+
+  std::array<uint64_t, kBuckets> buckets_{};
+  uint64_t count_ = 0;
+  uint64_t sum_us_ = 0;
+  uint64_t max_us_ = 0;
+};
+
+} // namespace amt
+
+#endif // __HISTOGRAM_H__
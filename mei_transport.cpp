@@ -0,0 +1,401 @@
+#include "mei_transport.h"
+#include "die.h"
+
+#include <endian.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <absl/strings/str_format.h>
+#include <absl/time/clock.h>
+
+namespace amt {
+namespace {
+
+constexpr char kTraceMagic[8] = {'M', 'E', 'I', 'T', 'R', 'A', 'C', 'E'};
+constexpr uint32_t kTraceVersion = 1;
+// kind, time, len
+constexpr size_t kRecordHeaderSize = 1 + 8 + 4;
+// uuid, max_msg_length, protocol_version
+constexpr size_t kConnectPayloadSize = 16 + 4 + 1;
+// Max wait for the handshake reply of a simulated ME.
+constexpr int kHandshakeTimeoutMs = 1000;
+
+void PutLe32(uint8_t *to, uint32_t v) {
+  v = htole32(v);
+  memcpy(to, &v, 4);
+}
+
+void PutLe64(uint8_t *to, uint64_t v) {
+  v = htole64(v);
+  memcpy(to, &v, 8);
+}
+
+uint32_t GetLe32(const uint8_t *from) {
+  uint32_t v;
+  memcpy(&v, from, 4);
+  return le32toh(v);
+}
+
+uint64_t GetLe64(const uint8_t *from) {
+  uint64_t v;
+  memcpy(&v, from, 8);
+  return le64toh(v);
+}
+
+} // namespace
+
+//
+// MeiDevice
+//
+
+bool MeiDevice::Connect(const uuid_le &client, MeiClientProperties &props) {
+  die_if(fd_ >= 0, "already connected");
+  int fd = open(path_.c_str(), O_RDWR | O_NONBLOCK);
+  if (fd < 0) {
+    absl::PrintF("Failed to open %s errno=%d\n", path_, errno);
+    return false;
+  }
+
+  mei_connect_client_data data;
+  data.in_client_uuid = client;
+  int ret = ioctl(fd, IOCTL_MEI_CONNECT_CLIENT, &data);
+  if (ret < 0) {
+    absl::PrintF("Failed to connect MEI client errno=%d\n", errno);
+    close(fd);
+    return false;
+  }
+
+  props.max_msg_length = data.out_client_properties.max_msg_length;
+  props.protocol_version = data.out_client_properties.protocol_version;
+  fd_ = fd;
+  return true;
+}
+
+void MeiDevice::Close() {
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+}
+
+ssize_t MeiDevice::Read(absl::Span<uint8_t> buf) {
+  return read(fd_, buf.data(), buf.size());
+}
+
+ssize_t MeiDevice::Write(absl::Span<const uint8_t> data) {
+  return write(fd_, data.data(), data.size());
+}
+
+//
+// MeiLoopback
+//
+
+bool MeiLoopback::Connect(const uuid_le &client, MeiClientProperties &props) {
+  die_if(fd_ >= 0, "already connected");
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0, fds) == -1) {
+    absl::PrintF("socketpair failed errno=%d\n", errno);
+    return false;
+  }
+  fd_ = fds[0];
+  props = props_;
+  on_connect_(fds[1]);
+  return true;
+}
+
+void MeiLoopback::Close() {
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+}
+
+ssize_t MeiLoopback::Read(absl::Span<uint8_t> buf) {
+  return recv(fd_, buf.data(), buf.size(), 0);
+}
+
+ssize_t MeiLoopback::Write(absl::Span<const uint8_t> data) {
+  if (data.size() > props_.max_msg_length) {
+    // Like the MEI driver.
+    errno = EFBIG;
+    return -1;
+  }
+  return send(fd_, data.data(), data.size(), MSG_NOSIGNAL);
+}
+
+//
+// MeiUnixSocket
+//
+
+bool MeiUnixSocket::Connect(const uuid_le &client, MeiClientProperties &props) {
+  die_if(fd_ >= 0, "already connected");
+  sockaddr_un sa{};
+  sa.sun_family = AF_UNIX;
+  die_if(path_.size() >= sizeof(sa.sun_path), "path too long: %s", path_.c_str());
+  memcpy(sa.sun_path, path_.data(), path_.size());
+
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  die_if(fd < 0, "socket errno=%d", errno);
+  if (connect(fd, reinterpret_cast<sockaddr *>(&sa), sizeof(sa)) == -1) {
+    absl::PrintF("Failed to connect %s errno=%d\n", path_, errno);
+    close(fd);
+    return false;
+  }
+  if (send(fd, client.b, 16, MSG_NOSIGNAL) != 16) {
+    absl::PrintF("Handshake send failed errno=%d\n", errno);
+    close(fd);
+    return false;
+  }
+  pollfd pfd{.fd = fd, .events = POLLIN, .revents = 0};
+  uint8_t reply[kHandshakeSize];
+  if (poll(&pfd, 1, kHandshakeTimeoutMs) != 1 ||
+      recv(fd, reply, sizeof(reply), 0) != sizeof(reply)) {
+    absl::PrintF("No handshake reply from %s errno=%d\n", path_, errno);
+    close(fd);
+    return false;
+  }
+  props.max_msg_length = GetLe32(reply);
+  props.protocol_version = reply[4];
+  fd_ = fd;
+  return true;
+}
+
+void MeiUnixSocket::Close() {
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+}
+
+ssize_t MeiUnixSocket::Read(absl::Span<uint8_t> buf) {
+  return recv(fd_, buf.data(), buf.size(), 0);
+}
+
+ssize_t MeiUnixSocket::Write(absl::Span<const uint8_t> data) {
+  return send(fd_, data.data(), data.size(), MSG_NOSIGNAL);
+}
+
+//
+// MeiRecorder
+//
+
+MeiRecorder::MeiRecorder(std::unique_ptr<MeiTransport> inner,
+                         const std::string &trace_path)
+    : inner_(std::move(inner)), start_(absl::Now()) {
+  trace_ = fopen(trace_path.c_str(), "wb");
+  die_if(trace_ == nullptr, "can't open %s errno=%d", trace_path.c_str(), errno);
+  uint8_t version[4];
+  PutLe32(version, kTraceVersion);
+  fwrite(kTraceMagic, sizeof(kTraceMagic), 1, trace_);
+  fwrite(version, sizeof(version), 1, trace_);
+}
+
+MeiRecorder::~MeiRecorder() {
+  Close();
+  fclose(trace_);
+}
+
+void MeiRecorder::Append(MeiTraceRecord kind, absl::Span<const uint8_t> payload) {
+  uint8_t header[kRecordHeaderSize];
+  header[0] = static_cast<uint8_t>(kind);
+  PutLe64(header + 1, absl::ToInt64Microseconds(absl::Now() - start_));
+  PutLe32(header + 9, payload.size());
+  fwrite(header, sizeof(header), 1, trace_);
+  fwrite(payload.data(), payload.size(), 1, trace_);
+}
+
+bool MeiRecorder::Connect(const uuid_le &client, MeiClientProperties &props) {
+  if (!inner_->Connect(client, props)) {
+    return false;
+  }
+  uint8_t payload[kConnectPayloadSize];
+  memcpy(payload, client.b, 16);
+  PutLe32(payload + 16, props.max_msg_length);
+  payload[20] = props.protocol_version;
+  Append(MeiTraceRecord::kConnect, absl::MakeConstSpan(payload));
+  connected_ = true;
+  return true;
+}
+
+void MeiRecorder::Close() {
+  if (connected_) {
+    Append(MeiTraceRecord::kDisconnect, {});
+    connected_ = false;
+  }
+  fflush(trace_);
+  inner_->Close();
+}
+
+ssize_t MeiRecorder::Read(absl::Span<uint8_t> buf) {
+  ssize_t r = inner_->Read(buf);
+  int err = errno;
+  if (r > 0) {
+    Append(MeiTraceRecord::kRead, buf.subspan(0, r));
+  } else if (r < 0 && err == EAGAIN) {
+    // Flush whenever the ME goes idle, so a killed process leaves a
+    // mostly complete trace without a write per message.
+    fflush(trace_);
+  } else if (connected_) {
+    Append(MeiTraceRecord::kDisconnect, {});
+    connected_ = false;
+  }
+  errno = err;
+  return r;
+}
+
+ssize_t MeiRecorder::Write(absl::Span<const uint8_t> data) {
+  ssize_t w = inner_->Write(data);
+  if (w > 0) {
+    int err = errno;
+    Append(MeiTraceRecord::kWrite, data.subspan(0, w));
+    errno = err;
+  }
+  return w;
+}
+
+//
+// MeiReplayer
+//
+
+MeiReplayer::MeiReplayer(const std::string &trace_path, double speed) : speed_(speed) {
+  FILE *f = fopen(trace_path.c_str(), "rb");
+  die_if(f == nullptr, "can't open %s errno=%d", trace_path.c_str(), errno);
+  std::string trace;
+  char chunk[65536];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+    trace.append(chunk, n);
+  }
+  fclose(f);
+
+  auto data = absl::MakeConstSpan(reinterpret_cast<const uint8_t *>(trace.data()),
+                                  trace.size());
+  die_if(data.size() < sizeof(kTraceMagic) + 4 ||
+             memcmp(data.data(), kTraceMagic, sizeof(kTraceMagic)) != 0,
+         "%s is not a MEI trace", trace_path.c_str());
+  uint32_t version = GetLe32(data.data() + sizeof(kTraceMagic));
+  die_if(version != kTraceVersion, "unsupported trace version %u", version);
+  data.remove_prefix(sizeof(kTraceMagic) + 4);
+
+  while (!data.empty()) {
+    die_if(data.size() < kRecordHeaderSize, "truncated trace");
+    Record record;
+    record.kind = static_cast<MeiTraceRecord>(data[0]);
+    record.time = absl::Microseconds(GetLe64(data.data() + 1));
+    uint32_t len = GetLe32(data.data() + 9);
+    data.remove_prefix(kRecordHeaderSize);
+    die_if(data.size() < len, "truncated trace");
+    record.payload.assign(reinterpret_cast<const char *>(data.data()), len);
+    data.remove_prefix(len);
+    die_if(record.kind == MeiTraceRecord::kConnect && len != kConnectPayloadSize,
+           "bad connect record");
+    records_.push_back(std::move(record));
+  }
+
+  timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  die_if(timer_fd_ < 0, "timerfd_create errno=%d", errno);
+}
+
+MeiReplayer::~MeiReplayer() { close(timer_fd_); }
+
+absl::Time MeiReplayer::DueTime(const Record &record) const {
+  if (speed_ <= 0) {
+    return absl::InfinitePast();
+  }
+  return replay_base_ + (record.time - trace_base_) / speed_;
+}
+
+void MeiReplayer::ArmTimer() {
+  while (next_ < records_.size() && records_[next_].kind == MeiTraceRecord::kWrite) {
+    recorded_writes_++;
+    next_++;
+  }
+  // The end of the connection is reported right away.
+  absl::Duration wait = absl::ZeroDuration();
+  if (next_ < records_.size() && records_[next_].kind == MeiTraceRecord::kRead) {
+    wait = DueTime(records_[next_]) - absl::Now();
+  }
+  itimerspec spec{};
+  spec.it_value = absl::ToTimespec(std::max(wait, absl::Nanoseconds(1)));
+  int err = timerfd_settime(timer_fd_, 0, &spec, nullptr);
+  die_if(err == -1, "timerfd_settime errno=%d", errno);
+}
+
+bool MeiReplayer::Connect(const uuid_le &client, MeiClientProperties &props) {
+  die_if(connected_, "already connected");
+  for (; next_ < records_.size(); next_++) {
+    const Record &record = records_[next_];
+    if (record.kind == MeiTraceRecord::kConnect &&
+        memcmp(record.payload.data(), client.b, 16) == 0) {
+      break;
+    }
+  }
+  if (next_ == records_.size()) {
+    absl::PrintF("MEI trace exhausted\n");
+    return false;
+  }
+
+  const Record &record = records_[next_++];
+  const uint8_t *payload = reinterpret_cast<const uint8_t *>(record.payload.data());
+  props.max_msg_length = GetLe32(payload + 16);
+  props.protocol_version = payload[20];
+  trace_base_ = record.time;
+  replay_base_ = absl::Now();
+  connected_ = true;
+  ArmTimer();
+  return true;
+}
+
+void MeiReplayer::Close() {
+  connected_ = false;
+  itimerspec spec{};
+  timerfd_settime(timer_fd_, 0, &spec, nullptr);
+}
+
+ssize_t MeiReplayer::Read(absl::Span<uint8_t> buf) {
+  if (!connected_) {
+    errno = ENODEV;
+    return -1;
+  }
+  uint64_t expirations;
+  (void)read(timer_fd_, &expirations, sizeof(expirations));
+
+  ArmTimer();
+  if (next_ == records_.size() || records_[next_].kind != MeiTraceRecord::kRead) {
+    // Lost here when recording, or the recording ended.
+    if (next_ < records_.size() && records_[next_].kind == MeiTraceRecord::kDisconnect) {
+      next_++;
+    }
+    return 0;
+  }
+  const Record &record = records_[next_];
+  if (DueTime(record) > absl::Now()) {
+    errno = EAGAIN;
+    return -1;
+  }
+  size_t len = std::min(buf.size(), record.payload.size());
+  memcpy(buf.data(), record.payload.data(), len);
+  next_++;
+  ArmTimer();
+  return len;
+}
+
+ssize_t MeiReplayer::Write(absl::Span<const uint8_t> data) {
+  if (!connected_) {
+    errno = ENODEV;
+    return -1;
+  }
+  writes_++;
+  return data.size();
+}
+
+} // namespace amt
@@ -0,0 +1,196 @@
+#ifndef __MEI_TRANSPORT_H__
+#define __MEI_TRANSPORT_H__
+
+#include <cinttypes>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <absl/time/time.h>
+#include <absl/types/span.h>
+#include <linux/mei.h>
+
+namespace amt {
+
+struct MeiClientProperties {
+  uint32_t max_msg_length;
+  uint8_t protocol_version;
+};
+
+// class MeiTransport
+// Message oriented, non-blocking connection to an ME client.
+// Read() and Write() follow read(2) / write(2) on the MEI chardev:
+//   - one Read() returns exactly one message, one Write() sends one
+//     message as a whole.
+//   - -1 with errno EAGAIN if they would block.
+//   - 0 or -1 with any other errno if the connection is lost.
+// fd() can be polled for EPOLLIN / EPOLLOUT while connected.
+class MeiTransport {
+public:
+  virtual ~MeiTransport() = default;
+
+  // Returns false on failure, it can be retried.
+  virtual bool Connect(const uuid_le &client, MeiClientProperties &props) = 0;
+  // Can be called when not connected.
+  virtual void Close() = 0;
+  virtual ssize_t Read(absl::Span<uint8_t> buf) = 0;
+  virtual ssize_t Write(absl::Span<const uint8_t> data) = 0;
+  // -1 when not connected.
+  virtual int fd() const = 0;
+};
+
+// class MeiDevice
+// The MEI chardev, e.g. /dev/mei0.
+class MeiDevice : public MeiTransport {
+public:
+  explicit MeiDevice(std::string path) : path_(std::move(path)) {}
+  ~MeiDevice() override { Close(); }
+
+  bool Connect(const uuid_le &client, MeiClientProperties &props) override;
+  void Close() override;
+  ssize_t Read(absl::Span<uint8_t> buf) override;
+  ssize_t Write(absl::Span<const uint8_t> data) override;
+  int fd() const override { return fd_; }
+
+private:
+  std::string path_;
+  int fd_ = -1;
+};
+
+// class MeiLoopback
+// In-memory transport over a SOCK_SEQPACKET socketpair, for simulating
+// the ME in the same process. Every Connect() creates a new pair and
+// passes the ME end to on_connect, which owns it from then on. The ME
+// side closing its end is seen as a lost connection.
+class MeiLoopback : public MeiTransport {
+public:
+  MeiLoopback(MeiClientProperties props, std::function<void(int me_fd)> on_connect)
+      : props_(props), on_connect_(std::move(on_connect)) {}
+  ~MeiLoopback() override { Close(); }
+
+  bool Connect(const uuid_le &client, MeiClientProperties &props) override;
+  void Close() override;
+  ssize_t Read(absl::Span<uint8_t> buf) override;
+  ssize_t Write(absl::Span<const uint8_t> data) override;
+  int fd() const override { return fd_; }
+
+private:
+  MeiClientProperties props_;
+  std::function<void(int)> on_connect_;
+  int fd_ = -1;
+};
+
+// class MeiUnixSocket
+// Connects to a simulated ME listening on a SOCK_SEQPACKET unix socket,
+// e.g. apf_loadgen --simulate_me. After connecting, the host sends the
+// 16 byte client uuid and the ME replies kHandshakeSize bytes: u32
+// max_msg_length (little-endian) and u8 protocol_version.
+class MeiUnixSocket : public MeiTransport {
+public:
+  static constexpr size_t kHandshakeSize = 5;
+
+  explicit MeiUnixSocket(std::string path) : path_(std::move(path)) {}
+  ~MeiUnixSocket() override { Close(); }
+
+  bool Connect(const uuid_le &client, MeiClientProperties &props) override;
+  void Close() override;
+  ssize_t Read(absl::Span<uint8_t> buf) override;
+  ssize_t Write(absl::Span<const uint8_t> data) override;
+  int fd() const override { return fd_; }
+
+private:
+  std::string path_;
+  int fd_ = -1;
+};
+
+// MEI trace format, all integers little-endian:
+//   "MEITRACE" u32 version
+//   records: u8 kind, u64 microseconds since the trace started, u32 len,
+//            len bytes of payload.
+// A kConnect payload is the client uuid (16 bytes), u32 max_msg_length
+// and u8 protocol_version. kDisconnect has no payload.
+enum class MeiTraceRecord : uint8_t {
+  kConnect = 0,
+  // Message from the ME.
+  kRead = 1,
+  // Message to the ME.
+  kWrite = 2,
+  kDisconnect = 3,
+};
+
+// class MeiRecorder
+// Passes everything through to another transport and appends the
+// messages to a trace file.
+class MeiRecorder : public MeiTransport {
+public:
+  MeiRecorder(std::unique_ptr<MeiTransport> inner, const std::string &trace_path);
+  ~MeiRecorder() override;
+
+  bool Connect(const uuid_le &client, MeiClientProperties &props) override;
+  void Close() override;
+  ssize_t Read(absl::Span<uint8_t> buf) override;
+  ssize_t Write(absl::Span<const uint8_t> data) override;
+  int fd() const override { return inner_->fd(); }
+
+private:
+  void Append(MeiTraceRecord kind, absl::Span<const uint8_t> payload);
+
+  std::unique_ptr<MeiTransport> inner_;
+  FILE *trace_;
+  absl::Time start_;
+  // A kDisconnect is owed when the connection ends.
+  bool connected_ = false;
+};
+
+// class MeiReplayer
+// Plays the ME side of a trace: Connect() returns the properties of the
+// next recorded connection, and Read() returns the recorded messages from
+// the ME once they are due, at speed times the original pace (0 for no
+// delay). Writes are accepted and discarded. The connection is lost where
+// the recording lost it, and Connect() fails once the trace is exhausted.
+// Channel ids in the trace only match if the host opens channels in the
+// same order as when recording.
+class MeiReplayer : public MeiTransport {
+public:
+  MeiReplayer(const std::string &trace_path, double speed);
+  ~MeiReplayer() override;
+
+  bool Connect(const uuid_le &client, MeiClientProperties &props) override;
+  void Close() override;
+  ssize_t Read(absl::Span<uint8_t> buf) override;
+  ssize_t Write(absl::Span<const uint8_t> data) override;
+  // A timerfd, readable when the next message is due.
+  int fd() const override { return connected_ ? timer_fd_ : -1; }
+
+  // Messages written to the replayer and recorded as written.
+  uint64_t writes() const { return writes_; }
+  uint64_t recorded_writes() const { return recorded_writes_; }
+
+private:
+  struct Record {
+    MeiTraceRecord kind;
+    absl::Duration time;
+    std::string payload;
+  };
+
+  absl::Time DueTime(const Record &record) const;
+  // Arm timer_fd_ for the next kRead record, if any.
+  void ArmTimer();
+
+  std::vector<Record> records_;
+  size_t next_ = 0;
+  double speed_;
+  int timer_fd_;
+  bool connected_ = false;
+  // Trace time of the kConnect record and when it was replayed.
+  absl::Duration trace_base_;
+  absl::Time replay_base_;
+  uint64_t writes_ = 0;
+  uint64_t recorded_writes_ = 0;
+};
+
+} // namespace amt
+
+#endif // __MEI_TRANSPORT_H__
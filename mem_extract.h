@@ -4,6 +4,7 @@
 #include <absl/types/span.h>
 #include <cinttypes>
 #include <cstring>
+#include <type_traits>
 
 namespace amt {
 void ExtractRaw(void *to, absl::Span<uint8_t> from) {
@@ -11,7 +12,7 @@ void ExtractRaw(void *to, absl::Span<uint8_t> from) {
 }
 
 template <typename T> void Extract(T *to, absl::Span<uint8_t> from) {
-  static_assert(std::is_pod<T>::value == true);
+  static_assert(std::is_trivially_copyable_v<T>);
   die_if(sizeof(T) != from.size(), "size mismatch");
   ExtractRaw(to, from);
 }
@@ -31,7 +32,7 @@ void FillRaw(absl::Span<uint8_t> to, const void *from) {
 }
 
 template <typename T> void Fill(absl::Span<uint8_t> to, const T &from) {
-  static_assert(std::is_pod<T>::value == true);
+  static_assert(std::is_trivially_copyable_v<T>);
   die_if(sizeof(T) != to.size(), "size mismatch");
   FillRaw(to, &from);
 }
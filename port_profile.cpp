@@ -0,0 +1,109 @@
+#include "port_profile.h"
+
+#include <vector>
+
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_format.h>
+#include <absl/strings/str_split.h>
+
+namespace amt {
+
+std::string PortProfile::ToString() const {
+  return absl::StrFormat("window=%u read_chunk=%u cork=%s weight=%u nodelay=%d "
+                         "rcvbuf=%d sndbuf=%d backlog=%d rate=%g burst=%u queue=%u",
+                         window, read_chunk, absl::FormatDuration(cork_delay), weight,
+                         nodelay, rcvbuf, sndbuf, backlog, conn_rate, conn_burst,
+                         conn_queue);
+}
+
+std::optional<PortProfile> PortProfilePreset(absl::string_view name) {
+  PortProfile profile;
+  if (name == "default") {
+    return profile;
+  }
+  if (name == "latency") {
+    // WS-MAN: small requests, responses up to a few frames.
+    profile.window = 16384;
+    profile.weight = 4;
+    profile.nodelay = true;
+    return profile;
+  }
+  if (name == "throughput") {
+    // KVM, SOL, IDE-R: long lived streams.
+    profile.window = 65536;
+    profile.read_chunk = kMaxReadChunk;
+    profile.cork_delay = absl::Milliseconds(1);
+    profile.rcvbuf = 256 * 1024;
+    profile.sndbuf = 256 * 1024;
+    profile.backlog = 64;
+    return profile;
+  }
+  return std::nullopt;
+}
+
+PortProfile DefaultPortProfile(uint32_t port) {
+  switch (port) {
+  case 5900:
+  case 16994:
+  case 16995:
+    return *PortProfilePreset("throughput");
+  case 16992:
+  case 16993:
+    return *PortProfilePreset("latency");
+  default:
+    return PortProfile{};
+  }
+}
+
+bool ParsePortProfile(absl::string_view spec, uint32_t &port, PortProfile &profile) {
+  std::vector<absl::string_view> parts = absl::StrSplit(spec, ':');
+  if (!absl::SimpleAtoi(parts[0], &port) || port > 65535) {
+    return false;
+  }
+  profile = DefaultPortProfile(port);
+  for (size_t i = 1; i < parts.size(); i++) {
+    std::pair<absl::string_view, absl::string_view> kv =
+        absl::StrSplit(parts[i], absl::MaxSplits('=', 1));
+    const auto &[key, value] = kv;
+    bool ok = true;
+    if (i == 1 && value.empty()) {
+      std::optional<PortProfile> preset = PortProfilePreset(key);
+      ok = preset.has_value();
+      if (ok) {
+        profile = *preset;
+      }
+    } else if (key == "window") {
+      ok = absl::SimpleAtoi(value, &profile.window) && profile.window > 0;
+    } else if (key == "read_chunk") {
+      ok = absl::SimpleAtoi(value, &profile.read_chunk) && profile.read_chunk > 0 &&
+           profile.read_chunk <= kMaxReadChunk;
+    } else if (key == "cork") {
+      ok = absl::ParseDuration(value, &profile.cork_delay) &&
+           profile.cork_delay >= absl::ZeroDuration();
+    } else if (key == "weight") {
+      ok = absl::SimpleAtoi(value, &profile.weight) && profile.weight > 0;
+    } else if (key == "nodelay") {
+      ok = absl::SimpleAtob(value, &profile.nodelay);
+    } else if (key == "rcvbuf") {
+      ok = absl::SimpleAtoi(value, &profile.rcvbuf) && profile.rcvbuf >= 0;
+    } else if (key == "sndbuf") {
+      ok = absl::SimpleAtoi(value, &profile.sndbuf) && profile.sndbuf >= 0;
+    } else if (key == "backlog") {
+      ok = absl::SimpleAtoi(value, &profile.backlog) && profile.backlog > 0;
+    } else if (key == "rate") {
+      ok = absl::SimpleAtod(value, &profile.conn_rate) && profile.conn_rate >= 0;
+    } else if (key == "burst") {
+      ok = absl::SimpleAtoi(value, &profile.conn_burst) && profile.conn_burst > 0;
+    } else if (key == "queue") {
+      ok = absl::SimpleAtoi(value, &profile.conn_queue);
+    } else {
+      ok = false;
+    }
+    if (!ok) {
+      return false;
+    }
+  }
+  return true;
+}
+
+} // namespace amt
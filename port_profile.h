@@ -0,0 +1,54 @@
+#ifndef __PORT_PROFILE_H__
+#define __PORT_PROFILE_H__
+
+#include <cinttypes>
+#include <optional>
+#include <string>
+
+#include <absl/strings/string_view.h>
+#include <absl/time/time.h>
+
+namespace amt {
+
+// struct PortProfile
+// Tuning of the channels on a forwarded port and of their client sockets.
+// The defaults are apfd's behavior without a profile.
+struct PortProfile {
+  // APF window offered to ME, i.e. how much ME can send ahead.
+  uint32_t window = 4096;
+  // Bytes read from the client at a time.
+  uint32_t read_chunk = 4096;
+  // Max time small writes to ME are held back, 0 to disable.
+  absl::Duration cork_delay;
+  // Frames per turn while the MEI queue is full.
+  uint32_t weight = 1;
+  bool nodelay = false;
+  // 0 keeps the kernel default.
+  int rcvbuf = 0;
+  int sndbuf = 0;
+  int backlog = 4096;
+  // New connections per second from each source (peer address, or uid on
+  // unix sockets), 0 for no limit. Up to conn_burst at once, then up to
+  // conn_queue are delayed and the others rejected.
+  double conn_rate = 0;
+  uint32_t conn_burst = 10;
+  uint32_t conn_queue = 16;
+
+  std::string ToString() const;
+};
+
+constexpr uint32_t kMaxReadChunk = 65536;
+
+// "default", "latency" or "throughput".
+std::optional<PortProfile> PortProfilePreset(absl::string_view name);
+// throughput for KVM (5900) and SOL/IDE-R (16994, 16995), latency for
+// WS-MAN (16992, 16993), default for the others.
+PortProfile DefaultPortProfile(uint32_t port);
+// Parses an --allowed_ports entry: port[:preset][:key=value]...
+// e.g. 5900:latency:window=8192. Keys are the PortProfile fields, the
+// preset defaults to DefaultPortProfile(port).
+bool ParsePortProfile(absl::string_view spec, uint32_t &port, PortProfile &profile);
+
+} // namespace amt
+
+#endif // __PORT_PROFILE_H__
@@ -0,0 +1,85 @@
+#include "rate_limiter.h"
+
+#include <algorithm>
+
+namespace amt {
+
+RateLimiter::Decision RateLimiter::Admit(const std::string &source, const Limit &limit,
+                                         absl::Time now) {
+  if (limit.rate <= 0) {
+    stats_.accepted++;
+    return {Decision::kAccept, absl::ZeroDuration()};
+  }
+  if (now - last_sweep_ >= kSweepInterval) {
+    Sweep(now);
+  }
+  auto [it, inserted] = buckets_.try_emplace(source);
+  Bucket &bucket = it->second;
+  if (inserted) {
+    bucket.tokens = limit.burst;
+    bucket.updated = now;
+  }
+  // For Sweep().
+  bucket.limit = limit;
+  bucket.tokens = std::min<double>(
+      bucket.tokens + absl::ToDoubleSeconds(now - bucket.updated) * limit.rate,
+      limit.burst);
+  bucket.updated = now;
+
+  if (bucket.tokens >= 1) {
+    bucket.tokens -= 1;
+    stats_.accepted++;
+    return {Decision::kAccept, absl::ZeroDuration()};
+  }
+  if (bucket.queued >= limit.queue) {
+    bucket.rejected++;
+    stats_.rejected++;
+    return {Decision::kReject, absl::ZeroDuration()};
+  }
+  bucket.tokens -= 1;
+  bucket.queued++;
+  queued_++;
+  stats_.delayed++;
+  stats_.queued_peak = std::max(stats_.queued_peak, queued_);
+  return {Decision::kDelay, absl::Seconds(-bucket.tokens / limit.rate)};
+}
+
+void RateLimiter::Dequeue(const std::string &source) {
+  auto it = buckets_.find(source);
+  if (it == buckets_.end() || it->second.queued == 0) {
+    return;
+  }
+  it->second.queued--;
+  queued_--;
+}
+
+std::vector<std::pair<std::string, uint64_t>> RateLimiter::TopRejected(size_t n) const {
+  std::vector<std::pair<std::string, uint64_t>> ret;
+  for (const auto &[source, bucket] : buckets_) {
+    if (bucket.rejected > 0) {
+      ret.emplace_back(source, bucket.rejected);
+    }
+  }
+  std::sort(ret.begin(), ret.end(),
+            [](const auto &a, const auto &b) { return a.second > b.second; });
+  if (ret.size() > n) {
+    ret.resize(n);
+  }
+  return ret;
+}
+
+void RateLimiter::Sweep(absl::Time now) {
+  last_sweep_ = now;
+  for (auto it = buckets_.begin(); it != buckets_.end();) {
+    const Bucket &bucket = it->second;
+    double tokens = bucket.tokens +
+                    absl::ToDoubleSeconds(now - bucket.updated) * bucket.limit.rate;
+    if (bucket.queued == 0 && tokens >= bucket.limit.burst) {
+      it = buckets_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+} // namespace amt
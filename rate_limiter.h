@@ -0,0 +1,75 @@
+#ifndef __RATE_LIMITER_H__
+#define __RATE_LIMITER_H__
+
+#include <cinttypes>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <absl/time/time.h>
+
+namespace amt {
+
+// class RateLimiter
+// Token buckets of new connections, keyed by source, e.g. the forwarded
+// port and the peer address. A bucket holds up to burst tokens and refills
+// at rate per second. Past the burst, up to queue connections per source
+// are delayed until their token refills: the token is taken right away,
+// so the bucket goes negative and later connections wait behind them.
+// Anything beyond that is rejected.
+class RateLimiter {
+public:
+  struct Limit {
+    // Tokens per second, 0 for no limit.
+    double rate = 0;
+    uint32_t burst = 1;
+    uint32_t queue = 0;
+  };
+  struct Decision {
+    enum Verdict { kAccept, kDelay, kReject };
+    Verdict verdict;
+    // Time to wait on kDelay.
+    absl::Duration delay;
+  };
+  struct Stats {
+    uint64_t accepted = 0;
+    uint64_t delayed = 0;
+    uint64_t rejected = 0;
+    uint64_t queued_peak = 0;
+  };
+
+  Decision Admit(const std::string &source, const Limit &limit, absl::Time now);
+  // A connection delayed by Admit() was started or closed.
+  void Dequeue(const std::string &source);
+
+  const Stats &stats() const { return stats_; }
+  uint64_t queued() const { return queued_; }
+  size_t sources() const { return buckets_.size(); }
+  // Sources with the most rejections, at most n. Counts are dropped with
+  // the bucket once it's full again.
+  std::vector<std::pair<std::string, uint64_t>> TopRejected(size_t n) const;
+
+private:
+  // Full buckets without waiters are dropped this often.
+  static constexpr absl::Duration kSweepInterval = absl::Seconds(10);
+
+  struct Bucket {
+    Limit limit;
+    double tokens;
+    absl::Time updated;
+    uint32_t queued = 0;
+    uint64_t rejected = 0;
+  };
+
+  void Sweep(absl::Time now);
+
+  std::unordered_map<std::string, Bucket> buckets_;
+  absl::Time last_sweep_ = absl::InfinitePast();
+  uint64_t queued_ = 0;
+  Stats stats_;
+};
+
+} // namespace amt
+
+#endif // __RATE_LIMITER_H__
@@ -0,0 +1,83 @@
+#include "send_pacer.h"
+
+#include <algorithm>
+
+namespace amt {
+namespace {
+
+constexpr uint32_t kInitialFrames = 4;
+constexpr uint32_t kMinFrames = 2;
+constexpr uint32_t kMaxCwnd = 16 << 20;
+
+} // namespace
+
+SendPacer::SendPacer(uint32_t frame) : frame_(frame), cwnd_(kInitialFrames * frame) {}
+
+double SendPacer::rate() const {
+  if (srtt_ == absl::ZeroDuration()) {
+    return 0;
+  }
+  return kGain * cwnd_ / absl::ToDoubleSeconds(srtt_);
+}
+
+void SendPacer::OnSend(uint32_t len, absl::Time now) {
+  sent_ += len;
+  samples_.push_back(Sample{.end = sent_, .time = now});
+  double r = rate();
+  if (r > 0) {
+    next_send_ = std::max(next_send_, now - kBurst) + absl::Seconds(len / r);
+  }
+}
+
+void SendPacer::OnWindowAdjust(uint32_t bytes, absl::Time now) {
+  acked_ += bytes;
+  // The last frame fully returned by this adjust.
+  absl::Time sent = absl::InfinitePast();
+  while (!samples_.empty() && samples_.front().end <= acked_) {
+    sent = samples_.front().time;
+    samples_.pop_front();
+  }
+  if (sent == absl::InfinitePast()) {
+    return;
+  }
+
+  absl::Duration rtt = now - sent;
+  rtt_samples_++;
+  srtt_ = srtt_ == absl::ZeroDuration() ? rtt : (srtt_ * 7 + rtt) / 8;
+  if (rtt < min_rtt_ || now - min_rtt_time_ > kMinRttExpiry) {
+    min_rtt_ = rtt;
+    min_rtt_time_ = now;
+  }
+
+  // Sub-millisecond jitter is not queueing.
+  if (rtt > min_rtt_ * 2 + kBurst) {
+    Backoff(now);
+    return;
+  }
+  if (cwnd_ < ssthresh_) {
+    cwnd_ = std::min(cwnd_ + bytes, kMaxCwnd);
+    return;
+  }
+  acked_since_increase_ += bytes;
+  if (acked_since_increase_ >= cwnd_) {
+    acked_since_increase_ -= cwnd_;
+    cwnd_ = std::min(cwnd_ + frame_, kMaxCwnd);
+  }
+}
+
+void SendPacer::OnStall(absl::Time now) {
+  stalls_++;
+  Backoff(now);
+}
+
+void SendPacer::Backoff(absl::Time now) {
+  if (now - last_backoff_ < srtt_) {
+    return;
+  }
+  last_backoff_ = now;
+  ssthresh_ = std::max(cwnd_ / 10 * 7, kMinFrames * frame_);
+  cwnd_ = ssthresh_;
+  acked_since_increase_ = 0;
+}
+
+} // namespace amt
@@ -0,0 +1,80 @@
+#ifndef __SEND_PACER_H__
+#define __SEND_PACER_H__
+
+#include <cinttypes>
+#include <deque>
+
+#include <absl/time/time.h>
+
+namespace amt {
+
+// class SendPacer
+// Rate controller for the host to ME direction of a channel.
+// The round trip is measured from sending a ChannelData frame to the
+// ApfChannelWindowAdjust that returns its last byte, as ME adjusts the
+// window once it has consumed the data. A congestion window grows like
+// TCP slow start / congestion avoidance while the round trip stays close
+// to the minimum seen, and is cut when it grows past twice the minimum
+// (ME is queueing) or the window stalls. Frames are spread out at
+// kGain * cwnd / srtt, no pacing until the first round trip is measured.
+class SendPacer {
+public:
+  // Sending is allowed to catch up this far, the caller's timers fire at
+  // this resolution.
+  static constexpr absl::Duration kBurst = absl::Milliseconds(1);
+
+  // frame: max ChannelData payload, the unit of the congestion window.
+  explicit SendPacer(uint32_t frame);
+
+  // Time the next frame may be sent.
+  absl::Time next_send() const { return next_send_; }
+  void OnSend(uint32_t len, absl::Time now);
+  void OnWindowAdjust(uint32_t bytes, absl::Time now);
+  // The send window ran out with data pending.
+  void OnStall(absl::Time now);
+
+  // Bytes per second, 0 while not pacing.
+  double rate() const;
+  absl::Duration srtt() const { return srtt_; }
+  absl::Duration min_rtt() const { return min_rtt_; }
+  uint32_t cwnd() const { return cwnd_; }
+  uint64_t stalls() const { return stalls_; }
+  uint64_t rtt_samples() const { return rtt_samples_; }
+
+private:
+  static constexpr double kGain = 1.25;
+  // The minimum round trip is forgotten after this long, e.g. when the
+  // ME gets busy with another channel for good.
+  static constexpr absl::Duration kMinRttExpiry = absl::Seconds(10);
+
+  // Cut the window at most once per round trip.
+  void Backoff(absl::Time now);
+
+  uint32_t frame_;
+  uint32_t cwnd_;
+  uint32_t ssthresh_ = UINT32_MAX;
+  // Fraction of a frame towards the next congestion avoidance increase.
+  uint64_t acked_since_increase_ = 0;
+
+  // Bytes sent and returned by window adjusts since the channel opened.
+  uint64_t sent_ = 0;
+  uint64_t acked_ = 0;
+  // Frames in flight: end offset in sent_ and when they were sent.
+  struct Sample {
+    uint64_t end;
+    absl::Time time;
+  };
+  std::deque<Sample> samples_;
+
+  absl::Duration srtt_;
+  absl::Duration min_rtt_ = absl::InfiniteDuration();
+  absl::Time min_rtt_time_;
+  absl::Time last_backoff_ = absl::InfinitePast();
+  absl::Time next_send_ = absl::InfinitePast();
+  uint64_t stalls_ = 0;
+  uint64_t rtt_samples_ = 0;
+};
+
+} // namespace amt
+
+#endif // __SEND_PACER_H__
@@ -0,0 +1,187 @@
+#include "single_flight.h"
+
+#include <algorithm>
+
+#include <absl/strings/ascii.h>
+#include <absl/strings/match.h>
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_split.h>
+
+namespace amt {
+namespace {
+
+void Append(std::string &s, absl::Span<const uint8_t> data) {
+  s.append(reinterpret_cast<const char *>(data.data()), data.size());
+}
+
+} // namespace
+
+//
+// DedupStream
+//
+
+DedupStream::Verdict DedupStream::OnRequestData(absl::Span<const uint8_t> data) {
+  if (passthrough_) {
+    return Verdict::kPassthrough;
+  }
+  Append(buffer_, data);
+  request_framer_.Feed(data, request_handler_);
+  // More than one request, or the start of the next one, is pipelining.
+  if (request_framer_.broken() || buffer_.size() > kMaxRequest || requests_ > 1 ||
+      (requests_ == 1 && !request_framer_.idle())) {
+    passthrough_ = true;
+  }
+  if (passthrough_) {
+    return Verdict::kPassthrough;
+  }
+  return requests_ == 1 ? Verdict::kRequest : Verdict::kPartial;
+}
+
+std::string DedupStream::TakeBuffered() {
+  requests_ = 0;
+  std::string buffered = std::move(buffer_);
+  buffer_.clear();
+  return buffered;
+}
+
+void DedupStream::OnResponseData(absl::Span<const uint8_t> data) {
+  response_framer_.Feed(data, response_handler_);
+}
+
+bool DedupStream::RequestHandler::OnHead(absl::string_view head) {
+  // The client waits for 100 Continue before sending the body, and a
+  // response to HEAD has no body regardless of headers.
+  if (absl::StartsWith(head, "HEAD ") ||
+      absl::StrContains(absl::AsciiStrToLower(head), "100-continue")) {
+    stream_->passthrough_ = true;
+  }
+  return true;
+}
+
+bool DedupStream::ResponseHandler::OnHead(absl::string_view head) {
+  // HTTP/1.1 200 OK
+  std::vector<absl::string_view> start =
+      absl::StrSplit(head.substr(0, head.find("\r\n")), absl::MaxSplits(' ', 2));
+  int status = 0;
+  if (start.size() > 1) {
+    (void)absl::SimpleAtoi(start[1], &status);
+  }
+  interim_ = status >= 100 && status < 200;
+  return !interim_ && status != 204 && status != 304;
+}
+
+void DedupStream::ResponseHandler::OnEnd() {
+  if (!interim_ && stream_->outstanding_ > 0) {
+    stream_->outstanding_--;
+  }
+}
+
+//
+// SingleFlight
+//
+
+SingleFlight::SingleFlight(const std::vector<std::string> &actions,
+                           size_t max_response)
+    : actions_(actions.begin(), actions.end()), max_response_(max_response) {}
+
+bool SingleFlight::Eligible(absl::string_view request) const {
+  if (!absl::StartsWith(request, "POST ")) {
+    return false;
+  }
+  size_t body = request.find("\r\n\r\n");
+  if (body == absl::string_view::npos) {
+    return false;
+  }
+  absl::string_view action = ExtractXmlElement(request.substr(body + 4), "Action");
+  return actions_.count(std::string(action)) > 0;
+}
+
+SingleFlight::Role SingleFlight::Join(uint32_t port, absl::string_view request,
+                                      uint32_t channel_id) {
+  std::string key = absl::StrCat(port, " ", request);
+  if (auto it = leader_by_key_.find(key); it != leader_by_key_.end()) {
+    Flight &flight = *flights_[it->second];
+    if (flight.responding) {
+      return Role::kAlone;
+    }
+    flight.waiters.push_back(channel_id);
+    waiting_[channel_id] = it->second;
+    return Role::kWaiter;
+  }
+  auto flight = std::make_unique<Flight>();
+  flight->key = key;
+  leader_by_key_[std::move(key)] = channel_id;
+  flights_[channel_id] = std::move(flight);
+  stats_.flights++;
+  return Role::kLeader;
+}
+
+std::optional<SingleFlight::Result>
+SingleFlight::OnResponse(uint32_t leader, absl::Span<const uint8_t> data) {
+  auto it = flights_.find(leader);
+  if (it == flights_.end()) {
+    return std::nullopt;
+  }
+  Flight &flight = *it->second;
+  flight.responding = true;
+  size_t len = flight.framer.FeedMessage(data, flight);
+  if (!flight.waiters.empty()) {
+    Append(flight.response, data.subspan(0, len));
+  }
+  if (flight.done) {
+    return Finish(leader, /*success=*/true);
+  }
+  if (flight.response.size() > max_response_) {
+    stats_.oversized++;
+    return Finish(leader, /*success=*/false);
+  }
+  if (flight.framer.broken()) {
+    return Finish(leader, /*success=*/false);
+  }
+  return std::nullopt;
+}
+
+SingleFlight::Result SingleFlight::Abort(uint32_t leader) {
+  if (flights_.find(leader) == flights_.end()) {
+    return {};
+  }
+  return Finish(leader, /*success=*/false);
+}
+
+void SingleFlight::Leave(uint32_t waiter) {
+  auto it = waiting_.find(waiter);
+  if (it == waiting_.end()) {
+    return;
+  }
+  std::vector<uint32_t> &waiters = flights_[it->second]->waiters;
+  waiters.erase(std::remove(waiters.begin(), waiters.end(), waiter), waiters.end());
+  waiting_.erase(it);
+}
+
+void SingleFlight::Clear() {
+  leader_by_key_.clear();
+  flights_.clear();
+  waiting_.clear();
+}
+
+SingleFlight::Result SingleFlight::Finish(uint32_t leader, bool success) {
+  auto it = flights_.find(leader);
+  std::unique_ptr<Flight> flight = std::move(it->second);
+  flights_.erase(it);
+  leader_by_key_.erase(flight->key);
+  for (uint32_t waiter : flight->waiters) {
+    waiting_.erase(waiter);
+  }
+  Result result;
+  result.waiters = std::move(flight->waiters);
+  if (success) {
+    result.response = std::move(flight->response);
+    stats_.coalesced += result.waiters.size();
+  } else {
+    stats_.fallbacks += result.waiters.size();
+  }
+  return result;
+}
+
+} // namespace amt
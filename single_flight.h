@@ -0,0 +1,170 @@
+#ifndef __SINGLE_FLIGHT_H__
+#define __SINGLE_FLIGHT_H__
+
+#include "wsman_profiler.h"
+
+#include <cinttypes>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <absl/strings/string_view.h>
+#include <absl/types/span.h>
+
+namespace amt {
+
+// class DedupStream
+// Per channel state for SingleFlight. Holds the client data back until it
+// is exactly one complete HTTP request, and counts the forwarded requests
+// whose response hasn't been written to the client yet. Gives up on the
+// stream (kPassthrough) if the client pipelines, sends a request larger
+// than kMaxRequest, expects 100-continue or the stream is unparsable.
+class DedupStream {
+public:
+  enum class Verdict {
+    // Keep buffering.
+    kPartial,
+    // The buffered data is one complete request.
+    kRequest,
+    // Forward the buffered data and everything after it as is.
+    kPassthrough,
+  };
+
+  static constexpr size_t kMaxRequest = 65536;
+
+  DedupStream() : request_handler_(this), response_handler_(this) {}
+
+  Verdict OnRequestData(absl::Span<const uint8_t> data);
+  std::string TakeBuffered();
+  // The request returned by TakeBuffered() was forwarded to ME.
+  void RequestSent() { outstanding_++; }
+  // Data from ME written to the client.
+  void OnResponseData(absl::Span<const uint8_t> data);
+  uint32_t outstanding() const { return outstanding_; }
+
+private:
+  class RequestHandler : public HttpFramer::Handler {
+  public:
+    explicit RequestHandler(DedupStream *stream) : stream_(stream) {}
+    bool OnHead(absl::string_view head) override;
+    void OnBody(absl::Span<const uint8_t> data) override {}
+    void OnEnd() override { stream_->requests_++; }
+
+  private:
+    DedupStream *stream_;
+  };
+
+  class ResponseHandler : public HttpFramer::Handler {
+  public:
+    explicit ResponseHandler(DedupStream *stream) : stream_(stream) {}
+    bool OnHead(absl::string_view head) override;
+    void OnBody(absl::Span<const uint8_t> data) override {}
+    void OnEnd() override;
+
+  private:
+    DedupStream *stream_;
+    bool interim_ = false;
+  };
+
+  HttpFramer request_framer_;
+  HttpFramer response_framer_;
+  RequestHandler request_handler_;
+  ResponseHandler response_handler_;
+  std::string buffer_;
+  // Requests ended in buffer_.
+  uint32_t requests_ = 0;
+  uint32_t outstanding_ = 0;
+  bool passthrough_ = false;
+};
+
+// class SingleFlight
+// De-duplicates identical in-flight requests on the same port: the first
+// channel sending a request leads a flight and forwards it to ME, channels
+// sending the same bytes before the first response byte arrives wait for
+// the leader's response, which is then copied to them. If the leader goes
+// away or its response is unusable, the waiters are returned to send their
+// own request instead.
+// Only POST requests with one of the allowed WS-MAN actions are eligible,
+// the caller is responsible for not mixing a flight with other responses
+// on the leader's channel, see DedupStream::outstanding().
+class SingleFlight {
+public:
+  enum class Role {
+    // Send the request, pass the response to OnResponse().
+    kLeader,
+    // Don't send the request, wait for the flight to finish.
+    kWaiter,
+    // An identical request is being answered already, send the request
+    // without leading a flight.
+    kAlone,
+  };
+
+  struct Result {
+    std::vector<uint32_t> waiters;
+    // Complete response for the waiters. Empty if they have to send their
+    // own request.
+    std::string response;
+  };
+
+  struct Stats {
+    uint64_t flights = 0;
+    // Requests answered with a leader's response.
+    uint64_t coalesced = 0;
+    // Waiters which had to send their own request.
+    uint64_t fallbacks = 0;
+    // Flights aborted for a response larger than max_response.
+    uint64_t oversized = 0;
+  };
+
+  SingleFlight(const std::vector<std::string> &actions, size_t max_response);
+
+  bool Eligible(absl::string_view request) const;
+  Role Join(uint32_t port, absl::string_view request, uint32_t channel_id);
+  // Data from ME written to the leader's client. Returns the result once
+  // the response is complete or the flight is aborted.
+  std::optional<Result> OnResponse(uint32_t leader, absl::Span<const uint8_t> data);
+  // The leader is gone before its response completed.
+  Result Abort(uint32_t leader);
+  // A waiter is gone.
+  void Leave(uint32_t waiter);
+  // Drop all flights without results, e.g. when ME disconnects.
+  void Clear();
+
+  const Stats &stats() const { return stats_; }
+
+private:
+  struct Flight : public HttpFramer::Handler {
+    bool OnHead(absl::string_view head) override { return true; }
+    void OnBody(absl::Span<const uint8_t> data) override {}
+    void OnEnd() override { done = true; }
+
+    std::string key;
+    std::vector<uint32_t> waiters;
+    HttpFramer framer;
+    // Copied only while there are waiters, who can't join after the
+    // first byte.
+    std::string response;
+    bool responding = false;
+    bool done = false;
+  };
+
+  // Removes the flight and returns the result for its waiters.
+  Result Finish(uint32_t leader, bool success);
+
+  std::unordered_set<std::string> actions_;
+  size_t max_response_;
+  // Key is port and request bytes.
+  std::unordered_map<std::string, uint32_t> leader_by_key_;
+  // Key is the leader's channel id.
+  std::unordered_map<uint32_t, std::unique_ptr<Flight>> flights_;
+  // waiter to leader
+  std::unordered_map<uint32_t, uint32_t> waiting_;
+  Stats stats_;
+};
+
+} // namespace amt
+
+#endif // __SINGLE_FLIGHT_H__
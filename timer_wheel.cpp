@@ -0,0 +1,127 @@
+#include "timer_wheel.h"
+#include "die.h"
+
+namespace amt {
+
+TimerWheel::TimerWheel(absl::Duration resolution, absl::Time now)
+    : resolution_(resolution), start_(now) {
+  die_if(resolution_ <= absl::ZeroDuration(), "bad timer resolution");
+}
+
+TimerWheel::TimerId TimerWheel::Arm(absl::Duration delay,
+                                    std::function<void()> callback) {
+  int64_t ticks = absl::Ceil(delay, resolution_) / resolution_;
+  if (ticks <= 0) {
+    ticks = 1;
+  }
+
+  TimerId id = next_id_++;
+  Timer &timer = timers_[id];
+  timer.expiry_tick = now_tick_ + ticks;
+  timer.callback = std::move(callback);
+  Insert(id, timer);
+  return id;
+}
+
+void TimerWheel::Cancel(TimerId id) {
+  auto it = timers_.find(id);
+  if (it == timers_.end()) {
+    return;
+  }
+  slots_[it->second.level][it->second.slot].erase(it->second.pos);
+  timers_.erase(it);
+}
+
+void TimerWheel::Advance(absl::Time now) {
+  const uint64_t target = ToTick(now);
+  while (now_tick_ < target) {
+    if (timers_.empty()) {
+      now_tick_ = target;
+      return;
+    }
+    now_tick_++;
+
+    // Cascade from the lowest level, stop at the first level not wrapping.
+    for (int level = 1; level < kLevels; level++) {
+      if ((now_tick_ >> (kSlotBits * (level - 1))) & kSlotMask) {
+        break;
+      }
+      Cascade(level);
+    }
+
+    std::list<TimerId> expired;
+    expired.swap(slots_[0][now_tick_ & kSlotMask]);
+    for (TimerId id : expired) {
+      // An earlier callback may have cancelled it.
+      auto it = timers_.find(id);
+      if (it == timers_.end()) {
+        continue;
+      }
+      std::function<void()> callback = std::move(it->second.callback);
+      timers_.erase(it);
+      callback();
+    }
+  }
+}
+
+int TimerWheel::NextTimeoutMs(absl::Time now) const {
+  if (timers_.empty()) {
+    return -1;
+  }
+
+  // Level 0 only holds timers expiring within kSlots ticks, and timers of
+  // upper levels can't expire before the next cascade.
+  uint64_t ticks = kSlots - (now_tick_ & kSlotMask);
+  for (uint64_t i = 1; i < ticks; i++) {
+    if (!slots_[0][(now_tick_ + i) & kSlotMask].empty()) {
+      ticks = i;
+      break;
+    }
+  }
+
+  absl::Time deadline = start_ + resolution_ * static_cast<int64_t>(now_tick_ + ticks);
+  int64_t ms =
+      absl::ToInt64Milliseconds(absl::Ceil(deadline - now, absl::Milliseconds(1)));
+  return ms < 0 ? 0 : static_cast<int>(ms);
+}
+
+uint64_t TimerWheel::ToTick(absl::Time t) const {
+  if (t <= start_) {
+    return 0;
+  }
+  return (t - start_) / resolution_;
+}
+
+void TimerWheel::Insert(TimerId id, Timer &timer) {
+  // Timers cascaded into the current tick are fired right after the cascade.
+  uint64_t expiry = timer.expiry_tick;
+  if (expiry < now_tick_) {
+    expiry = now_tick_;
+  }
+  uint64_t delta = expiry - now_tick_;
+
+  int level = 0;
+  while (level < kLevels - 1 && delta >= (uint64_t{1} << (kSlotBits * (level + 1)))) {
+    level++;
+  }
+  if (level == kLevels - 1 && delta >= (uint64_t{1} << (kSlotBits * kLevels))) {
+    // Beyond the range of the wheel, park in the farthest slot and
+    // re-insert when it cascades.
+    expiry = now_tick_ + (uint64_t{1} << (kSlotBits * kLevels)) - 1;
+  }
+
+  timer.level = level;
+  timer.slot = (expiry >> (kSlotBits * level)) & kSlotMask;
+  std::list<TimerId> &slot = slots_[timer.level][timer.slot];
+  timer.pos = slot.insert(slot.end(), id);
+}
+
+void TimerWheel::Cascade(int level) {
+  std::list<TimerId> timers;
+  timers.swap(slots_[level][(now_tick_ >> (kSlotBits * level)) & kSlotMask]);
+  for (TimerId id : timers) {
+    Insert(id, timers_.at(id));
+  }
+}
+
+} // namespace amt
@@ -0,0 +1,72 @@
+#ifndef __TIMER_WHEEL_H__
+#define __TIMER_WHEEL_H__
+
+#include <cinttypes>
+#include <functional>
+#include <list>
+#include <unordered_map>
+
+#include <absl/time/clock.h>
+#include <absl/time/time.h>
+
+namespace amt {
+
+// class TimerWheel
+// Hierarchical timing wheel with O(1) Arm() and Cancel().
+// The caller drives the wheel by calling Advance() from its event loop,
+// and uses NextTimeoutMs() as the epoll_wait() timeout.
+// Timers are relative to the time of the last Advance().
+class TimerWheel {
+public:
+  // 0 is never a valid id.
+  typedef uint64_t TimerId;
+
+  explicit TimerWheel(absl::Duration resolution, absl::Time now = absl::Now());
+
+  // Run callback after delay. The callback may arm or cancel timers.
+  TimerId Arm(absl::Duration delay, std::function<void()> callback);
+  // No-op if the timer has already fired or been cancelled.
+  void Cancel(TimerId id);
+
+  // Fire all timers expired by now.
+  void Advance(absl::Time now);
+
+  // Milliseconds until Advance() needs to be called again.
+  // -1 if there's no timer.
+  int NextTimeoutMs(absl::Time now) const;
+
+  size_t size() const { return timers_.size(); }
+
+private:
+  static constexpr int kLevels = 4;
+  static constexpr int kSlotBits = 6;
+  static constexpr int kSlots = 1 << kSlotBits;
+  static constexpr uint64_t kSlotMask = kSlots - 1;
+
+  struct Timer {
+    uint64_t expiry_tick;
+    std::function<void()> callback;
+    int level;
+    int slot;
+    std::list<TimerId>::iterator pos;
+  };
+
+  uint64_t ToTick(absl::Time t) const;
+  // Place the timer into a slot according to its distance from now_tick_.
+  void Insert(TimerId id, Timer &timer);
+  // Move timers of the current slot of level down to lower levels.
+  void Cascade(int level);
+
+  absl::Duration resolution_;
+  absl::Time start_;
+  // All ticks up to now_tick_ have been processed.
+  uint64_t now_tick_ = 0;
+  TimerId next_id_ = 1;
+
+  std::unordered_map<TimerId, Timer> timers_;
+  std::list<TimerId> slots_[kLevels][kSlots];
+};
+
+} // namespace amt
+
+#endif // __TIMER_WHEEL_H__
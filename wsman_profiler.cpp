@@ -0,0 +1,329 @@
+#include "wsman_profiler.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <absl/strings/ascii.h>
+#include <absl/strings/match.h>
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_format.h>
+#include <absl/strings/str_split.h>
+#include <absl/strings/strip.h>
+
+namespace amt {
+namespace {
+
+// Action and ResourceURI are in the SOAP header, at the start of the body.
+constexpr size_t kMaxBodyPrefix = 4096;
+constexpr size_t kMaxLine = 1024;
+
+// http://schemas.xmlsoap.org/ws/2004/09/transfer/Get -> Get
+absl::string_view LastSegment(absl::string_view uri) {
+  size_t pos = uri.find_last_of('/');
+  return pos == absl::string_view::npos ? uri : uri.substr(pos + 1);
+}
+
+} // namespace
+
+// e.g. <a:Action s:mustUnderstand="true">text</a:Action>
+absl::string_view ExtractXmlElement(absl::string_view xml, absl::string_view name) {
+  size_t pos = 0;
+  while ((pos = xml.find(name, pos)) != absl::string_view::npos) {
+    size_t end = pos + name.size();
+    bool starts_tag = pos > 0 && (xml[pos - 1] == '<' || xml[pos - 1] == ':');
+    bool ends_name = end < xml.size() && (xml[end] == '>' || xml[end] == ' ');
+    pos = end;
+    if (!starts_tag || !ends_name) {
+      continue;
+    }
+    size_t text_begin = xml.find('>', end);
+    if (text_begin == absl::string_view::npos) {
+      break;
+    }
+    text_begin++;
+    size_t text_end = xml.find('<', text_begin);
+    if (text_end == absl::string_view::npos) {
+      break;
+    }
+    return absl::StripAsciiWhitespace(xml.substr(text_begin, text_end - text_begin));
+  }
+  return {};
+}
+
+//
+// HttpFramer
+//
+
+bool HttpFramer::ReadLine(absl::Span<const uint8_t> &data) {
+  const void *nl = memchr(data.data(), '\n', data.size());
+  size_t len = nl == nullptr ? data.size()
+                             : static_cast<const uint8_t *>(nl) - data.data() + 1;
+  line_.append(reinterpret_cast<const char *>(data.data()), len);
+  data.remove_prefix(len);
+  if (line_.size() > kMaxLine) {
+    state_ = kBroken;
+    return false;
+  }
+  if (nl == nullptr) {
+    return false;
+  }
+  line_ = std::string(absl::StripSuffix(absl::StripSuffix(line_, "\n"), "\r"));
+  return true;
+}
+
+bool HttpFramer::StartBody(Handler &handler) {
+  absl::string_view head(head_);
+  head = absl::StripSuffix(head, "\r\n\r\n");
+  bool chunked = false;
+  uint64_t content_length = 0;
+  std::vector<absl::string_view> lines = absl::StrSplit(head, "\r\n");
+  for (size_t i = 1; i < lines.size(); i++) {
+    std::pair<absl::string_view, absl::string_view> kv =
+        absl::StrSplit(lines[i], absl::MaxSplits(':', 1));
+    absl::string_view name = absl::StripAsciiWhitespace(kv.first);
+    absl::string_view value = absl::StripAsciiWhitespace(kv.second);
+    if (absl::EqualsIgnoreCase(name, "Content-Length")) {
+      if (!absl::SimpleAtoi(value, &content_length)) {
+        return false;
+      }
+    } else if (absl::EqualsIgnoreCase(name, "Transfer-Encoding")) {
+      chunked = absl::StrContains(absl::AsciiStrToLower(value), "chunked");
+    }
+  }
+
+  bool has_body = handler.OnHead(head);
+  head_.clear();
+  if (has_body && chunked) {
+    state_ = kChunkSize;
+  } else if (has_body && content_length > 0) {
+    state_ = kFixedBody;
+    remaining_ = content_length;
+  } else {
+    state_ = kHead;
+    ended_ = true;
+    handler.OnEnd();
+  }
+  return true;
+}
+
+void HttpFramer::Feed(absl::Span<const uint8_t> data, Handler &handler) {
+  Feed(data, handler, /*stop_at_end=*/false);
+}
+
+size_t HttpFramer::FeedMessage(absl::Span<const uint8_t> data, Handler &handler) {
+  return Feed(data, handler, /*stop_at_end=*/true);
+}
+
+size_t HttpFramer::Feed(absl::Span<const uint8_t> data, Handler &handler,
+                        bool stop_at_end) {
+  const size_t size = data.size();
+  ended_ = false;
+  while (!data.empty() && state_ != kBroken && !(stop_at_end && ended_)) {
+    switch (state_) {
+    case kHead: {
+      const void *nl = memchr(data.data(), '\n', data.size());
+      size_t len = nl == nullptr ? data.size()
+                                 : static_cast<const uint8_t *>(nl) - data.data() + 1;
+      head_.append(reinterpret_cast<const char *>(data.data()), len);
+      data.remove_prefix(len);
+      if (head_.size() > kMaxHead) {
+        state_ = kBroken;
+      } else if (head_ == "\r\n") {
+        // Stray CRLF between messages.
+        head_.clear();
+      } else if (absl::EndsWith(head_, "\r\n\r\n") && !StartBody(handler)) {
+        state_ = kBroken;
+      }
+    } break;
+    case kFixedBody:
+    case kChunkData: {
+      size_t len = std::min<uint64_t>(remaining_, data.size());
+      handler.OnBody(data.subspan(0, len));
+      data.remove_prefix(len);
+      remaining_ -= len;
+      if (remaining_ == 0 && state_ == kFixedBody) {
+        state_ = kHead;
+        ended_ = true;
+        handler.OnEnd();
+      } else if (remaining_ == 0) {
+        state_ = kChunkDataEnd;
+        remaining_ = 2;
+      }
+    } break;
+    case kChunkDataEnd: {
+      size_t len = std::min<uint64_t>(remaining_, data.size());
+      data.remove_prefix(len);
+      remaining_ -= len;
+      if (remaining_ == 0) {
+        state_ = kChunkSize;
+      }
+    } break;
+    case kChunkSize:
+      if (ReadLine(data)) {
+        absl::string_view size = line_;
+        size = size.substr(0, size.find(';'));
+        if (!absl::SimpleHexAtoi(absl::StripAsciiWhitespace(size), &remaining_)) {
+          state_ = kBroken;
+        } else {
+          state_ = remaining_ == 0 ? kTrailer : kChunkData;
+        }
+        line_.clear();
+      }
+      break;
+    case kTrailer:
+      if (ReadLine(data)) {
+        if (line_.empty()) {
+          state_ = kHead;
+          ended_ = true;
+        handler.OnEnd();
+        }
+        line_.clear();
+      }
+      break;
+    case kBroken:
+      break;
+    }
+  }
+  return size - data.size();
+}
+
+//
+// WsmanProfiler::Stream
+//
+
+void WsmanProfiler::Stream::OnRequestData(absl::Span<const uint8_t> data,
+                                          absl::Time now) {
+  now_ = now;
+  if (request_framer_.idle()) {
+    request_start_ = now;
+  }
+  request_framer_.Feed(data, request_handler_);
+}
+
+void WsmanProfiler::Stream::OnResponseData(absl::Span<const uint8_t> data,
+                                           absl::Time now) {
+  now_ = now;
+  if (response_framer_.idle() && !data.empty() && !requests_.empty() &&
+      requests_.front().first_response == absl::InfinitePast()) {
+    requests_.front().first_response = now;
+  }
+  response_framer_.Feed(data, response_handler_);
+}
+
+void WsmanProfiler::Stream::SetStalled(bool stalled, absl::Time now) {
+  if (stalled) {
+    if (stalled_since_ == absl::InfinitePast()) {
+      stalled_since_ = now;
+    }
+    return;
+  }
+  if (stalled_since_ == absl::InfinitePast()) {
+    return;
+  }
+  for (Request &request : requests_) {
+    if (request.sent != absl::InfinitePast()) {
+      continue;
+    }
+    request.stall += now - stalled_since_;
+    if (request.uploaded) {
+      request.sent = now;
+    }
+  }
+  stalled_since_ = absl::InfinitePast();
+}
+
+bool WsmanProfiler::Stream::RequestHandler::OnHead(absl::string_view head) {
+  // POST /wsman HTTP/1.1
+  std::vector<absl::string_view> start = absl::StrSplit(
+      head.substr(0, head.find("\r\n")), absl::MaxSplits(' ', 2));
+  Request request;
+  request.method = std::string(start[0]);
+  request.key = absl::StrFormat("HTTP %s %s", start[0], start.size() > 1 ? start[1] : "");
+  request.start = stream_->request_start_;
+  // Pipelined requests in the same read.
+  stream_->request_start_ = stream_->now_;
+  stream_->requests_.push_back(std::move(request));
+  return true;
+}
+
+void WsmanProfiler::Stream::RequestHandler::OnBody(absl::Span<const uint8_t> data) {
+  std::string &body = stream_->requests_.back().body;
+  size_t len = std::min(data.size(), kMaxBodyPrefix - body.size());
+  body.append(reinterpret_cast<const char *>(data.data()), len);
+}
+
+void WsmanProfiler::Stream::RequestHandler::OnEnd() {
+  Request &request = stream_->requests_.back();
+  absl::string_view action = ExtractXmlElement(request.body, "Action");
+  if (!action.empty()) {
+    absl::string_view resource = ExtractXmlElement(request.body, "ResourceURI");
+    request.key = absl::StrFormat("%s %s", LastSegment(action), LastSegment(resource));
+  }
+  request.body = std::string();
+  request.uploaded = true;
+  if (stream_->stalled_since_ == absl::InfinitePast()) {
+    request.sent = stream_->now_;
+  }
+}
+
+bool WsmanProfiler::Stream::ResponseHandler::OnHead(absl::string_view head) {
+  // HTTP/1.1 200 OK
+  std::vector<absl::string_view> start =
+      absl::StrSplit(head.substr(0, head.find("\r\n")), absl::MaxSplits(' ', 2));
+  int status = 0;
+  if (start.size() > 1) {
+    (void)absl::SimpleAtoi(start[1], &status);
+  }
+  interim_ = status >= 100 && status < 200;
+  if (interim_ || status == 204 || status == 304) {
+    return false;
+  }
+  return stream_->requests_.empty() || stream_->requests_.front().method != "HEAD";
+}
+
+void WsmanProfiler::Stream::ResponseHandler::OnEnd() {
+  if (interim_ || stream_->requests_.empty()) {
+    return;
+  }
+  Request request = std::move(stream_->requests_.front());
+  stream_->requests_.pop_front();
+  absl::Time now = stream_->now_;
+  // The response may come before the upload finishes, e.g. 401.
+  absl::Time sent = request.sent == absl::InfinitePast() ? now : request.sent;
+  absl::Time first_response =
+      request.first_response == absl::InfinitePast() ? now : request.first_response;
+  stream_->profiler_->Record(request.key, now - request.start,
+                             std::max(first_response - sent, absl::ZeroDuration()),
+                             request.stall);
+}
+
+//
+// WsmanProfiler
+//
+
+void WsmanProfiler::Record(const std::string &key, absl::Duration total,
+                           absl::Duration me_wait, absl::Duration stall) {
+  ActionStats &stats = actions_[key];
+  stats.total.Add(total);
+  stats.me_wait.Add(me_wait);
+  stats.stall.Add(stall);
+}
+
+std::string WsmanProfiler::Dump() const {
+  std::string ret = absl::StrFormat("%-48s %7s %9s %9s %9s %9s %9s %9s\n", "action",
+                                    "count", "p50", "p99", "max", "wait_p50",
+                                    "wait_p99", "stall_p99");
+  for (const auto &[key, stats] : actions_) {
+    absl::StrAppendFormat(
+        &ret, "%-48s %7u %9s %9s %9s %9s %9s %9s\n", key, stats.total.count(),
+        absl::FormatDuration(stats.total.Percentile(50)),
+        absl::FormatDuration(stats.total.Percentile(99)),
+        absl::FormatDuration(stats.total.max()),
+        absl::FormatDuration(stats.me_wait.Percentile(50)),
+        absl::FormatDuration(stats.me_wait.Percentile(99)),
+        absl::FormatDuration(stats.stall.Percentile(99)));
+  }
+  return ret;
+}
+
+} // namespace amt
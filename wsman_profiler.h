@@ -0,0 +1,161 @@
+#ifndef __WSMAN_PROFILER_H__
+#define __WSMAN_PROFILER_H__
+
+#include "histogram.h"
+
+#include <cinttypes>
+#include <deque>
+#include <map>
+#include <string>
+
+#include <absl/strings/string_view.h>
+#include <absl/time/time.h>
+#include <absl/types/span.h>
+
+namespace amt {
+
+// class HttpFramer
+// Finds HTTP/1.1 message boundaries in a byte stream, without copying the
+// body. Handles Content-Length and chunked bodies. The head is buffered
+// up to kMaxHead bytes, the framer gives up on the stream past that.
+class HttpFramer {
+public:
+  class Handler {
+  public:
+    virtual ~Handler() = default;
+    // head: start line and headers, without the final empty line.
+    // Returns false if the message has no body regardless of headers,
+    // e.g. a response to HEAD.
+    virtual bool OnHead(absl::string_view head) = 0;
+    virtual void OnBody(absl::Span<const uint8_t> data) = 0;
+    virtual void OnEnd() = 0;
+  };
+
+  static constexpr size_t kMaxHead = 8192;
+
+  void Feed(absl::Span<const uint8_t> data, Handler &handler);
+  // Like Feed(), but stops after the end of a message. Returns the number
+  // of bytes consumed.
+  size_t FeedMessage(absl::Span<const uint8_t> data, Handler &handler);
+  // Unparsable stream, all further data is ignored.
+  bool broken() const { return state_ == kBroken; }
+  // Between messages.
+  bool idle() const { return state_ == kHead && head_.empty(); }
+
+private:
+  enum State {
+    kHead,
+    kFixedBody,
+    kChunkSize,
+    kChunkData,
+    kChunkDataEnd,
+    kTrailer,
+    kBroken,
+  };
+
+  size_t Feed(absl::Span<const uint8_t> data, Handler &handler, bool stop_at_end);
+  // Returns false if the head is invalid.
+  bool StartBody(Handler &handler);
+  // Consume a CRLF terminated line into line_, returns true once complete.
+  bool ReadLine(absl::Span<const uint8_t> &data);
+
+  State state_ = kHead;
+  std::string head_;
+  std::string line_;
+  uint64_t remaining_ = 0;
+  // A message ended during the current Feed().
+  bool ended_ = false;
+};
+
+// Text of the first element named name, with any namespace prefix, e.g.
+// the WS-Addressing Action of a SOAP envelope. Empty if not found.
+absl::string_view ExtractXmlElement(absl::string_view xml, absl::string_view name);
+
+// class WsmanProfiler
+// Latency of WS-MAN requests per Action and ResourceURI, measured by
+// observing the plaintext HTTP traffic of channels.
+// For each request it records:
+//   total:   first request byte to last response byte.
+//   me_wait: request fully sent to ME to first response byte.
+//   stall:   time the request upload was blocked by the APF window.
+class WsmanProfiler {
+public:
+  // Per channel observer. The caller passes the data read from the client
+  // to OnRequestData() and the data written to the client to
+  // OnResponseData(), and reports when APF blocks the channel.
+  class Stream {
+  public:
+    explicit Stream(WsmanProfiler *profiler)
+        : profiler_(profiler), request_handler_(this), response_handler_(this) {}
+
+    void OnRequestData(absl::Span<const uint8_t> data, absl::Time now);
+    void OnResponseData(absl::Span<const uint8_t> data, absl::Time now);
+    void SetStalled(bool stalled, absl::Time now);
+
+  private:
+    struct Request {
+      std::string method;
+      std::string key;
+      absl::Time start;
+      // InfinitePast until the upload is complete.
+      absl::Time sent = absl::InfinitePast();
+      absl::Time first_response = absl::InfinitePast();
+      absl::Duration stall;
+      // Body prefix, for Action and ResourceURI.
+      std::string body;
+      bool uploaded = false;
+    };
+
+    class RequestHandler : public HttpFramer::Handler {
+    public:
+      explicit RequestHandler(Stream *stream) : stream_(stream) {}
+      bool OnHead(absl::string_view head) override;
+      void OnBody(absl::Span<const uint8_t> data) override;
+      void OnEnd() override;
+
+    private:
+      Stream *stream_;
+    };
+
+    class ResponseHandler : public HttpFramer::Handler {
+    public:
+      explicit ResponseHandler(Stream *stream) : stream_(stream) {}
+      bool OnHead(absl::string_view head) override;
+      void OnBody(absl::Span<const uint8_t> data) override {}
+      void OnEnd() override;
+
+    private:
+      Stream *stream_;
+      bool interim_ = false;
+    };
+
+    WsmanProfiler *profiler_;
+    HttpFramer request_framer_;
+    HttpFramer response_framer_;
+    RequestHandler request_handler_;
+    ResponseHandler response_handler_;
+    // In request order, the front one is being answered.
+    std::deque<Request> requests_;
+    absl::Time now_;
+    // First byte of the request whose head is being read.
+    absl::Time request_start_;
+    absl::Time stalled_since_ = absl::InfinitePast();
+  };
+
+  void Record(const std::string &key, absl::Duration total, absl::Duration me_wait,
+              absl::Duration stall);
+  // Table of all actions, sorted by key.
+  std::string Dump() const;
+
+private:
+  struct ActionStats {
+    LatencyHistogram total;
+    LatencyHistogram me_wait;
+    LatencyHistogram stall;
+  };
+  std::map<std::string, ActionStats> actions_;
+};
+
+} // namespace amt
+
+#endif // __WSMAN_PROFILER_H__